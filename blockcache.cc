@@ -0,0 +1,98 @@
+#include "blockcache.h"
+#include <assert.h>
+#include <stdlib.h>
+
+BlockCache::BlockCache(uint64_t capacity) :capacity(capacity), hits(0), misses(0) {
+    static_assert(CACHE_SHARDS == 64, "shardOf uses the top 6 hash bits");
+    shards = new shard[CACHE_SHARDS];
+    auto frames = capacity / CACHE_PAGE_SIZE / CACHE_SHARDS;
+    for (auto i=0; i<CACHE_SHARDS; i++) {
+        auto &s = shards[i];
+        s.frames = frames;
+        s.used = 0;
+        s.hand = 0;
+        s.pages = nullptr;
+        if (frames) {
+            auto r = posix_memalign(reinterpret_cast<void **>(&s.pages), ALIGN_SIZE, frames*CACHE_PAGE_SIZE);
+            assert(r == 0);
+            s.keys.resize(frames);
+            s.ref.resize(frames);
+            s.index.reserve(frames);
+        }
+    }
+}
+
+BlockCache::~BlockCache() {
+    for (auto i=0; i<CACHE_SHARDS; i++) {
+        free(shards[i].pages);
+    }
+    delete [] shards;
+}
+
+bool BlockCache::Lookup(uint64_t off, char *dst) {
+    auto &s = shardOf(off);
+    if (s.frames) {
+        lock_guard<mutex> lock(s.m);
+        auto it = s.index.find(off);
+        if (it != s.index.end()) {
+            s.ref[it->second] = 1;
+            memcpy(dst, s.pages + uint64_t(it->second)*CACHE_PAGE_SIZE, CACHE_PAGE_SIZE);
+            hits++;
+            return true;
+        }
+    }
+
+    misses++;
+    return false;
+}
+
+void BlockCache::Insert(uint64_t off, const char *src) {
+    auto &s = shardOf(off);
+    if (!s.frames) {
+        return;
+    }
+
+    lock_guard<mutex> lock(s.m);
+    if (s.index.find(off) != s.index.end()) {
+        return;
+    }
+
+    int frame;
+    if (s.used < s.frames) {
+        frame = s.used++;
+    } else {
+        // Pages referenced since the last sweep get a second chance
+        while (s.ref[s.hand]) {
+            s.ref[s.hand] = 0;
+            s.hand = (s.hand+1) % s.frames;
+        }
+        frame = s.hand;
+        s.hand = (s.hand+1) % s.frames;
+        s.index.erase(s.keys[frame]);
+    }
+
+    s.keys[frame] = off;
+    s.ref[frame] = 0;
+    s.index[off] = frame;
+    memcpy(s.pages + uint64_t(frame)*CACHE_PAGE_SIZE, src, CACHE_PAGE_SIZE);
+}
+
+// Dropped frames are recycled by CLOCK as usual, their pages just stop
+// matching lookups
+void BlockCache::Invalidate(uint64_t start, uint64_t end) {
+    if (!shards[0].frames) {
+        return;
+    }
+
+    start = (start/CACHE_PAGE_SIZE)*CACHE_PAGE_SIZE;
+    for (auto off=start; off<end; off += CACHE_PAGE_SIZE) {
+        auto &s = shardOf(off);
+        lock_guard<mutex> lock(s.m);
+        auto it = s.index.find(off);
+        if (it != s.index.end()) {
+            s.ref[it->second] = 0;
+            s.keys[it->second] = UINT64_MAX;
+            s.index.erase(it);
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include "common.h"
+
+using namespace std;
+
+const int CACHE_SHARDS = 64;
+const int CACHE_PAGE_SIZE = ALIGN_SIZE;
+
+// Cache of log pages keyed by their aligned offset. Every shard owns a
+// fixed set of page frames that are recycled with the CLOCK algorithm,
+// so memory use never exceeds the capacity given at construction. A cache
+// with no capacity only counts lookups.
+class BlockCache {
+public:
+    BlockCache(uint64_t capacity);
+
+    ~BlockCache();
+
+    // Copy the page at off into dst, returns false if it is not cached
+    bool Lookup(uint64_t off, char *dst);
+
+    void Insert(uint64_t off, const char *src);
+
+    // Drop the pages of [start, end)
+    void Invalidate(uint64_t start, uint64_t end);
+
+    uint64_t Capacity() {
+        return capacity;
+    }
+
+    uint64_t Hits() {
+        return hits;
+    }
+
+    uint64_t Misses() {
+        return misses;
+    }
+
+private:
+    struct shard {
+        mutex m;
+        unordered_map<uint64_t, int> index;
+        vector<uint64_t> keys;
+        vector<uint8_t> ref;
+        char *pages;
+        int frames, used, hand;
+    };
+
+    shard &shardOf(uint64_t off) {
+        auto page = off / CACHE_PAGE_SIZE;
+        return shards[(page * 0x9E3779B97F4A7C15ULL) >> 58];
+    }
+
+    uint64_t capacity;
+    shard *shards;
+    atomic<uint64_t> hits, misses;
+};
@@ -1,42 +1,64 @@
 #pragma once
 
+#include <string.h>
+#include <algorithm>
 #include "common.h"
 
+const int BLOOM_MAX_HASHES = 4;
+
+// Bloom filters of 8, 16 or 32 bits stored back to back in a side array,
+// one per bucket. All probe bits are derived from the key hash with double
+// hashing, so a filter costs no hashing beyond the bucket lookup. A key is
+// turned into a mask of its probe bits and tested with a single compare.
 class BloomFilter {
 public:
-    BloomFilter(void *data, size_t size, int hashFns) :filter(static_cast<uint8_t *>(data)), size(size) {}
-
-    void Add(const bytes &itm) {
-        for (auto i=0; i<hashFns; i++) {
-            uint32_t h;
-            MurmurHash3_x86_32(itm.data, itm.size, i+1, &h);
-            h %= size*8;
-            filter[h/8] |= (1 << h % 8);
-        }
+    // The number of probes is picked for items keys per filter
+    BloomFilter(int bits, int items) :bits(bits), bytes(bits/8) {
+        assert(bits == 8 || bits == 16 || bits == 32);
+        numHashes = int(double(bits)/items*0.693 + 0.5);
+        numHashes = max(1, min(BLOOM_MAX_HASHES, numHashes));
     }
 
-    bool Test(const bytes &itm) {
-        for (auto i=0; i<hashFns; i++) {
-            uint32_t h;
-            MurmurHash3_x86_32(itm.data, itm.size, i+1, &h);
-            h %= size*8;
-            if (!(filter[h/8] & (1 << h % 8))) {
-                return false;
-            }
+    uint32_t Mask(uint32_t h) const {
+        // The bucket is picked with the low order of h, remix it so that
+        // the keys of a bucket spread over the filter
+        auto x = h * 0x9E3779B1u;
+        auto h1 = x >> 27, h2 = (x >> 22) | 1;
+        uint32_t mask = 0;
+        for (auto i=0; i<BLOOM_MAX_HASHES; i++) {
+            mask |= uint32_t(i < numHashes) << ((h1 + i*h2) & (bits-1));
         }
+        return mask;
+    }
 
-        return true;
+    static bool Test(uint32_t filter, uint32_t mask) {
+        return (filter & mask) == mask;
     }
 
-    void Reset() {
-        for (auto i=0; i<size; i++) {
-            filter[i] = 0;
-        }
+    // The array needs 3 bytes of slack past the last filter
+    uint32_t Load(const uint8_t *dir, uint32_t id) const {
+        uint32_t filter;
+        memcpy(&filter, dir + uint64_t(id)*bytes, sizeof(filter));
+        return bits == 32 ? filter : filter & ((1u << bits) - 1);
     }
 
-private:
+    void Store(uint8_t *dir, uint32_t id, uint32_t filter) const {
+        memcpy(dir + uint64_t(id)*bytes, &filter, bytes);
+    }
 
-    uint8_t *filter;
-    size_t size;
-    int hashFns;
+    int Bits() const {
+        return bits;
+    }
+
+    int Bytes() const {
+        return bytes;
+    }
+
+    int NumHashes() const {
+        return numHashes;
+    }
+
+private:
+    int bits, bytes;
+    int numHashes;
 };
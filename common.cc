@@ -1,6 +1,10 @@
 #include "common.h"
 #include <iostream>
 
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
 using namespace std;
 
 ostream & operator << (ostream &out, const bytes &s){
@@ -18,3 +22,86 @@ void bytes_free(const bytes &s) {
     delete [] s.data;
 }
 
+// Slicing-by-8 tables, crc32cTable[0] is the classic byte wise table
+static uint32_t crc32cTable[8][256];
+
+static bool crc32cInit() {
+    for (uint32_t i=0; i<256; i++) {
+        uint32_t c = i;
+        for (auto j=0; j<8; j++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        }
+        crc32cTable[0][i] = c;
+    }
+
+    for (uint32_t i=0; i<256; i++) {
+        for (auto t=1; t<8; t++) {
+            auto c = crc32cTable[t-1][i];
+            crc32cTable[t][i] = crc32cTable[0][c & 0xff] ^ (c >> 8);
+        }
+    }
+    return true;
+}
+
+static bool crc32cReady = crc32cInit();
+
+uint32_t crc32cSoftware(uint32_t crc, const void *data, size_t len) {
+    auto p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p+4, 4);
+        lo ^= crc;
+        crc = crc32cTable[7][lo & 0xff] ^ crc32cTable[6][(lo >> 8) & 0xff] ^
+            crc32cTable[5][(lo >> 16) & 0xff] ^ crc32cTable[4][lo >> 24] ^
+            crc32cTable[3][hi & 0xff] ^ crc32cTable[2][(hi >> 8) & 0xff] ^
+            crc32cTable[1][(hi >> 16) & 0xff] ^ crc32cTable[0][hi >> 24];
+    }
+
+    for (; len; len--, p++) {
+        crc = crc32cTable[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+
+// The crc32 instruction computes the same CRC-32C as the tables
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSSE42(uint32_t crc, const void *data, size_t len) {
+    auto p = static_cast<const uint8_t *>(data);
+    uint64_t c = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+
+    auto c32 = uint32_t(c);
+    for (; len; len--, p++) {
+        c32 = _mm_crc32_u8(c32, *p);
+    }
+    return ~c32;
+}
+
+static bool crc32cHW = __builtin_cpu_supports("sse4.2");
+
+#else
+
+static bool crc32cHW = false;
+
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+#if defined(__x86_64__)
+    if (crc32cHW) {
+        return crc32cSSE42(crc, data, len);
+    }
+#endif
+    return crc32cSoftware(crc, data, len);
+}
+
+bool crc32cAccelerated() {
+    return crc32cHW;
+}
@@ -1,11 +1,12 @@
 #pragma once
 
-#include "murmurhash3.h"
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <iostream>
 #include <ostream>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
@@ -48,6 +49,15 @@ struct bytes {
 
 bytes bytes_dup(const bytes &src);
 
+// CRC-32C (Castagnoli) of len bytes, chained through crc. Uses the crc32
+// instruction where the CPU has SSE4.2.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// The table driven fallback of crc32c
+uint32_t crc32cSoftware(uint32_t crc, const void *data, size_t len);
+
+bool crc32cAccelerated();
+
 void bytes_free(const bytes &s);
 
 struct Buffer {
@@ -71,6 +81,11 @@ struct Buffer {
         return bytes{reinterpret_cast<char*>(buf), n};
     }
 
+    bool Contains(const char *p) {
+        auto start = reinterpret_cast<char*>(buf);
+        return p >= start && p < start+size;
+    }
+
     bytes Resize(int n) {
         if (n > size) {
             buf = realloc(buf, n);
@@ -92,13 +107,59 @@ struct Buffer {
     }
 };
 
+const size_t ARENA_CHUNK_SIZE = 64*1024;
 
-ostream & operator << (ostream &out, const bytes &s);
+// Bump allocator for short lived copies. Reset keeps the chunks for reuse,
+// so an arena that is reset between uses stops allocating once it has
+// grown to its working set.
+class Arena {
+public:
+    Arena() :chunk(0), used(0) {}
 
-struct bytesHasher {
-      size_t operator()(const bytes& k) const {
-        uint32_t h;
-        MurmurHash3_x86_32(k.data, k.size, 0, &h);
-        return (size_t) h;
-      }
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena() {
+        for (auto &c: chunks) {
+            delete [] c.data;
+        }
+    }
+
+    char *Alloc(size_t n) {
+        n = (n+7) & ~size_t(7);
+        for (; chunk<chunks.size(); chunk++, used=0) {
+            if (used+n <= chunks[chunk].size) {
+                auto p = chunks[chunk].data + used;
+                used += n;
+                return p;
+            }
+        }
+
+        chunks.push_back(chunkInfo{new char[max(n, ARENA_CHUNK_SIZE)], max(n, ARENA_CHUNK_SIZE)});
+        used = n;
+        return chunks[chunk].data;
+    }
+
+    bytes Dup(const bytes &src) {
+        bytes dst{Alloc(src.size), src.size};
+        memcpy(dst.data, src.data, src.size);
+        return dst;
+    }
+
+    void Reset() {
+        chunk = 0;
+        used = 0;
+    }
+
+private:
+    struct chunkInfo {
+        char *data;
+        size_t size;
+    };
+
+    vector<chunkInfo> chunks;
+    size_t chunk, used;
 };
+
+ostream & operator << (ostream &out, const bytes &s);
+
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+#include "murmurhash3.h"
+
+// Key hash policies. Every policy returns 64 bits, the table folds them to
+// the 32 bits it addresses buckets, tags and bloom filters with. The policy
+// is a template parameter of the table, tables on disk record the ID of
+// the one they were written with.
+
+// MurmurHash3_x86_32, the hash of tables written before there were
+// policies. The fold leaves it unchanged.
+struct Murmur32Hash {
+    static const uint32_t ID = 0;
+
+    static uint64_t Hash(const void *data, size_t len) {
+        uint32_t h;
+        MurmurHash3_x86_32(data, int(len), 0, &h);
+        return h;
+    }
+};
+
+struct Murmur128Hash {
+    static const uint32_t ID = 1;
+
+    static uint64_t Hash(const void *data, size_t len) {
+        uint64_t h;
+        MurmurHash3_x64_128(data, int(len), 0, &h);
+        return h;
+    }
+};
+
+// CRC-32C with the crc32 instruction where available, the multiply
+// spreads the CRC over all 64 bits
+struct CRC32CHash {
+    static const uint32_t ID = 2;
+
+    static uint64_t Hash(const void *data, size_t len) {
+        return crc32c(0, data, len) * 0x9E3779B97F4A7C15ULL;
+    }
+};
+
+// wyhash: 64x64->128 bit multiplies over 16 or 48 byte strides
+struct WyHash {
+    static const uint32_t ID = 3;
+
+    static uint64_t Hash(const void *data, size_t len) {
+        static const uint64_t s[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+            0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+        auto p = static_cast<const uint8_t *>(data);
+        auto seed = mix(s[0], s[1]);
+        uint64_t a, b;
+        if (len <= 16) {
+            if (len >= 4) {
+                a = (r4(p) << 32) | r4(p + ((len >> 3) << 2));
+                b = (r4(p + len - 4) << 32) | r4(p + len - 4 - ((len >> 3) << 2));
+            } else if (len > 0) {
+                a = (uint64_t(p[0]) << 16) | (uint64_t(p[len >> 1]) << 8) | p[len-1];
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            auto i = len;
+            if (i > 48) {
+                auto seed1 = seed, seed2 = seed;
+                do {
+                    seed = mix(r8(p) ^ s[1], r8(p+8) ^ seed);
+                    seed1 = mix(r8(p+16) ^ s[2], r8(p+24) ^ seed1);
+                    seed2 = mix(r8(p+32) ^ s[3], r8(p+40) ^ seed2);
+                    p += 48;
+                    i -= 48;
+                } while (i > 48);
+                seed ^= seed1 ^ seed2;
+            }
+            for (; i > 16; i -= 16, p += 16) {
+                seed = mix(r8(p) ^ s[1], r8(p+8) ^ seed);
+            }
+            a = r8(p + i - 16);
+            b = r8(p + i - 8);
+        }
+
+        a ^= s[1];
+        b ^= seed;
+        mum(a, b);
+        return mix(a ^ s[0] ^ len, b ^ s[1]);
+    }
+
+private:
+    static void mum(uint64_t &a, uint64_t &b) {
+        auto r = static_cast<unsigned __int128>(a) * b;
+        a = uint64_t(r);
+        b = uint64_t(r >> 64);
+    }
+
+    static uint64_t mix(uint64_t a, uint64_t b) {
+        mum(a, b);
+        return a ^ b;
+    }
+
+    static uint64_t r8(const uint8_t *p) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+    }
+
+    static uint64_t r4(const uint8_t *p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+};
+
+// The 32 bit key hash of a table with hash policy H
+template<class H=Murmur32Hash>
+inline uint32_t keyHash(const bytes &key) {
+    auto h = H::Hash(key.data, key.size);
+    return uint32_t(h ^ (h >> 32));
+}
+
+template<class H=Murmur32Hash>
+struct bytesHasher {
+      size_t operator()(const bytes& k) const {
+        return H::Hash(k.data, k.size);
+      }
+};
@@ -1,205 +1,2000 @@
 #include "hashtable.h"
 #include <vector>
+#include <algorithm>
+#include <new>
+#include <unordered_set>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
 
-HashTable::HashTable(int nb, const string &filepath) :DataSize(0) {
-    numBuckets = nb;
+// Pending write of one bucket segment
+template<class KT, class VT, class L, class H>
+struct BasicHashTable<KT, VT, L, H>::segmentWrite {
+    uint32_t id;
+    HTBucketInfo head;
+    uint32_t filter;
+    HTExpiryHint hint;
+    bool cold;
+    vector<kv> kvs;
+    // Keys the segment adds to the bucket, less the ones it deletes
+    int added;
+    BasicDedupKVCallback<H> merged;
+
+    segmentWrite() :cold(false) {}
+};
+
+// The logs of a table bound to a log type have to be of that type
+template<class L>
+static L *streamLog(Log *l) {
+    assert(dynamic_cast<L *>(l));
+    return static_cast<L *>(l);
+}
+
+// Operands that could not be folded, with the value they apply to. See
+// HT_MERGE_PACKED.
+static void packOperands(const bytes *value, uint32_t expires, const vector<bytes> &operands, string &out) {
+    uint8_t has = value != nullptr;
+    uint32_t n = value ? value->size : 0;
+    out.assign(1, char(HT_MERGE_PACKED));
+    out.append(reinterpret_cast<const char *>(&has), sizeof(has));
+    out.append(reinterpret_cast<const char *>(&expires), sizeof(expires));
+    out.append(reinterpret_cast<const char *>(&n), sizeof(n));
+    if (value) {
+        out.append(value->data, n);
+    }
+    for (auto &op: operands) {
+        n = op.size;
+        out.append(reinterpret_cast<const char *>(&n), sizeof(n));
+        out.append(op.data, n);
+    }
+}
+
+// Returns whether the packed operands hold a value
+static bool unpackOperands(const bytes &packed, bytes &value, uint32_t &expires, vector<bytes> &operands) {
+    auto p = packed.data+1;
+    uint8_t has;
+    uint32_t n;
+    memcpy(&has, p, sizeof(has));
+    memcpy(&expires, p+sizeof(has), sizeof(expires));
+    memcpy(&n, p+sizeof(has)+sizeof(expires), sizeof(n));
+    p += sizeof(has)+sizeof(expires)+sizeof(n);
+    value = bytes(p, n);
+    p += n;
+    operands.clear();
+    while (p < packed.data+packed.size) {
+        memcpy(&n, p, sizeof(n));
+        operands.push_back(bytes(p+sizeof(n), n));
+        p += sizeof(n)+n;
+    }
+    return has;
+}
+
+void WriteBatch::Put(const bytes &key, const bytes &value, uint32_t expires) {
+    entry e {data.size(), key.size, data.size()+key.size, value.size, expires};
+    data.append(key.data, key.size);
+    data.append(value.data, value.size);
+    entries.push_back(e);
+}
+
+void WriteBatch::Delete(const bytes &key) {
+    Put(key, deleteValue);
+}
+
+void WriteBatch::Clear() {
+    data.clear();
+    entries.clear();
+}
+
+template<class KT, class VT, class L, class H>
+BasicHashTable<KT, VT, L, H>::BasicHashTable(int nb, const string &filepath, bool recover, uint64_t cacheSize,
+        LogDurability durability, int bloomBits, uint32_t valueThreshold) :bloom(bloomBits, HT_SPLIT_LOAD), DataSize(0),
+    coldDataSize(0), valueDataSize(0), valueThreshold(valueThreshold), numItems(0),
+    userBytes(0), logBytes(0), metrics(HT_COUNTERS, HT_HISTOGRAMS), compactorRunning(false), checkpointerRunning(false),
+    checkpointInterval(HT_CHECKPOINT_INTERVAL), checkpointTail(0) {
+    assert(nb > 0 && nb <= HT_MAX_BUCKETS);
+    assert(!VT::Size || !valueThreshold);
+    fill(begin(mergeOps), end(mergeOps), nullptr);
+    initBuckets = nb;
+    dirState = 0;
     maxSegments = 2;
-    numHashes = 3; // 5 bytes filter, 15 % false positives
-    bucketDir = new HTBucketInfo[nb];
+
+    // Zero filled pages are valid empty buckets, so the directory can grow
+    // without copying by touching more of the reservation
+    auto dir = mmap(0, sizeof(HTBucketInfo)*HT_MAX_BUCKETS, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    assert(dir != MAP_FAILED);
+    bucketDir = static_cast<HTBucketInfo *>(dir);
+    dir = mmap(0, bloomDirSize(), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    assert(dir != MAP_FAILED);
+    bloomDir = static_cast<uint8_t *>(dir);
+    dir = mmap(0, sizeof(HTExpiryHint)*HT_MAX_BUCKETS, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    assert(dir != MAP_FAILED);
+    expiryDir = static_cast<HTExpiryHint *>(dir);
+    nextExpiry = UINT32_MAX;
+    lastExpirySweep = 0;
+    sweeping = false;
+    expiryCursor = 0;
+    sweepExpiry = UINT32_MAX;
+    stripes = new HTLockStripe[HT_LOCK_STRIPES];
+
     if (filepath == "") {
-        log = new InMemoryLog();
+        assert(!recover);
+        log = new BasicHotColdLog<L>(streamLog<L>(new InMemoryLog()), streamLog<L>(new InMemoryLog()),
+                streamLog<L>(new InMemoryLog()));
     } else {
-        log = new PersistentLog(filepath, WRITE_BUFFER_SIZE);
+        // The cold and value logs of a table written without them start
+        // out empty
+        checkpointPath = filepath + ".ckpt";
+        auto coldPath = filepath + ".cold", valuePath = filepath + ".values";
+        if (!recover) {
+            unlink(checkpointPath.c_str());
+        }
+        auto hot = new PersistentLog(filepath, WRITE_BUFFER_SIZE, recover, cacheSize/3, LOG_IO_URING, durability);
+        auto cold = new PersistentLog(coldPath, WRITE_BUFFER_SIZE, recover && access(coldPath.c_str(), F_OK) == 0,
+                cacheSize/3, LOG_IO_URING, durability);
+        auto values = new PersistentLog(valuePath, WRITE_BUFFER_SIZE, recover && access(valuePath.c_str(), F_OK) == 0,
+                cacheSize/3, LOG_IO_URING, durability);
+        hot->SetPeer(cold);
+        cold->SetPeer(hot);
+        // Values moved by the compactor are referenced from the hot log
+        values->SetPeer(hot);
+        log = new BasicHotColdLog<L>(streamLog<L>(hot), streamLog<L>(cold), streamLog<L>(values));
+        if (recover) {
+            auto data = hot->UserData();
+            assert(data >> 32 == formatID());
+            initBuckets = uint32_t(data);
+            this->recover(hot, cold, values);
+        } else {
+            // Bucket ids also depend on the initial directory size
+            hot->SetUserData(initBuckets | formatID() << 32);
+        }
     }
 }
 
-bytes HashTable::Get(const bytes &key, Buffer &b) {
-    auto h = hash(key);
-    auto bInfo = &bucketDir[h % numBuckets];
+// Map the directory of the last checkpoint over the bucket directory.
+// Pages are read in on first access and copied on write.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::loadCheckpoint(HTCheckpointHeader &hdr) {
+    auto fd = open(checkpointPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
 
-#ifdef USE_BLOOMFILTER
-    BloomFilter bloom(static_cast<void *>(&bInfo->bloom), 5, numHashes);
+    auto ok = pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        hdr.magic == HT_CHECKPOINT_MAGIC && hdr.initBuckets == initBuckets &&
+        hdr.bloomBits == uint32_t(bloom.Bits());
+    if (ok) {
+        auto size = sizeof(HTBucketInfo)*hdr.numBuckets;
+        size = ((size+ALIGN_SIZE-1)/ALIGN_SIZE)*ALIGN_SIZE;
+        if (size) {
+            auto dir = mmap(bucketDir, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, ALIGN_SIZE);
+            assert(dir == bucketDir);
+        }
+
+        auto filters = uint64_t(bloom.Bytes())*hdr.numBuckets;
+        filters = ((filters+ALIGN_SIZE-1)/ALIGN_SIZE)*ALIGN_SIZE;
+        if (filters) {
+            auto dir = mmap(bloomDir, filters, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, ALIGN_SIZE+size);
+            assert(dir == bloomDir);
+        }
 
-    if (!bloom.Test(key)) {
-        return bytes();
+        auto hints = sizeof(HTExpiryHint)*hdr.numBuckets;
+        hints = ((hints+ALIGN_SIZE-1)/ALIGN_SIZE)*ALIGN_SIZE;
+        if (hints) {
+            auto dir = mmap(expiryDir, hints, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd,
+                    ALIGN_SIZE+size+filters);
+            assert(dir == expiryDir);
+        }
     }
-#endif
 
-    LookupKVCallback cb(key);
+    close(fd);
+    return ok;
+}
 
-    VisitBucketKVs(log, b, bInfo, &cb);
-    if (cb.Found) {
-        return cb.Value;
+// Replay the log in order on top of the last checkpoint. A block without a
+// next offset starts a new chain for its bucket and other blocks extend the
+// chain they point to. Blocks of chains that were merged or relocated later
+// fail both checks. Without the checkpoint the whole log is replayed.
+// Cold segments are replayed at the position of the hot tail they carry,
+// which was read under the stripe lock of their bucket, so they land
+// between the hot blocks of the bucket written before and after them.
+// Blocks before the checkpoint tails are in the checkpoint, replaying them
+// could take a bucket back to a chain it was relocated from.
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::recover(PersistentLog *hot, PersistentLog *cold, PersistentLog *values) {
+    HTCheckpointHeader ckpt;
+    uint32_t numBuckets = initBuckets;
+    LogOffset head = 0, from = 0, coldHead = 0, coldFrom = 0, valueHead = 0, valueFrom = 0;
+    if (loadCheckpoint(ckpt)) {
+        numBuckets = max(numBuckets, ckpt.numBuckets);
+        head = ckpt.head;
+        from = ckpt.tail;
+        coldHead = ckpt.coldHead & ~LOG_COLD_BIT;
+        coldFrom = ckpt.coldTail & ~LOG_COLD_BIT;
+        valueHead = ckpt.valueHead & ~LOG_VALUE_BIT;
+        valueFrom = ckpt.valueTail & ~LOG_VALUE_BIT;
+        // Bytes of the checkpointed chains replaced during replay are not
+        // known, so this errs on the high side
+        DataSize = ckpt.dataSize;
+        coldDataSize = ckpt.coldDataSize;
+        valueDataSize = ckpt.valueDataSize;
+        checkpointTail = ckpt.tail;
     }
 
-    return bytes();
-}
+    // Values are only read through the references, the scan finds the
+    // end of the value log
+    values->Recover(thread::hardware_concurrency(), [](LogOffset off, const bytes &block) {}, valueHead, valueFrom);
+
+    vector<uint64_t> liveBytes(numBuckets, 0), coldBytes(numBuckets, 0), valueBytes(numBuckets, 0);
+    auto apply = [&](LogOffset off, const HTData &header, int size, size_t n, uint32_t mask, uint64_t refBytes,
+            const HTExpiryHint &hint) {
+        auto info = &bucketDir[header.bucketID];
+        if (header.nextOffset && header.nextOffset != info->offset) {
+            return;
+        }
+
+        if (header.bucketID >= liveBytes.size()) {
+            liveBytes.resize(header.bucketID+1, 0);
+            coldBytes.resize(header.bucketID+1, 0);
+            valueBytes.resize(header.bucketID+1, 0);
+        }
+
+        uint32_t filter = bloom.Load(bloomDir, header.bucketID);
+        if (!header.nextOffset) {
+            *info = HTBucketInfo();
+            info->version = header.version;
+            info->start = off;
+            liveBytes[header.bucketID] = 0;
+            coldBytes[header.bucketID] = 0;
+            valueBytes[header.bucketID] = 0;
+            expiryDir[header.bucketID] = HTExpiryHint();
+            filter = 0;
+        }
+        bloom.Store(bloomDir, header.bucketID, filter | mask);
+        auto &eh = expiryDir[header.bucketID];
+        if (hint.expires && (!eh.expires || hint.expires < eh.expires)) {
+            eh.expires = hint.expires;
+        }
+        eh.count = min(int(UINT8_MAX), eh.count + hint.count);
+
+        info->count = min(size_t(UINT8_MAX), info->count + n);
+        info->offset = off;
+        info->segments++;
+        liveBytes[header.bucketID] += logBlockSize(size);
+        valueBytes[header.bucketID] += refBytes;
+        if (off & LOG_COLD_BIT) {
+            coldBytes[header.bucketID] += logBlockSize(size);
+        }
+        numBuckets = max(numBuckets, header.bucketID+1);
+    };
 
-int copyKV(char *buf, int offset, const bytes &k, const bytes &v) {
-    uint16_t kl = (uint16_t) k.size;
-    uint32_t vl = (uint32_t) v.size;
+    // Number of kvs in the block, the bloom filter bits of their keys, the
+    // value log bytes they reference and their expiry hint
+    auto summarize = [&](const bytes &block, size_t &n, uint32_t &mask, uint64_t &refBytes, HTExpiryHint &hint) {
+        n = 0;
+        mask = 0;
+        refBytes = 0;
+        hint = HTExpiryHint();
+        segment::Visit(block, [&](const bytes &k, const bytes &v, uint32_t flags) {
+            n++;
+            mask |= bloom.Mask(hash(k));
+            if (flags & HT_VALUE_REF) {
+                refBytes += valueRecordSize(k, htValue(v, flags));
+            }
+            addExpiry(hint, htExpiry(v, flags));
+            return true;
+        });
+    };
 
-    memcpy(buf+offset, &kl, keyLenSize);
-    offset += keyLenSize;
+    struct coldSegment {
+        LogOffset hotTail, off;
+        HTData header;
+        int size;
+        size_t n;
+        uint32_t mask;
+        uint64_t refBytes;
+        HTExpiryHint hint;
+    };
+    vector<coldSegment> segs;
+    cold->Recover(thread::hardware_concurrency(), [&](LogOffset off, const bytes &block) {
+        if (off < coldFrom) {
+            return;
+        }
 
-    memcpy(buf+offset, k.data, k.size);
-    offset += kl;
+        coldSegment c;
+        c.header = *(HTData*)(block.data);
+        c.hotTail = *(LogOffset*)(block.data+sizeof(HTData));
+        c.off = off | LOG_COLD_BIT;
+        c.size = block.size;
+        summarize(block, c.n, c.mask, c.refBytes, c.hint);
+        segs.push_back(c);
+    }, coldHead, coldFrom);
 
-    memcpy(buf+offset, &vl,valLenSize);
-    offset += valLenSize;
+    size_t next = 0;
+    auto applyCold = [&](LogOffset until) {
+        for (; next<segs.size() && segs[next].hotTail <= until; next++) {
+            auto &c = segs[next];
+            apply(c.off, c.header, c.size, c.n, c.mask, c.refBytes, c.hint);
+        }
+    };
+    hot->Recover(thread::hardware_concurrency(), [&](LogOffset off, const bytes &block) {
+        if (off < from) {
+            return;
+        }
+        applyCold(off);
+        size_t n;
+        uint32_t mask;
+        uint64_t refBytes;
+        HTExpiryHint hint;
+        summarize(block, n, mask, refBytes, hint);
+        apply(off, *(HTData*)(block.data), block.size, n, mask, refBytes, hint);
+    }, head, from);
+    applyCold(UINT64_MAX);
 
-    memcpy(buf+offset, v.data, v.size);
-    offset += vl;
-    return offset;
+    liveBytes.resize(numBuckets, 0);
+    coldBytes.resize(numBuckets, 0);
+    valueBytes.resize(numBuckets, 0);
+    for (uint32_t i=0; i<numBuckets; i++) {
+        numItems += bucketDir[i].count;
+        DataSize += liveBytes[i];
+        coldDataSize += coldBytes[i];
+        valueDataSize += valueBytes[i];
+        lowerNextExpiry(expiryDir[i].expires);
+    }
+
+    // Buckets are only ever added at the end of the directory, so the
+    // highest bucket id gives the level and the split pointer
+    uint64_t level = 0;
+    while ((initBuckets << (level+1)) <= numBuckets) {
+        level++;
+    }
+    dirState = (level << 32) | (numBuckets - (initBuckets << level));
 }
 
-void HashTable::Delete(const bytes &key) {
-    Set(key, deleteValue);
+template<class KT, class VT, class L, class H>
+BasicHashTable<KT, VT, L, H>::~BasicHashTable() {
+    StopCheckpointer();
+    StopCompactor();
+    Checkpoint();
+    delete log;
+    delete [] stripes;
+    munmap(bucketDir, sizeof(HTBucketInfo)*HT_MAX_BUCKETS);
+    munmap(bloomDir, bloomDirSize());
+    munmap(expiryDir, sizeof(HTExpiryHint)*HT_MAX_BUCKETS);
 }
 
-void HashTable::Set(const bytes &key, const bytes &value){
-    auto h = hash(key);
-    auto id = h % numBuckets;
-    auto bInfo = &bucketDir[id];
+// Lock the stripe of the bucket that owns the hash. The bucket is validated
+// after locking as a concurrent split may have moved the hash elsewhere.
+template<class KT, class VT, class L, class H>
+uint32_t BasicHashTable<KT, VT, L, H>::lockBucket(uint32_t h) {
+    while (true) {
+        auto id = bucketID(h, dirState);
+        auto &st = stripe(id);
+        st.m.lock();
+        if (bucketID(h, dirState) == id) {
+            return id;
+        }
+        st.m.unlock();
+    }
+}
+
+// Take a consistent copy of the bucket that owns the hash without locking
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::readBucket(uint32_t h, HTBucketInfo &info, uint32_t &filter) {
+    while (true) {
+        auto state = dirState.load(memory_order_acquire);
+        auto id = bucketID(h, state);
+        auto &st = stripe(id);
+        auto seq = st.seq.load(memory_order_acquire);
+        if (seq & 1) {
+            this_thread::yield();
+            continue;
+        }
+
+        info = bucketDir[id];
+        filter = bloom.Load(bloomDir, id);
+        atomic_thread_fence(memory_order_acquire);
+        if (st.seq.load(memory_order_relaxed) == seq && dirState.load(memory_order_relaxed) == state) {
+            return;
+        }
+    }
+}
+
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::beginUpdate(HTLockStripe &st) {
+    st.seq.store(st.seq.load(memory_order_relaxed)+1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
 
-    compactLog(30, wBuf);
-    kvs.clear();
-    kvs.push_back(kv{key,value});
-    writeHTData(id, bInfo, kvs, maxSegments);
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::endUpdate(HTLockStripe &st) {
+    st.seq.store(st.seq.load(memory_order_relaxed)+1, memory_order_release);
 }
 
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::publish(uint32_t id, const HTBucketInfo &info, uint32_t filter, const HTExpiryHint &hint) {
+    numItems += info.count;
+    numItems -= bucketDir[id].count;
+    bucketDir[id] = info;
+    bloom.Store(bloomDir, id, filter);
+    expiryDir[id] = hint;
+    lowerNextExpiry(hint.expires);
+}
 
-void HashTable::writeHTData(int id, HTBucketInfo *bInfo, vector<kv> &kvs, int maxSegments) {
-    DedupKVCallback cb;
-    HTBucketInfo head = *bInfo;
+// The value points into the log when it is kept in memory, or into b. The
+// caller must hold a pin, log space visible from the bucket copy stays
+// readable until it is unpinned.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::lookup(const bytes &key, Buffer &b, bytes &value) {
+    auto h = hash(key);
+    HTBucketInfo info;
+    uint32_t filter;
+    readBucket(h, info, filter);
+    metrics.Add(HT_GETS);
 
 #ifdef USE_BLOOMFILTER
-    BloomFilter bloom(static_cast<void *>(&bInfo->bloom), 4, numHashes);
+    if (!BloomFilter::Test(filter, bloom.Mask(h))) {
+        metrics.Add(HT_BLOOM_NEGATIVES);
+        return false;
+    }
 #endif
 
-    if (bInfo->segments > maxSegments) {
+    uint32_t flags;
+    auto next = info.offset;
+    if (!findKV(key, h, next, b, value, flags)) {
+        metrics.Add(HT_BLOOM_FALSE_POSITIVES);
+        return false;
+    }
+    if ((flags & HT_VALUE_OPERAND) && !resolve(key, h, next, b, value, flags)) {
+        return false;
+    }
+    if (htExpired(value, flags, htNow())) {
+        return false;
+    }
+    value = htValue(value, flags);
+    if (!value.size || ((flags & HT_VALUE_REF) && !readValue(key, value, b, value))) {
+        return false;
+    }
+    metrics.Add(HT_GET_HITS);
+    return true;
+}
+
+// Find the latest kv of the key in the bucket chain from the given
+// segment on, the value is empty for deleted keys. From is left at the
+// segment after the one holding the kv.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::findKV(const bytes &key, uint32_t h, LogOffset &from, Buffer &b, bytes &value, uint32_t &flags) {
+    auto t = tag(h);
+    while (from) {
+        auto block = log->ReadInPlace(from);
+        if (!block.data) {
+            block = log->Read(from, b);
+            metrics.Add(HT_BYTES_READ, block.size);
+        }
+        metrics.Add(HT_SEGMENTS_READ);
+
+        from = (*(HTData*)(block.data)).nextOffset;
+        if (segment::Lookup(block, key, t, value, flags)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Whether the chain of the bucket holds the key, deleted and expired kvs
+// do not count. The filter rules out most new keys without a read. The
+// caller holds the lock of the bucket.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::hasKey(const bytes &key, uint32_t h, const HTBucketInfo &info, uint32_t filter,
+        uint32_t now, Buffer &b) {
 #ifdef USE_BLOOMFILTER
-        bloom.Reset();
+    if (!BloomFilter::Test(filter, bloom.Mask(h))) {
+        return false;
+    }
 #endif
-        head = HTBucketInfo();
-        head.offset = 0;
-        head.version = bInfo->version+1;
-
-        DataSize -= VisitBucketKVs(log, wBuf, bInfo, &cb);
-        for (auto x: cb.Map) {
-            if (x.second.size > 0) {
-               kvs.push_back(kv{x.first,x.second});
+
+    auto t = tag(h);
+    for (auto next = info.offset; next; ) {
+        auto block = log->ReadInPlace(next);
+        if (!block.data) {
+            block = log->Read(next, b);
+        }
+        next = (*(HTData*)(block.data)).nextOffset;
+        bytes value;
+        uint32_t flags;
+        if (segment::Lookup(block, key, t, value, flags)) {
+            return value.size && !htExpired(value, flags, now);
+        }
+    }
+    return false;
+}
+
+// Fold the operand in value and the older operands of the key down the
+// chain from next into its base value, expired values count as missing.
+// The result is copied into b and inline, empty if nothing is left of the
+// key. Returns false, with an empty value, if an operator is missing.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::resolve(const bytes &key, uint32_t h, LogOffset next, Buffer &b, bytes &value, uint32_t &flags) {
+    // The operands are copied as b is reused by the reads down the chain
+    static thread_local string data, result;
+    static thread_local vector<size_t> ends;
+    static thread_local vector<bytes> operands;
+    data.clear();
+    ends.clear();
+
+    auto found = true;
+    while (found && (flags & HT_VALUE_OPERAND)) {
+        data.append(value.data, value.size);
+        ends.push_back(data.size());
+        found = findKV(key, h, next, b, value, flags);
+    }
+
+    const bytes *base = nullptr;
+    if (found && value.size && !htExpired(value, flags, htNow())) {
+        value = htValue(value, flags);
+        if (!(flags & HT_VALUE_REF) || readValue(key, value, b, value)) {
+            base = &value;
+        }
+    }
+
+    operands.clear();
+    for (auto i = ends.size(); i-- > 0; ) {
+        auto start = i ? ends[i-1] : 0;
+        operands.push_back(bytes(&data[start], ends[i]-start));
+    }
+    uint32_t expires = 0;
+    if (!fold(key, base, operands, htNow(), result, expires)) {
+        metrics.Add(HT_UNRESOLVED);
+        value = bytes();
+        flags = 0;
+        return false;
+    }
+
+    value = b.Alloc(int(result.size()));
+    memcpy(value.data, result.data(), result.size());
+    flags = 0;
+    return true;
+}
+
+// Apply the operands, oldest first, to the value. Expires is that of the
+// value and is updated when packed operands replace it. Returns false if
+// an operator is not registered.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::fold(const bytes &key, const bytes *value, const vector<bytes> &operands, uint32_t now,
+        string &result, uint32_t &expires) {
+    string cur;
+    if (value) {
+        cur.assign(value->data, value->size);
+    }
+
+    auto has = value != nullptr;
+    if (!applyOperands(key, operands, now, cur, has, expires)) {
+        return false;
+    }
+    result.swap(cur);
+    return true;
+}
+
+// Each run of operands of the same merge operator goes to it in a single
+// call. Packed operands start over from the value they hold, unless it
+// expired.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::applyOperands(const bytes &key, const vector<bytes> &operands, uint32_t now, string &cur,
+        bool &has, uint32_t &expires) {
+    static thread_local vector<bytes> run;
+    static thread_local string out;
+    for (size_t i=0; i<operands.size(); ) {
+        auto id = uint8_t(operands[i].data[0]);
+        if (id == HT_MERGE_PACKED) {
+            vector<bytes> packed;
+            bytes v;
+            has = unpackOperands(operands[i++], v, expires, packed) && !(expires && expires <= now);
+            cur.clear();
+            if (has) {
+                cur.assign(v.data, v.size);
+            } else {
+                expires = 0;
+            }
+            if (!applyOperands(key, packed, now, cur, has, expires)) {
+                return false;
             }
+            continue;
+        }
+
+        auto op = id < HT_MERGE_OPERATORS ? mergeOps[id] : nullptr;
+        if (!op) {
+            return false;
         }
+        run.clear();
+        for (; i<operands.size() && uint8_t(operands[i].data[0]) == id; i++) {
+            run.push_back(bytes(operands[i].data+1, operands[i].size-1));
+        }
+
+        bytes v(&cur[0], cur.size());
+        op->Merge(key, has ? &v : nullptr, run, out);
+        cur.swap(out);
+        has = true;
     }
+    return true;
+}
 
-    HTData header {(uint32_t)id, head.version, head.offset};
-    auto headerSize = sizeof(header);
-    auto size = headerSize;
+// Fold the collected operands of the merged kvs into their values, the
+// results go into the arena, or into the value log from valueThreshold on.
+// They keep the expiry time of the value they were folded into. Operands
+// of operators that are not registered are packed with their value into a
+// single operand instead. The caller holds the lock of the bucket.
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::resolveMerged(BasicDedupKVCallback<H> &d, Buffer &b, Arena &a) {
+    static thread_local vector<bytes> operands;
+    static thread_local string result;
+    auto now = htNow();
+    for (auto &e: d) {
+        if (!e.operands) {
+            continue;
+        }
 
-    for (auto x: kvs) {
-        size += keyLenSize +valLenSize;
-        size += x.k.size+ x.v.size;
+        bytes value;
+        const bytes *base = nullptr;
+        uint32_t expires = 0;
+        if (!e.open && e.v.size) {
+            auto expired = htExpired(e.v, e.flags, now);
+            value = htValue(e.v, e.flags);
+            if (e.flags & HT_VALUE_REF) {
+                d.DroppedValues += valueRecordSize(e.k, value);
+                if (!expired && readValue(e.k, value, b, value)) {
+                    base = &value;
+                }
+            } else if (!expired) {
+                base = &value;
+            }
+            if (!expired) {
+                expires = htExpiry(e.v, e.flags);
+            }
+        }
+
+        operands.clear();
+        for (auto o = e.operands; o; o = o->next) {
+            operands.push_back(o->v);
+        }
+        auto baseExpires = expires;
+        if (fold(e.k, base, operands, now, result, expires)) {
+            auto x = valueKV(e.k, a.Dup(bytes(&result[0], result.size())), expires, a);
+            e.v = x.v;
+            e.flags = x.flags;
+        } else if (!base && operands.size() == 1) {
+            e.v = operands[0];
+            e.flags = HT_VALUE_OPERAND;
+        } else {
+            packOperands(base, baseExpires, operands, result);
+            e.v = a.Dup(bytes(&result[0], result.size()));
+            e.flags = HT_VALUE_OPERAND;
+        }
+        e.operands = nullptr;
+        e.open = false;
     }
+}
 
-    auto space = log->ReserveSpace(size);
+// Whether a kv of a merged chain goes into the new segment. Deleted and
+// expired kvs are left out, the value log records of expired ones add up
+// in dropped.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::keepMerged(const bytes &k, const bytes &v, uint32_t flags, uint32_t now, uint64_t &dropped) {
+    if (!v.size) {
+        return false;
+    }
+    if (!htExpired(v, flags, now)) {
+        return true;
+    }
 
-    auto offset = 0;
-    memcpy(space.Buffer+offset, &header, headerSize);
-    offset += headerSize;
+    if (flags & HT_VALUE_REF) {
+        dropped += valueRecordSize(k, htValue(v, flags));
+    }
+    metrics.Add(HT_EXPIRED);
+    return false;
+}
 
-    for (auto x: kvs) {
-        offset = copyKV(space.Buffer, offset, x.k, x.v);
+// Read the value that ref points to. The key is stored with the value, a
+// reference that outlived its value in a crash fails the check.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::readValue(const bytes &key, const bytes &ref, Buffer &b, bytes &value) {
+    HTValueRef r;
+    memcpy(&r, ref.data, sizeof(r));
+    if (r.offset >= log->ValueTailOffset()) {
+        return false;
+    }
+
+    auto block = log->ReadInPlace(r.offset);
+    if (!block.data) {
+        block = log->Read(r.offset, b);
+    }
+
+    auto kl = *(uint16_t*)(block.data);
+    if (size_t(block.size) != keyLenSize + kl + r.size || !(bytes(block.data+keyLenSize, kl) == key)) {
+        return false;
+    }
+    value = bytes(block.data+keyLenSize+kl, r.size);
+    return true;
+}
+
+template<class KT, class VT, class L, class H>
+bytes BasicHashTable<KT, VT, L, H>::Get(const bytes &key, Buffer &b) {
+    MetricTimer t;
+    bytes value;
+    auto slot = log->Pin();
+    auto found = lookup(key, b, value);
+
+    // Only the value is copied out of the log
+    if (found && !b.Contains(value.data)) {
+        auto out = b.Alloc(value.size);
+        memcpy(out.data, value.data, value.size);
+        value = out;
+    }
+    log->Unpin(slot);
+    metrics.Record(HT_GET_LATENCY, t);
+
+    return found ? value : bytes();
+}
+
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::Get(const bytes &key, PinnedValue &v) {
+    MetricTimer t;
+    v.Release();
+    v.log = log;
+    v.slot = log->Pin();
+    auto found = lookup(key, v.b, v.value);
+    if (!found) {
+        v.Release();
+    }
+    metrics.Record(HT_GET_LATENCY, t);
+
+    return found;
+}
+
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::MayContain(const bytes &key) {
+    auto h = hash(key);
+    HTBucketInfo info;
+    uint32_t filter;
+    readBucket(h, info, filter);
+    return BloomFilter::Test(filter, bloom.Mask(h));
+}
+
+// Lookups advance through the bucket chains in rounds. Every round reads
+// the current segment of all unresolved keys with a single ReadBatch call,
+// only keys that miss in their segment move on to the next one. Keys
+// that hit merge operands are resolved one by one at the end.
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::MultiGet(const vector<bytes> &keys, vector<bytes> &values, Buffer &b) {
+    static thread_local Buffer rb;
+    auto n = keys.size();
+    vector<LogOffset> next(n, 0);
+    vector<size_t> pos(n);
+    string found;
+
+    vector<uint8_t> tags(n);
+    values.assign(n, bytes());
+    auto slot = log->Pin();
+    for (size_t i=0; i<n; i++) {
+        HTBucketInfo info;
+        uint32_t filter;
+        auto h = hash(keys[i]);
+        tags[i] = tag(h);
+        readBucket(h, info, filter);
+        next[i] = info.offset;
 #ifdef USE_BLOOMFILTER
-        bloom.Add(x.k);
+        if (!BloomFilter::Test(filter, bloom.Mask(h))) {
+            metrics.Add(HT_BLOOM_NEGATIVES);
+            next[i] = 0;
+        }
 #endif
     }
+    metrics.Add(HT_GETS, n);
+
+    vector<LogOffset> offs;
+    vector<bytes> blocks;
+    vector<int> pending;
+    // Keys whose value is in the value log, with their references
+    vector<int> refKeys;
+    vector<HTValueRef> refs;
+    // Keys with operands, the rest of their chain and a copy of the operand
+    vector<int> opKeys;
+    vector<LogOffset> opNext;
+    vector<size_t> opEnds;
+    string operands;
+    auto now = htNow();
+    while (true) {
+        pending.clear();
+        offs.clear();
+        for (size_t i=0; i<n; i++) {
+            if (next[i]) {
+                pending.push_back(i);
+                offs.push_back(next[i]);
+            }
+        }
+
+        if (pending.empty()) {
+            break;
+        }
+
+        // Keys of the same bucket share the segment read
+        sort(offs.begin(), offs.end());
+        offs.erase(unique(offs.begin(), offs.end()), offs.end());
+        blocks.resize(offs.size());
+        log->ReadBatch(offs.data(), offs.size(), rb, blocks.data());
+        metrics.Add(HT_SEGMENTS_READ, offs.size());
+
+        for (auto i: pending) {
+            auto idx = lower_bound(offs.begin(), offs.end(), next[i]) - offs.begin();
+            auto &block = blocks[idx];
+            bytes value;
+            uint32_t flags;
+            if (segment::Lookup(block, keys[i], tags[i], value, flags)) {
+                next[i] = 0;
+                if (htExpired(value, flags, now)) {
+                    continue;
+                }
+                value = htValue(value, flags);
+                if (flags & HT_VALUE_OPERAND) {
+                    opKeys.push_back(i);
+                    opNext.push_back((*(HTData*)(block.data)).nextOffset);
+                    operands.append(value.data, value.size);
+                    opEnds.push_back(operands.size());
+                } else if (flags & HT_VALUE_REF) {
+                    HTValueRef r;
+                    memcpy(&r, value.data, sizeof(r));
+                    refKeys.push_back(i);
+                    refs.push_back(r);
+                } else if (value.size) {
+                    pos[i] = found.size();
+                    values[i].size = value.size;
+                    found.append(value.data, value.size);
+                }
+            } else {
+                next[i] = (*(HTData*)(block.data)).nextOffset;
+                if (!next[i]) {
+                    metrics.Add(HT_BLOOM_FALSE_POSITIVES);
+                }
+            }
+        }
+    }
+
+    // The values of all references are read with one more batch. See
+    // readValue for the checks.
+    offs.clear();
+    auto valueTail = log->ValueTailOffset();
+    for (size_t j=0; j<refs.size(); j++) {
+        if (refs[j].offset < valueTail) {
+            refKeys[offs.size()] = refKeys[j];
+            refs[offs.size()] = refs[j];
+            offs.push_back(refs[j].offset);
+        }
+    }
+    blocks.resize(offs.size());
+    if (offs.size()) {
+        log->ReadBatch(offs.data(), offs.size(), rb, blocks.data());
+    }
+    for (size_t j=0; j<offs.size(); j++) {
+        auto i = refKeys[j];
+        auto &block = blocks[j];
+        auto kl = *(uint16_t*)(block.data);
+        if (size_t(block.size) == keyLenSize + kl + refs[j].size && bytes(block.data+keyLenSize, kl) == keys[i]) {
+            pos[i] = found.size();
+            values[i].size = refs[j].size;
+            found.append(block.data+keyLenSize+kl, refs[j].size);
+        }
+    }
+    for (size_t j=0; j<opKeys.size(); j++) {
+        auto i = opKeys[j];
+        auto start = j ? opEnds[j-1] : 0;
+        bytes value(&operands[start], opEnds[j]-start);
+        uint32_t flags = HT_VALUE_OPERAND;
+        resolve(keys[i], hash(keys[i]), opNext[j], rb, value, flags);
+        if (value.size) {
+            pos[i] = found.size();
+            values[i].size = value.size;
+            found.append(value.data, value.size);
+        }
+    }
+    log->Unpin(slot);
 
+    auto buf = b.Alloc(found.size());
+    memcpy(buf.data, found.data(), found.size());
+    uint64_t hits = 0;
+    for (size_t i=0; i<n; i++) {
+        if (values[i].size) {
+            values[i].data = buf.data + pos[i];
+            hits++;
+        }
+    }
+    metrics.Add(HT_GET_HITS, hits);
+}
+
+// The kv to store in the bucket, large values are written to the value
+// log first and referenced from the kv. Values that expire are prefixed
+// with their expiry time. Encoded values are allocated from the arena.
+// The caller must hold the lock stripe of the bucket, the value log
+// compactor checks references under it.
+template<class KT, class VT, class L, class H>
+kv BasicHashTable<KT, VT, L, H>::valueKV(const bytes &key, const bytes &value, uint32_t expires, Arena &a) {
+    auto v = value;
+    uint32_t flags = 0;
+    HTValueRef ref;
+    if (valueThreshold && value.size >= int(valueThreshold)) {
+        writeValue(key, value, ref);
+        v = bytes(reinterpret_cast<char *>(&ref), sizeof(ref));
+        flags = HT_VALUE_REF;
+    }
+    if (!expires || !value.size) {
+        return kv{key, flags ? a.Dup(v) : v, flags};
+    }
+
+    auto p = a.Alloc(sizeof(expires) + v.size);
+    memcpy(p, &expires, sizeof(expires));
+    memcpy(p+sizeof(expires), v.data, v.size);
+    return kv{key, bytes(p, sizeof(expires) + v.size), flags | HT_VALUE_EXPIRES};
+}
+
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::writeValue(const bytes &key, const bytes &value, HTValueRef &ref) {
+    assert(!(uint32_t(value.size) & HT_VALUE_FLAGS));
+    auto size = keyLenSize + key.size + value.size;
+    auto space = log->ReserveValueSpace(size);
+    uint16_t kl = key.size;
+    memcpy(space.Buffer, &kl, keyLenSize);
+    memcpy(space.Buffer+keyLenSize, key.data, key.size);
+    memcpy(space.Buffer+keyLenSize+key.size, value.data, value.size);
     log->FinalizeWrite(space);
-    DataSize += logBlockSize(size);
 
-    bInfo->offset = space.Offset;
-    bInfo->segments = head.segments+1;
-    bInfo->count = head.count + kvs.size();
-    bInfo->version = head.version;
+    ref = HTValueRef{space.Offset, uint32_t(value.size)};
+    valueDataSize += logBlockSize(size);
+    logBytes += logBlockSize(size);
+}
+
+template<class KT, class VT, class L, class H>
+LogOffset BasicHashTable<KT, VT, L, H>::Delete(const bytes &key) {
+    return Set(key, deleteValue);
+}
+
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::throttle() {
+    if (compactionDue()) {
+        compactCond.notify_one();
+    }
+
+    // Back-pressure only when the log is about to run out of space
+    if (logSize() > compactOpts.logBudget) {
+        unique_lock<mutex> lock(m);
+        while (compactorRunning && logSize() > compactOpts.logBudget &&
+                GetLogFragmentation() > compactOpts.lowWatermark) {
+            stallCond.wait_for(lock, chrono::milliseconds(1));
+        }
+    }
+}
+
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::beforeWrite() {
+    if (compactorRunning) {
+        throttle();
+    } else {
+        // Writers take turns compacting inline, nobody waits for it
+        unique_lock<mutex> lock(compactLock, try_to_lock);
+        if (lock) {
+            static thread_local Buffer cBuf;
+            compactLog(30, cBuf);
+            expireBuckets();
+        }
+    }
+}
+
+// Split as many buckets as updates were written to keep up with the load
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::afterWrite(int n) {
+    for (auto i=0; i<n && numItems > uint64_t(NumBuckets())*HT_SPLIT_LOAD &&
+            NumBuckets() < HT_MAX_BUCKETS; i++) {
+        if (!splitBucket()) {
+            break;
+        }
+    }
+}
+
+template<class KT, class VT, class L, class H>
+LogOffset BasicHashTable<KT, VT, L, H>::Set(const bytes &key, const bytes &value, uint32_t expires){
+    static thread_local Arena vArena;
+    assert(!KT::Size || key.size == KT::Size);
+    assert(!VT::Size || !value.size || value.size == VT::Size);
+    assert(!VT::Size || !expires);
+    MetricTimer t;
+    beforeWrite();
+    vArena.Reset();
+
+    auto h = hash(key);
+    vector<kv> kvs;
+    userBytes += key.size + value.size;
+
+    auto id = lockBucket(h);
+    kvs.push_back(valueKV(key, value, expires, vArena));
+    writeHTData(id, &bucketDir[id], kvs, maxSegments);
+    auto seq = bucketDir[id].offset;
+    stripe(id).m.unlock();
+
+    afterWrite(1);
+    metrics.Add(value.size ? HT_SETS : HT_DELETES);
+    metrics.Record(HT_SET_LATENCY, t);
+    return seq;
+}
+
+// Operands are stored as kvs of their own, prefixed with the id of their
+// merge operator
+template<class KT, class VT, class L, class H>
+LogOffset BasicHashTable<KT, VT, L, H>::Merge(const bytes &key, const bytes &operand, int op) {
+    assert(!KT::Size || key.size == KT::Size);
+    assert(!VT::Size && op >= 0 && op < HT_MERGE_OPERATORS);
+    MetricTimer t;
+    beforeWrite();
+
+    static thread_local string v;
+    v.assign(1, char(op));
+    v.append(operand.data, operand.size);
+    auto h = hash(key);
+    vector<kv> kvs;
+    userBytes += key.size + operand.size;
+
+    auto id = lockBucket(h);
+    kvs.push_back(kv{key, bytes(&v[0], v.size()), HT_VALUE_OPERAND});
+    writeHTData(id, &bucketDir[id], kvs, maxSegments);
+    auto seq = bucketDir[id].offset;
+    stripe(id).m.unlock();
+
+    afterWrite(1);
+    metrics.Add(HT_OPERANDS);
+    metrics.Record(HT_SET_LATENCY, t);
+    return seq;
+}
+
+template<class KT, class VT, class L, class H>
+LogOffset BasicHashTable<KT, VT, L, H>::Write(WriteBatch &batch) {
+    static thread_local Buffer mBuf;
+    static thread_local Arena mArena;
+    if (!batch.Count()) {
+        return 0;
+    }
+
+    beforeWrite();
+
+    // Walk the batch backwards so that the last update of a key wins
+    unordered_set<bytes, bytesHasher<H>> seen;
+    vector<pair<uint32_t, kv>> updates;
+    vector<uint32_t> expires;
+    for (auto i=batch.Count()-1; i>=0; i--) {
+        auto &e = batch.entries[i];
+        auto k = bytes(&batch.data[e.keyOffset], e.keySize);
+        auto v = bytes(&batch.data[e.valOffset], e.valSize);
+        assert(!KT::Size || k.size == KT::Size);
+        assert(!VT::Size || !v.size || v.size == VT::Size);
+        assert(!VT::Size || !e.expires);
+        if (seen.insert(k).second) {
+            updates.push_back(make_pair(hash(k), kv{k, v, 0}));
+            expires.push_back(e.expires);
+            userBytes += k.size + v.size;
+            metrics.Add(v.size ? HT_SETS : HT_DELETES);
+        }
+    }
+
+    // Lock every touched bucket in stripe order and validate the buckets
+    // against concurrent splits
+    vector<uint32_t> ids(updates.size());
+    vector<HTLockStripe*> locked;
+    while (true) {
+        auto state = dirState.load();
+        locked.clear();
+        for (size_t i=0; i<updates.size(); i++) {
+            ids[i] = bucketID(updates[i].first, state);
+            locked.push_back(&stripe(ids[i]));
+        }
+        sort(locked.begin(), locked.end());
+        locked.erase(unique(locked.begin(), locked.end()), locked.end());
+        for (auto st: locked) {
+            st->m.lock();
+        }
+
+        auto valid = true;
+        state = dirState.load();
+        for (size_t i=0; i<updates.size() && valid; i++) {
+            valid = bucketID(updates[i].first, state) == ids[i];
+        }
+
+        if (valid) {
+            break;
+        }
+
+        for (auto st: locked) {
+            st->m.unlock();
+        }
+    }
+
+    vector<int> order(updates.size());
+    for (size_t i=0; i<order.size(); i++) {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&ids](int a, int b) { return ids[a] < ids[b]; });
+
+    auto groups = 0;
+    for (size_t i=0; i<order.size(); i++) {
+        groups += i == 0 || ids[order[i]] != ids[order[i-1]];
+    }
+
+    // One segment per bucket, the log space for all of them is reserved
+    // together
+    vector<segmentWrite> segs;
+    mArena.Reset();
+    segs.reserve(groups);
+    for (size_t i=0; i<order.size(); i++) {
+        auto id = ids[order[i]];
+        if (i == 0 || id != segs.back().id) {
+            segs.emplace_back();
+            segs.back().id = id;
+        }
+        auto &x = updates[order[i]].second;
+        segs.back().kvs.push_back(valueKV(x.k, x.v, expires[order[i]], mArena));
+    }
+
+    vector<int> sizes;
+    for (auto &w: segs) {
+        prepareSegment(w, bucketDir[w.id], maxSegments, mBuf, mArena);
+        sizes.push_back(segmentSize(w));
+    }
+
+    vector<LogSpace> spaces(segs.size());
+    LogOffset seq = 0;
+    for (size_t i=0; i<segs.size(); ) {
+        auto n = log->ReserveSpace(&sizes[i], segs.size()-i, &spaces[i]);
+        for (auto j=i; j<i+n; j++) {
+            fillSegment(segs[j], spaces[j], sizes[j]);
+            seq = max(seq, spaces[j].Offset);
+        }
+        i += n;
+    }
+
+    for (auto st: locked) {
+        beginUpdate(*st);
+    }
+    for (auto &w: segs) {
+        publish(w.id, w.head, w.filter, w.hint);
+    }
+    for (auto st: locked) {
+        endUpdate(*st);
+        st->m.unlock();
+    }
+
+    afterWrite(updates.size());
+    return seq;
 }
 
+template<class KT, class VT, class L, class H>
+int BasicHashTable<KT, VT, L, H>::writeHTData(int id, HTBucketInfo *bInfo, vector<kv> &kvs, int maxSegments, bool cold) {
+    static thread_local Buffer mBuf;
+    static thread_local Arena mArena;
+    // Reused to keep its kv vector allocated
+    static thread_local segmentWrite w;
+    mArena.Reset();
+    w.id = id;
+    w.cold = cold;
+    w.kvs.clear();
+    for (auto &x: kvs) {
+        w.kvs.push_back(x);
+    }
+
+    // A cold segment always starts a new chain
+    prepareSegment(w, *bInfo, cold ? -1 : maxSegments, mBuf, mArena);
+    auto size = segmentSize(w);
+    auto space = cold ? log->ReserveColdSpace(size) : log->ReserveSpace(size);
+    fillSegment(w, space, size);
 
+    auto &st = stripe(id);
+    beginUpdate(st);
+    publish(id, w.head, w.filter, w.hint);
+    endUpdate(st);
+    return logBlockSize(size);
+}
 
-int VisitBucketKVs(Log *log, Buffer &b, HTBucketInfo *info, KVCallback *callb) {
-    int readBytes = 0;
+// Split the bucket at the split pointer into itself and its buddy bucket
+// at the next level. Only one bucket is rewritten per split, so the
+// directory grows in small steps instead of a full rehash.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::splitBucket() {
+    static thread_local Buffer sBuf;
+    static thread_local Arena sArena;
+    unique_lock<mutex> lock(splitLock, try_to_lock);
+    if (!lock || numItems <= uint64_t(NumBuckets())*HT_SPLIT_LOAD) {
+        return false;
+    }
 
-    LogOffset logOff = info->offset;
-    while (logOff) {
-        auto block = log->Read(logOff, b);
-        readBytes += logBlockSize(block.size);
-        logOff = (*(HTData*)(block.data)).nextOffset;
-        for (auto off = sizeof(HTData); off<block.size; ) {
-            uint16_t kl = *(uint16_t*)(block.data+off);
-            off += keyLenSize;
+    auto state = dirState.load();
+    uint32_t n = initBuckets << (state >> 32);
+    uint32_t src = uint32_t(state);
+    uint32_t dst = src + n;
 
-            auto k = bytes(block.data+off, kl);
-            off += kl;
+    // Lock the stripes in address order, both buckets may share a stripe
+    auto first = &stripe(src), second = &stripe(dst);
+    if (second < first) {
+        swap(first, second);
+    }
 
-            uint32_t vl = *(uint32_t*)(block.data+off);
-            off += valLenSize;
+    first->m.lock();
+    if (second != first) {
+        second->m.lock();
+    }
 
-            auto v = bytes(block.data+off, vl);
-            off += vl;
+    sArena.Reset();
+    BasicDedupKVCallback<H> cb;
+    cb.Reset(sArena, bucketDir[src].count);
+    auto coldBytes = 0;
+    DataSize -= VisitBucketKVs<KT, VT>(log, sBuf, &bucketDir[src], &cb, &coldBytes);
+    coldDataSize -= coldBytes;
+    resolveMerged(cb, sBuf, sArena);
 
-            if (!callb->Call(k,v)) {
-                return readBytes;
+    vector<kv> lo, hi;
+    auto now = htNow();
+    for (auto &x: cb) {
+        if (keepMerged(x.k, x.v, x.flags, now, cb.DroppedValues)) {
+            if (x.h % (n*2) == src) {
+                lo.push_back(kv{x.k, x.v, x.flags});
+            } else {
+                hi.push_back(kv{x.k, x.v, x.flags});
             }
         }
     }
+    valueDataSize -= cb.DroppedValues;
+
+    // The new bucket is written first. Recovery derives the split pointer
+    // from the highest bucket found in the log, and until the rewritten
+    // source bucket is on disk its old chain still holds every key.
+    auto dstInfo = bucketDir[dst];
+    uint32_t srcFilter = 0, dstFilter = 0;
+    HTExpiryHint srcHint, dstHint = expiryDir[dst];
+    if (hi.size()) {
+        dstInfo = writeSegment(dst, bucketDir[dst], hi, dstFilter, dstHint);
+    }
+    auto srcInfo = writeSegment(src, bucketDir[src], lo, srcFilter, srcHint);
+
+    beginUpdate(*first);
+    if (second != first) {
+        beginUpdate(*second);
+    }
+
+    publish(src, srcInfo, srcFilter, srcHint);
+    publish(dst, dstInfo, dstFilter, dstHint);
+    if (src+1 == n) {
+        dirState = (((state >> 32) + 1) << 32);
+    } else {
+        dirState = state + 1;
+    }
+
+    if (second != first) {
+        endUpdate(*second);
+        second->m.unlock();
+    }
+    endUpdate(*first);
+    first->m.unlock();
+    return true;
+}
+
+// Start a segment for the bucket. Buckets with too many segments are
+// merged into the new segment, which then starts a new chain. Merged kvs
+// are copied into the arena.
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::prepareSegment(segmentWrite &w, const HTBucketInfo &cur, int maxSegments, Buffer &b, Arena &a) {
+    w.head = cur;
+    w.filter = bloom.Load(bloomDir, w.id);
+    w.hint = expiryDir[w.id];
+    if (cur.segments <= maxSegments) {
+        w.added = 0;
+        auto now = htNow();
+        for (auto &x: w.kvs) {
+            if (hasKey(x.k, hash(x.k), cur, w.filter, now, b)) {
+                w.added -= !x.v.size;
+            } else {
+                w.added += x.v.size > 0;
+            }
+        }
+    } else {
+        // Relocations are counted by the compaction
+        if (maxSegments >= 0) {
+            metrics.Add(HT_MERGES);
+        }
+        // The new kvs shadow the chain, their operands are folded into it
+        w.merged.Reset(a, cur.count + w.kvs.size());
+        for (auto &x: w.kvs) {
+            w.merged.Call(x.k, x.v, x.flags);
+        }
+        w.kvs.clear();
+        auto coldBytes = 0;
+        DataSize -= VisitBucketKVs<KT, VT>(log, b, &w.head, &w.merged, &coldBytes);
+        coldDataSize -= coldBytes;
+        resolveMerged(w.merged, b, a);
+        auto now = htNow();
+        for (auto &x: w.merged) {
+            if (keepMerged(x.k, x.v, x.flags, now, w.merged.DroppedValues)) {
+               w.kvs.push_back(kv{x.k, x.v, x.flags});
+            }
+        }
+        valueDataSize -= w.merged.DroppedValues;
+
+        w.head = HTBucketInfo();
+        w.head.offset = 0;
+        w.head.version = cur.version+1;
+        w.filter = 0;
+        w.hint = HTExpiryHint();
+        w.added = w.kvs.size();
+    }
+}
+
+template<class KT, class VT, class L, class H>
+int BasicHashTable<KT, VT, L, H>::segmentSize(segmentWrite &w) {
+    return segment::Size(w.kvs, w.cold);
+}
+
+// Write the segment into the reserved log space and advance w.head to the
+// bucket info that references it
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::fillSegment(segmentWrite &w, LogSpace &space, int size) {
+    auto &head = w.head;
+    auto n = w.kvs.size();
+    auto count = min(n, size_t(HT_UNTAGGED));
+    auto deletes = segment::HasDeletes(w.kvs);
+    uint8_t flags = (w.cold ? HT_SEG_COLD : 0) | (deletes ? HT_SEG_DELETES : 0);
+    HTData header {w.id, head.version, flags, uint16_t(count), head.offset};
+    assert(!w.cold || !head.offset);
+
+    auto p = space.Buffer;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+
+    if (w.cold) {
+        // Read under the stripe lock, see recover
+        auto hotTail = log->TailOffset();
+        memcpy(p, &hotTail, sizeof(hotTail));
+        p += sizeof(hotTail);
+    }
+
+    if (deletes) {
+        uint32_t kvs = n;
+        memcpy(p, &kvs, sizeof(kvs));
+        p += sizeof(kvs);
+    }
+
+    auto tags = reinterpret_cast<uint8_t *>(p);
+    if (count != HT_UNTAGGED) {
+        p += count;
+    }
+
+    uint8_t *deleted = nullptr;
+    if (deletes) {
+        deleted = reinterpret_cast<uint8_t *>(p);
+        memset(deleted, 0, (n+7)/8);
+        p += (n+7)/8;
+    }
+
+    for (size_t i=0; i<n; i++) {
+        auto &x = w.kvs[i];
+        auto h = hash(x.k);
+        p = KT::Put(p, x.k);
+        p = VT::Put(p, x.v, x.flags);
+        w.filter |= bloom.Mask(h);
+        addExpiry(w.hint, htExpiry(x.v, x.flags));
+        if (count != HT_UNTAGGED) {
+            tags[i] = tag(h);
+        }
+        if (deleted && !x.v.size) {
+            deleted[i/8] |= 1 << i%8;
+        }
+    }
+    assert(p == space.Buffer + size);
 
-    return readBytes;
+    log->FinalizeWrite(space);
+    DataSize += logBlockSize(size);
+    if (w.cold) {
+        coldDataSize += logBlockSize(size);
+    }
+    logBytes += logBlockSize(size);
+
+    head.count = max(0, min(int(UINT8_MAX), head.count + w.added));
+    if (!head.offset) {
+        head.start = space.Offset;
+    }
+    head.offset = space.Offset;
+    head.segments++;
 }
 
-void HashTable::Dump() {
+// Write kvs as the new chain of the bucket, filter and hint are set to
+// its bloom filter and expiry hint
+template<class KT, class VT, class L, class H>
+HTBucketInfo BasicHashTable<KT, VT, L, H>::writeSegment(int id, const HTBucketInfo &cur, vector<kv> &kvs, uint32_t &filter,
+        HTExpiryHint &hint) {
+    segmentWrite w;
+    w.id = id;
+    w.head = HTBucketInfo();
+    w.head.offset = 0;
+    w.head.version = cur.version+1;
+    w.filter = 0;
+    w.hint = HTExpiryHint();
+
+    for (auto &x: kvs) {
+        w.kvs.push_back(x);
+    }
+    w.added = w.kvs.size();
+
+    auto size = segmentSize(w);
+    auto space = log->ReserveSpace(size);
+    fillSegment(w, space, size);
+    filter = w.filter;
+    hint = w.hint;
+    return w.head;
+}
+
+bool VisitSegmentKVs(const bytes &block, KVCallback *callb) {
+    return HTSegment<VarKey, VarValue>::Visit(block, [callb](const bytes &k, const bytes &v, uint32_t flags) {
+        return callb->Call(k, v, flags);
+    });
+}
+
+bool LookupSegmentKV(const bytes &block, const bytes &key, uint8_t tag, bytes &value, uint32_t &flags) {
+    return HTSegment<VarKey, VarValue>::Lookup(block, key, tag, value, flags);
+}
+
+int VisitBucketKVs(Log *log, Buffer &b, HTBucketInfo *info, KVCallback *callb, int *coldBytes) {
+    return VisitBucketKVs<VarKey, VarValue>(log, b, info, callb, coldBytes);
+}
+
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::Dump() {
     PrintKVCallback cb;
     Buffer b;
-    VisitBucketKVs(log, b, &bucketDir[0], &cb);
+    auto slot = log->Pin();
+    VisitBucketKVs<KT, VT>(log, b, &bucketDir[0], &cb);
+    log->Unpin(slot);
 }
 
-void HashTable::Stats() {
-    cout<<"Fragmentation: "<<GetLogFragmentation()<<endl;
-    /*
-    for (auto i=0;i <numBuckets; i++) {
-        cout<<"Bucket "<<i<<"-"<<int(bucketDir[i].count)<<endl;
+template<class KT, class VT, class L, class H>
+HTStats BasicHashTable<KT, VT, L, H>::GetStats(bool buckets) {
+    HTStats s;
+    for (auto i=0; i<HT_COUNTERS; i++) {
+        s.counters[i] = metrics.Counter(i);
+    }
+    for (auto i=0; i<HT_HISTOGRAMS; i++) {
+        metrics.GetHistogram(i, s.histograms[i]);
+    }
+    log->GetStats(s.log);
+
+    s.buckets = NumBuckets();
+    s.items = numItems;
+    s.fragmentation = GetLogFragmentation();
+    s.writeAmplification = GetWriteAmplification();
+    uint64_t dataSize = DataSize, coldLive = coldDataSize;
+    s.hotSize = log->TailOffset() - log->HeadOffset();
+    s.hotLive = dataSize > coldLive ? dataSize-coldLive : 0;
+    s.coldSize = log->ColdTailOffset() - log->ColdHeadOffset();
+    s.coldLive = coldLive;
+    s.valueSize = log->ValueTailOffset() - log->ValueHeadOffset();
+    s.valueLive = valueDataSize;
+    auto cache = log->Cache();
+    if (cache) {
+        s.cacheHits = cache->Hits();
+        s.cacheMisses = cache->Misses();
     }
-    */
+
+    if (buckets) {
+        // Counts and chain lengths fit in 8 bits
+        s.chainLengths.assign(256, 0);
+        s.occupancy.assign(256, 0);
+        for (uint32_t id=0; id<s.buckets; id++) {
+            auto &st = stripe(id);
+            HTBucketInfo info;
+            while (true) {
+                auto seq = st.seq.load(memory_order_acquire);
+                info = bucketDir[id];
+                atomic_thread_fence(memory_order_acquire);
+                if (!(seq & 1) && st.seq.load(memory_order_relaxed) == seq) {
+                    break;
+                }
+            }
+            s.chainLengths[info.segments]++;
+            s.occupancy[info.count]++;
+        }
+        for (auto v: {&s.chainLengths, &s.occupancy}) {
+            while (v->size() && !v->back()) {
+                v->pop_back();
+            }
+        }
+    }
+    return s;
 }
 
-float HashTable::GetLogFragmentation() {
-    auto logSize = log->TailOffset() - log->HeadOffset();
-    //cout<<"logSize :"<<logSize<<" dataSize :"<<DataSize<<endl;
-    auto wasted = logSize-DataSize;
-    return float(wasted*100)/float(logSize);
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::Stats() {
+    GetStats().Print(cout);
 }
 
-void HashTable::compactLog(float fragThreshold, Buffer &b) {
-    int n;
-    auto offset = log->HeadOffset();
+static void printHistogram(ostream &os, const char *name, const Histogram &h) {
+    if (!h.count) {
+        return;
+    }
+    os<<name<<" latency(ns) count: "<<h.count<<" mean: "<<uint64_t(h.Mean())<<" p50: "<<h.Percentile(0.5)
+        <<" p99: "<<h.Percentile(0.99)<<" p99.9: "<<h.Percentile(0.999)<<" max: "<<h.max<<endl;
+}
+
+static void printDistribution(ostream &os, const char *name, const vector<uint64_t> &v) {
+    os<<name<<":";
+    for (size_t i=0; i<v.size(); i++) {
+        if (v[i]) {
+            os<<" "<<i<<"="<<v[i];
+        }
+    }
+    os<<endl;
+}
+
+void HTStats::Print(ostream &os) const {
+    os<<"Fragmentation: "<<fragmentation<<endl;
+    os<<"Buckets: "<<buckets<<" Items: "<<items<<endl;
+    os<<"Write amplification: "<<writeAmplification<<endl;
+    os<<"Cold log: "<<coldSize<<" bytes, live: "<<coldLive<<endl;
+    os<<"Value log: "<<valueSize<<" bytes, live: "<<valueLive<<endl;
+    if (cacheHits || cacheMisses) {
+        os<<"Cache hits: "<<cacheHits<<" misses: "<<cacheMisses<<endl;
+    }
+
+#ifdef USE_METRICS
+    auto &c = counters;
+    auto gets = max(c[HT_GETS], uint64_t(1));
+    os<<"Gets: "<<c[HT_GETS]<<" hits: "<<c[HT_GET_HITS]<<" bloom negatives: "<<c[HT_BLOOM_NEGATIVES]
+        <<" false positives: "<<c[HT_BLOOM_FALSE_POSITIVES]<<" segments/get: "<<double(c[HT_SEGMENTS_READ])/gets
+        <<" bytes read/get: "<<double(c[HT_BYTES_READ])/gets<<endl;
+    os<<"Sets: "<<c[HT_SETS]<<" deletes: "<<c[HT_DELETES]<<" operands: "<<c[HT_OPERANDS]<<" merges: "<<c[HT_MERGES]<<endl;
+    os<<"Compactions: "<<c[HT_COMPACTIONS]<<" compacted bytes: "<<c[HT_COMPACTED_BYTES]
+        <<" relocated bytes: "<<c[HT_RELOCATED_BYTES]<<endl;
+    os<<"Expired: "<<c[HT_EXPIRED]<<" expiry rewrites: "<<c[HT_EXPIRY_REWRITES]<<" unresolved: "<<c[HT_UNRESOLVED]<<endl;
+    printHistogram(os, "Get", histograms[HT_GET_LATENCY]);
+    printHistogram(os, "Set", histograms[HT_SET_LATENCY]);
+    printHistogram(os, "Compaction", histograms[HT_COMPACT_LATENCY]);
+
+    auto &l = log.counters;
+    if (l[LOG_DISK_READS] || l[LOG_DISK_WRITES]) {
+        os<<"Disk reads: "<<l[LOG_DISK_READS]<<" bytes: "<<l[LOG_DISK_READ_BYTES]<<" writes: "<<l[LOG_DISK_WRITES]
+            <<" bytes: "<<l[LOG_DISK_WRITE_BYTES]<<" flush waits: "<<l[LOG_FLUSH_WAITS]<<" syncs: "<<l[LOG_SYNCS]<<endl;
+    }
+    printHistogram(os, "Read", log.histograms[LOG_READ_LATENCY]);
+    printHistogram(os, "Write", log.histograms[LOG_WRITE_LATENCY]);
+    printHistogram(os, "Flush wait", log.histograms[LOG_FLUSH_WAIT_LATENCY]);
+    printHistogram(os, "Sync", log.histograms[LOG_SYNC_LATENCY]);
+#endif
+
+    if (chainLengths.size()) {
+        printDistribution(os, "Chain lengths", chainLengths);
+        printDistribution(os, "Occupancy", occupancy);
+    }
+}
+
+template<class KT, class VT, class L, class H>
+float BasicHashTable<KT, VT, L, H>::GetWriteAmplification() {
+    if (!userBytes) {
+        return 0;
+    }
+    return float(logBytes)/float(userBytes);
+}
+
+// Bytes between head and tail of all logs
+template<class KT, class VT, class L, class H>
+uint64_t BasicHashTable<KT, VT, L, H>::logSize() {
+    return (log->TailOffset() - log->HeadOffset()) + (log->ColdTailOffset() - log->ColdHeadOffset()) +
+        (log->ValueTailOffset() - log->ValueHeadOffset());
+}
+
+template<class KT, class VT, class L, class H>
+float BasicHashTable<KT, VT, L, H>::GetLogFragmentation() {
+    auto size = logSize();
+    //cout<<"logSize :"<<size<<" dataSize :"<<DataSize<<endl;
+    uint64_t dataSize = DataSize + valueDataSize;
+    if (dataSize >= size) {
+        return 0;
+    }
+    auto wasted = size-dataSize;
+    return float(wasted*100)/float(size);
+}
+
+// Above the budget the compactor runs down to lowWatermark, which is as
+// long as throttle stalls the writers
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::compactionDue() {
+    auto frag = GetLogFragmentation();
+    return frag > compactOpts.highWatermark ||
+        (frag > compactOpts.lowWatermark && logSize() > compactOpts.logBudget);
+}
+
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::compactLog(float fragThreshold, Buffer &b) {
     while (GetLogFragmentation() > fragThreshold) {
-        auto block = log->Read(offset, sizeof(HTData), b, n);
+        if (!compactStep(b)) {
+            break;
+        }
+    }
+}
 
-        // Ignore padding block
-        if (n < 0) {
-            offset += logBlockSize(-n);
+// Relocate the block at the head of the hot, the cold or the value log if
+// it is still live and trim it from its log. The log with the smallest
+// share of live bytes goes first, it frees the most space per byte
+// relocated. Returns false if all logs are empty.
+// The caller must hold the compaction lock.
+template<class KT, class VT, class L, class H>
+bool BasicHashTable<KT, VT, L, H>::compactStep(Buffer &b) {
+    LogOffset heads[] = {log->HeadOffset(), log->ColdHeadOffset(), log->ValueHeadOffset()};
+    LogOffset tails[] = {log->TailOffset(), log->ColdTailOffset(), log->ValueTailOffset()};
+    uint64_t dataSize = DataSize, coldLive = coldDataSize;
+    uint64_t live[] = {dataSize > coldLive ? dataSize-coldLive : 0, coldLive, valueDataSize};
+
+    auto victim = -1;
+    double minShare = 0;
+    for (auto i=0; i<3; i++) {
+        if (heads[i] >= tails[i]) {
             continue;
         }
+        auto share = double(live[i])/(tails[i]-heads[i]);
+        if (victim < 0 || share < minShare) {
+            victim = i;
+            minShare = share;
+        }
+    }
+
+    if (victim < 0) {
+        return false;
+    }
+
+    MetricTimer t;
+    metrics.Add(HT_COMPACTIONS);
+    auto offset = heads[victim];
+    if (victim == 2) {
+        compactValue(offset, b);
+        metrics.Record(HT_COMPACT_LATENCY, t);
+        return true;
+    }
 
-        HTData *header = (HTData*)(block.data);
-        if (!header->nextOffset) {
-            auto bInfo = &bucketDir[header->bucketID];
-            if (bInfo->version == header->version) {
-                kvs.clear();
-                writeHTData(header->bucketID, bInfo, kvs, -1);
+    int n;
+    auto block = log->Read(offset, sizeof(HTData), b, n);
+
+    // Ignore padding block
+    if (n < 0) {
+        log->TrimLog(offset + logBlockSize(-n));
+        metrics.Add(HT_COMPACTED_BYTES, logBlockSize(-n));
+        metrics.Record(HT_COMPACT_LATENCY, t);
+        return true;
+    }
+
+    // Chains start either with a block without a next offset or, when they
+    // were relocated to the cold log, with the first hot block written on
+    // top of it. Later blocks of a live chain come after its start in the
+    // hot log, so they are dead once the chain is relocated. A start is
+    // live while the bucket still begins its chain there.
+    HTData header = *(HTData*)(block.data);
+    if (!header.nextOffset || (header.nextOffset & LOG_COLD_BIT)) {
+        auto &st = stripe(header.bucketID);
+        lock_guard<mutex> lock(st.m);
+        auto bInfo = &bucketDir[header.bucketID];
+        if (bInfo->start == (header.nextOffset ? header.nextOffset : offset)) {
+            vector<kv> kvs;
+            metrics.Add(HT_RELOCATED_BYTES, writeHTData(header.bucketID, bInfo, kvs, -1, compactOpts.segregate));
+        }
+    }
+
+    log->TrimLog(offset + logBlockSize(n));
+    metrics.Add(HT_COMPACTED_BYTES, logBlockSize(n));
+    metrics.Record(HT_COMPACT_LATENCY, t);
+    return true;
+}
+
+// Move the value at the head of the value log to its tail if its key
+// still references it, the new reference is written like an update
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::compactValue(LogOffset offset, Buffer &b) {
+    static thread_local Buffer lBuf;
+    static thread_local Arena vArena;
+    int n;
+    log->Read(offset, keyLenSize, b, n);
+
+    // Ignore padding block
+    if (n < 0) {
+        log->TrimLog(offset + logBlockSize(-n));
+        metrics.Add(HT_COMPACTED_BYTES, logBlockSize(-n));
+        return;
+    }
+
+    auto block = log->Read(offset, b);
+    auto kl = *(uint16_t*)(block.data);
+    auto key = bytes(block.data+keyLenSize, kl);
+    auto h = hash(key);
+    auto id = lockBucket(h);
+
+    bytes v;
+    uint32_t flags;
+    HTValueRef r;
+    auto from = bucketDir[id].offset;
+    auto found = findKV(key, h, from, lBuf, v, flags), operands = false;
+    while (found && (flags & HT_VALUE_OPERAND)) {
+        operands = true;
+        found = findKV(key, h, from, lBuf, v, flags);
+    }
+    if (found && (flags & HT_VALUE_REF) && (memcpy(&r, htValue(v, flags).data, sizeof(r)), r.offset == offset)) {
+        vector<kv> kvs;
+        if (operands || htExpired(v, flags, htNow())) {
+            // A new reference would shadow the operands, merging the
+            // chain folds them into the value instead. Expired values are
+            // dropped by the merge.
+            auto size = writeHTData(id, &bucketDir[id], kvs, -1);
+            metrics.Add(HT_RELOCATED_BYTES, size);
+        } else {
+            vArena.Reset();
+            kvs.push_back(valueKV(key, bytes(block.data+keyLenSize+kl, r.size), htExpiry(v, flags), vArena));
+            auto size = writeHTData(id, &bucketDir[id], kvs, maxSegments);
+            metrics.Add(HT_RELOCATED_BYTES, size + logBlockSize(n));
+        }
+    }
+    stripe(id).m.unlock();
+
+    log->TrimLog(offset + logBlockSize(n));
+    metrics.Add(HT_COMPACTED_BYTES, logBlockSize(n));
+}
+
+// Rewrite the buckets whose expiry hint has passed, merging their chains
+// drops the expired kvs. A sweep starts once the earliest hint passed and
+// scans HT_EXPIRE_SCAN buckets per call, so that inline calls from writers
+// stay short. Of the scanned buckets the ones with the largest share of
+// expiring kvs go first, the rest wait for the next sweep a second later.
+// The caller must hold the compaction lock.
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::expireBuckets() {
+    auto now = htNow();
+    if (!sweeping) {
+        if (nextExpiry.load(memory_order_relaxed) == UINT32_MAX || now < nextExpiry || now == lastExpirySweep) {
+            return;
+        }
+        lastExpirySweep = now;
+        // Updates during the sweep lower it again
+        nextExpiry = UINT32_MAX;
+        sweeping = true;
+        expiryCursor = 0;
+        sweepExpiry = UINT32_MAX;
+    }
+
+    vector<pair<double, uint32_t>> due;
+    uint32_t nb = NumBuckets();
+    auto end = min(nb, expiryCursor + HT_EXPIRE_SCAN);
+    for (auto id=expiryCursor; id<end; id++) {
+        auto hint = expiryDir[id];
+        if (hint.expires && hint.expires <= now) {
+            due.push_back(make_pair(double(hint.count)/max(1, int(bucketDir[id].count)), id));
+        } else if (hint.expires) {
+            sweepExpiry = min(sweepExpiry, hint.expires);
+        }
+    }
+    expiryCursor = end;
+    sort(due.begin(), due.end(), greater<pair<double, uint32_t>>());
+
+    for (size_t i=0; i<due.size(); i++) {
+        auto id = due[i].second;
+        if (i >= size_t(HT_EXPIRE_BATCH)) {
+            sweepExpiry = now;
+            break;
+        }
+
+        lock_guard<mutex> lock(stripe(id).m);
+        auto hint = expiryDir[id];
+        if (!hint.expires || hint.expires > now) {
+            lowerNextExpiry(hint.expires);
+            continue;
+        }
+        vector<kv> kvs;
+        metrics.Add(HT_RELOCATED_BYTES, writeHTData(id, &bucketDir[id], kvs, -1));
+        metrics.Add(HT_EXPIRY_REWRITES);
+    }
+
+    if (expiryCursor >= nb) {
+        sweeping = false;
+        lowerNextExpiry(sweepExpiry);
+    }
+}
+
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::StartCompactor(const CompactionOptions &opts) {
+    lock_guard<mutex> lock(m);
+    if (compactorRunning) {
+        return;
+    }
+
+    compactOpts = opts;
+    compactorRunning = true;
+    compactor = thread(&BasicHashTable::runCompactor, this);
+}
+
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::StopCompactor() {
+    {
+        lock_guard<mutex> lock(m);
+        if (!compactorRunning) {
+            return;
+        }
+        compactorRunning = false;
+        compactCond.notify_all();
+        stallCond.notify_all();
+    }
+
+    compactor.join();
+}
+
+// Background compaction loop. Writers only contend with the compactor on
+// the stripe of the bucket being relocated.
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::runCompactor() {
+    Buffer b;
+    while (compactorRunning) {
+        {
+            lock_guard<mutex> lock(compactLock);
+            expireBuckets();
+        }
+        if (!compactionDue()) {
+            unique_lock<mutex> lock(m);
+            compactCond.wait_for(lock, chrono::milliseconds(10));
+            continue;
+        }
+
+        lock_guard<mutex> lock(compactLock);
+        while (compactorRunning && GetLogFragmentation() > compactOpts.lowWatermark) {
+            if (!compactStep(b)) {
+                break;
             }
+            stallCond.notify_all();
+        }
+    }
+}
+
+// Take a fuzzy copy of the directory. Every stripe is copied under its lock,
+// so writers wait for the copy of at most one stripe. Buckets updated after
+// the copy started are rebuilt by replaying the log from the tail taken
+// before the copy: an update that was reserved before it holds the stripe
+// lock until it is published, so it is either in the copy or replayed.
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::Checkpoint() {
+    if (checkpointPath == "") {
+        return;
+    }
+
+    lock_guard<mutex> lock(checkpointLock);
+    HTCheckpointHeader hdr;
+    hdr.magic = HT_CHECKPOINT_MAGIC;
+    hdr.initBuckets = initBuckets;
+    hdr.head = log->HeadOffset();
+    hdr.tail = log->TailOffset();
+    // Read after the hot tail, see recover
+    hdr.coldHead = log->ColdHeadOffset();
+    hdr.coldTail = log->ColdTailOffset();
+    hdr.valueHead = log->ValueHeadOffset();
+    hdr.valueTail = log->ValueTailOffset();
+    hdr.dataSize = DataSize;
+    hdr.coldDataSize = coldDataSize;
+    hdr.valueDataSize = valueDataSize;
+    hdr.bloomBits = bloom.Bits();
+
+    vector<HTBucketInfo> dir;
+    vector<uint8_t> filters;
+    vector<HTExpiryHint> hints;
+    for (auto s=0; s<HT_LOCK_STRIPES; s++) {
+        lock_guard<mutex> sl(stripes[s].m);
+        uint32_t n = NumBuckets();
+        if (dir.size() < n) {
+            dir.resize(n);
+            filters.resize(n*bloom.Bytes() + sizeof(uint32_t));
+            hints.resize(n);
+        }
+        for (auto id=uint32_t(s); id<n; id += HT_LOCK_STRIPES) {
+            dir[id] = bucketDir[id];
+            bloom.Store(filters.data(), id, bloom.Load(bloomDir, id));
+            hints[id] = expiryDir[id];
         }
+    }
+    hdr.numBuckets = dir.size();
+
+    // The copy may reference any block reserved so far
+    log->Sync();
+
+    auto tmpPath = checkpointPath + ".tmp";
+    auto fd = open(tmpPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    assert(fd > 0);
+
+    string page(ALIGN_SIZE, '\0');
+    memcpy(&page[0], &hdr, sizeof(hdr));
+    auto r = write(fd, page.data(), page.size());
+    assert(r == ssize_t(page.size()));
+
+    auto size = sizeof(HTBucketInfo)*dir.size();
+    auto data = reinterpret_cast<const char *>(dir.data());
+    for (size_t off=0; off<size; off += r) {
+        r = write(fd, data+off, size-off);
+        assert(r > 0);
+    }
+
+    // The directory, the filters and the expiry hints are mapped in whole
+    // pages on recovery
+    auto padded = ((size+ALIGN_SIZE-1)/ALIGN_SIZE)*ALIGN_SIZE;
+    auto fsize = dir.size()*bloom.Bytes();
+    data = reinterpret_cast<const char *>(filters.data());
+    for (size_t off=0; off<fsize; off += r) {
+        r = pwrite(fd, data+off, fsize-off, ALIGN_SIZE+padded+off);
+        assert(r > 0);
+    }
+
+    padded += ((fsize+ALIGN_SIZE-1)/ALIGN_SIZE)*ALIGN_SIZE;
+    auto hsize = sizeof(HTExpiryHint)*hints.size();
+    data = reinterpret_cast<const char *>(hints.data());
+    for (size_t off=0; off<hsize; off += r) {
+        r = pwrite(fd, data+off, hsize-off, ALIGN_SIZE+padded+off);
+        assert(r > 0);
+    }
+
+    r = ftruncate(fd, ALIGN_SIZE+padded+((hsize+ALIGN_SIZE-1)/ALIGN_SIZE)*ALIGN_SIZE);
+    assert(r == 0);
+    r = fsync(fd);
+    assert(r == 0);
+    close(fd);
+
+    r = rename(tmpPath.c_str(), checkpointPath.c_str());
+    assert(r == 0);
+    // Padding of the synced buffer does not count towards the interval
+    checkpointTail = log->TailOffset();
+}
 
-        offset += logBlockSize(n);
-        log->TrimLog(offset);
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::StartCheckpointer(uint64_t interval) {
+    lock_guard<mutex> lock(m);
+    if (checkpointerRunning) {
+        return;
     }
+
+    checkpointInterval = interval;
+    checkpointerRunning = true;
+    checkpointer = thread(&BasicHashTable::runCheckpointer, this);
 }
+
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::StopCheckpointer() {
+    {
+        lock_guard<mutex> lock(m);
+        if (!checkpointerRunning) {
+            return;
+        }
+        checkpointerRunning = false;
+        checkpointCond.notify_all();
+    }
+
+    checkpointer.join();
+}
+
+template<class KT, class VT, class L, class H>
+void BasicHashTable<KT, VT, L, H>::runCheckpointer() {
+    while (checkpointerRunning) {
+        if (log->TailOffset() - checkpointTail < checkpointInterval) {
+            unique_lock<mutex> lock(m);
+            checkpointCond.wait_for(lock, chrono::milliseconds(100));
+            continue;
+        }
+
+        Checkpoint();
+    }
+}
+
+// Tables in use, a table of other key or value sizes or of another log
+// type needs its own instantiation
+template class BasicHashTable<VarKey, VarValue>;
+template class BasicHashTable<FixedKey<8>, FixedValue<16>>;
+template class BasicHashTable<VarKey, VarValue, InMemoryLog>;
+template class BasicHashTable<VarKey, VarValue, PersistentLog>;
+template class BasicHashTable<VarKey, VarValue, Log, CRC32CHash>;
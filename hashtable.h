@@ -4,107 +4,922 @@
 #include <string>
 #include <vector>
 #include <atomic>
-#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <new>
 #include <string.h>
+#include <time.h>
 #include "common.h"
 #include "log.h"
-#include "murmurhash3.h"
+#include "hash.h"
 #include "bloom.h"
 
 #define USE_BLOOMFILTER
 #define WRITE_BUFFER_SIZE 1024*1024
+#define BLOCK_CACHE_SIZE 256*1024*1024
+
+// Upper bound for the bucket directory, it is reserved upfront and
+// populated on demand as buckets get split
+const uint32_t HT_MAX_BUCKETS = 1<<26;
+// Average items per bucket that triggers the next bucket split
+const int HT_SPLIT_LOAD = 8;
+// Number of bucket lock stripes shared by writers
+const int HT_LOCK_STRIPES = 1024;
+// Most buckets rewritten by one step of a sweep of expired kvs, and the
+// buckets whose hints it scans
+const int HT_EXPIRE_BATCH = 64;
+const int HT_EXPIRE_SCAN = 4096;
+// Log bytes written between two background checkpoints
+const uint64_t HT_CHECKPOINT_INTERVAL = static_cast<uint64_t>(1024)*1024*1024;
+const uint64_t HT_CHECKPOINT_MAGIC = 0x33706b6368736168ULL;
+// Default width of the bucket bloom filters
+const int HT_BLOOM_BITS = 32;
 
 using namespace std;
 
+// Offset is the latest segment of the chain and start the block the
+// chain begins with, see compactStep. Count is the number of live keys in
+// the chain, overwrites do not add to it. It saturates at 255, and chains
+// rebuilt by recovery count every kv, until they are next merged.
 struct HTBucketInfo {
-    LogOffset offset;
+    LogOffset offset, start;
     uint8_t segments;
     uint8_t version;
     uint8_t count;
-    // 5 bytes bloom filter
-    uint8_t bloom;
-    uint32_t _bloom;
 
-    HTBucketInfo() :offset(0), count(0), segments(0), bloom(0), _bloom(0) {}
+    HTBucketInfo() :offset(0), start(0), count(0), segments(0) {}
 };
 
+// Segment header. The 8 bit tags of the keys follow it in kv order, so
+// that lookups only compare the keys whose tag matches. Segments of
+// HT_UNTAGGED kvs or more have no tags.
 struct HTData {
     uint32_t bucketID;
     uint8_t version;
+    uint8_t flags;
+    uint16_t count;
     LogOffset nextOffset;
 };
 
+const uint16_t HT_UNTAGGED = UINT16_MAX;
+// Segments in the cold log start a new chain, the tail of the hot log at
+// the time of the write comes before their tags. Recovery merges the cold
+// log into the replay of the hot log by it.
+const uint8_t HT_SEG_COLD = 1;
+
+// Values stored apart from their keys. The value log holds the length of
+// the key, the key and the value, the segment holds an HTValueRef to it
+// and HT_VALUE_REF is set in its value length.
+struct HTValueRef {
+    LogOffset offset;
+    uint32_t size;
+};
+
+const uint32_t HT_VALUE_REF = 1u<<31;
+// Merge operands, see HashTable::Merge. The value holds the id of the
+// merge operator followed by the operand.
+const uint32_t HT_VALUE_OPERAND = 1u<<30;
+// Kvs that expire, the value is prefixed with the expiry time in seconds
+// since the epoch. Expired kvs read as deleted.
+const uint32_t HT_VALUE_EXPIRES = 1u<<29;
+// Flags of the kvs kept in the top bits of the value length
+const uint32_t HT_VALUE_FLAGS = HT_VALUE_REF | HT_VALUE_OPERAND | HT_VALUE_EXPIRES;
+
+// Clock of the expiry times
+inline uint32_t htNow() {
+    return uint32_t(time(nullptr));
+}
+
+// Expiry time of a stored value, 0 if it does not expire
+inline uint32_t htExpiry(const bytes &v, uint32_t flags) {
+    uint32_t expires = 0;
+    if (flags & HT_VALUE_EXPIRES) {
+        memcpy(&expires, v.data, sizeof(expires));
+    }
+    return expires;
+}
+
+inline bool htExpired(const bytes &v, uint32_t flags, uint32_t now) {
+    auto expires = htExpiry(v, flags);
+    return expires && expires <= now;
+}
+
+// A stored value without its expiry time
+inline bytes htValue(const bytes &v, uint32_t flags) {
+    if (flags & HT_VALUE_EXPIRES) {
+        return bytes(v.data+sizeof(uint32_t), v.size-int(sizeof(uint32_t)));
+    }
+    return v;
+}
+
+// Earliest expiry time of the kvs written to a bucket chain since it was
+// last merged, and their number. Expires is 0 if none of them expire.
+struct HTExpiryHint {
+    uint32_t expires;
+    uint8_t count;
+};
+
+// First page of a checkpoint file, the bucket directory, the bloom filters
+// and the expiry hints follow it, each padded to whole pages. Recovery replays the log
+// from tail on top of the directory.
+struct HTCheckpointHeader {
+    uint64_t magic;
+    uint32_t initBuckets;
+    uint32_t numBuckets;
+    LogOffset head, tail;
+    uint64_t dataSize;
+    uint32_t bloomBits;
+    LogOffset coldHead, coldTail;
+    uint64_t coldDataSize;
+    LogOffset valueHead, valueTail;
+    uint64_t valueDataSize;
+};
+
 const int keyLenSize = 2;
 const int valLenSize = 4;
 
+// Bytes of the value log block that ref points to
+inline uint64_t valueRecordSize(const bytes &key, const bytes &ref) {
+    HTValueRef r;
+    memcpy(&r, ref.data, sizeof(r));
+    return logBlockSize(keyLenSize + key.size + r.size);
+}
+
+// Flags are HT_VALUE_FLAGS, with HT_VALUE_REF set v holds an HTValueRef
 struct kv {
     const bytes k, v;
+    uint32_t flags;
 };
 
+// Encodings of the keys and values in the segments, a table is specialized
+// for them with BasicHashTable<KeyTraits, ValueTraits>. Variable sized keys
+// and values are prefixed with their length. Fixed size ones are stored as
+// they are, so that the kvs of a segment of fixed size keys and values are
+// an array. Size is 0 for variable sized encodings.
+struct VarKey {
+    static const int Size = 0;
 
-const bytes deleteValue;
+    static int EncodedSize(const bytes &k) {
+        return keyLenSize + k.size;
+    }
+
+    static char *Put(char *p, const bytes &k) {
+        uint16_t kl = k.size;
+        memcpy(p, &kl, keyLenSize);
+        memcpy(p+keyLenSize, k.data, k.size);
+        return p + keyLenSize + k.size;
+    }
+
+    // Decode the key at p and advance p past it
+    static bytes Get(char *&p) {
+        uint16_t kl = *(uint16_t*)p;
+        auto k = bytes(p+keyLenSize, kl);
+        p += keyLenSize + kl;
+        return k;
+    }
+
+    // Compare the key at p with k
+    static bool Equal(const char *p, const bytes &k) {
+        return *(uint16_t*)p == k.size && memcmp(p+keyLenSize, k.data, k.size) == 0;
+    }
+};
+
+template<int N>
+struct FixedKey {
+    static_assert(N > 0 && N < 4096, "fixed keys are 1 to 4095 bytes");
+    static const int Size = N;
 
-class HashTable {
+    static int EncodedSize(const bytes &k) {
+        return N;
+    }
+
+    static char *Put(char *p, const bytes &k) {
+        memcpy(p, k.data, N);
+        return p + N;
+    }
+
+    static bytes Get(char *&p) {
+        auto k = bytes(p, N);
+        p += N;
+        return k;
+    }
+
+    // A memcmp of constant size compiles to integer compares
+    static bool Equal(const char *p, const bytes &k) {
+        return k.size == N && memcmp(p, k.data, N) == 0;
+    }
+};
+
+struct VarValue {
+    static const int Size = 0;
+
+    static int EncodedSize(const bytes &v) {
+        return valLenSize + v.size;
+    }
+
+    static char *Put(char *p, const bytes &v, uint32_t flags) {
+        assert(!(uint32_t(v.size) & HT_VALUE_FLAGS));
+        uint32_t vl = uint32_t(v.size) | flags;
+        memcpy(p, &vl, valLenSize);
+        memcpy(p+valLenSize, v.data, v.size);
+        return p + valLenSize + v.size;
+    }
+
+    // Decode the value at p and advance p past it
+    static void Get(char *&p, bytes &v, uint32_t &flags) {
+        uint32_t vl = *(uint32_t*)p;
+        v = bytes(p+valLenSize, vl & ~HT_VALUE_FLAGS);
+        flags = vl & HT_VALUE_FLAGS;
+        p += valLenSize + v.size;
+    }
+};
+
+// Fixed size values are never moved to the value log and take no merge
+// operands. Deleted keys keep a zeroed value, see HT_SEG_DELETES.
+template<int N>
+struct FixedValue {
+    static_assert(N > 0 && N < 4096, "fixed values are 1 to 4095 bytes");
+    static const int Size = N;
+
+    static int EncodedSize(const bytes &v) {
+        return N;
+    }
+
+    static char *Put(char *p, const bytes &v, uint32_t flags) {
+        assert(!flags && (!v.size || v.size == N));
+        if (v.size) {
+            memcpy(p, v.data, N);
+        } else {
+            memset(p, 0, N);
+        }
+        return p + N;
+    }
+
+    static void Get(char *&p, bytes &v, uint32_t &flags) {
+        v = bytes(p, N);
+        flags = 0;
+        p += N;
+    }
+};
+
+// Segments of fixed size values that hold deleted keys. The number of kvs
+// comes before the tags and a bitmap of the deleted kvs after them.
+const uint8_t HT_SEG_DELETES = 2;
+
+// Reads the segments of a layout. Callbacks are called with the kvs as
+// stored in the segments and are inlined.
+template<class KT, class VT>
+struct HTSegment {
+    // Bytes per kv when the kvs are an array, 0 otherwise
+    static const int Stride = KT::Size && VT::Size ? KT::Size + VT::Size : 0;
+
+    static const HTData &Header(const bytes &block) {
+        return *(HTData*)(block.data);
+    }
+
+    // Offset of the tags
+    static size_t Tags(const HTData &header) {
+        return sizeof(HTData) + (header.flags & HT_SEG_COLD ? sizeof(LogOffset) : 0) +
+            (header.flags & HT_SEG_DELETES ? sizeof(uint32_t) : 0);
+    }
+
+    // Bitmap of the deleted kvs, null if the segment has none
+    static uint8_t *Deleted(const bytes &block) {
+        auto &header = Header(block);
+        if (!VT::Size || !(header.flags & HT_SEG_DELETES)) {
+            return nullptr;
+        }
+        auto off = Tags(header) + (header.count == HT_UNTAGGED ? 0 : header.count);
+        return reinterpret_cast<uint8_t *>(block.data + off);
+    }
+
+    // Offset of the first kv
+    static size_t KVs(const bytes &block) {
+        auto &header = Header(block);
+        auto off = Tags(header) + (header.count == HT_UNTAGGED ? 0 : header.count);
+        if (VT::Size && (header.flags & HT_SEG_DELETES)) {
+            auto n = *(uint32_t*)(block.data + Tags(header) - sizeof(uint32_t));
+            off += (n+7)/8;
+        }
+        return off;
+    }
+
+    static bool HasDeletes(const vector<kv> &kvs) {
+        for (auto &x: kvs) {
+            if (VT::Size && !x.v.size) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Bytes of a segment of kvs
+    static int Size(const vector<kv> &kvs, bool cold) {
+        int size = sizeof(HTData) + (cold ? sizeof(LogOffset) : 0);
+        if (kvs.size() < HT_UNTAGGED) {
+            size += kvs.size();
+        }
+        if (HasDeletes(kvs)) {
+            size += sizeof(uint32_t) + (kvs.size()+7)/8;
+        }
+        if (Stride) {
+            return size + Stride*kvs.size();
+        }
+        for (auto &x: kvs) {
+            size += KT::EncodedSize(x.k) + VT::EncodedSize(x.v);
+        }
+        return size;
+    }
+
+    // Returns false if the callback stopped
+    template<class F>
+    static bool Visit(const bytes &block, F &&f) {
+        auto deleted = Deleted(block);
+        auto p = block.data + KVs(block), end = block.data + block.size;
+        for (uint32_t i=0; p<end; i++) {
+            auto k = KT::Get(p);
+            bytes v;
+            uint32_t flags;
+            VT::Get(p, v, flags);
+            if (deleted && (deleted[i/8] & (1 << i%8))) {
+                v.size = 0;
+            }
+            if (!f(k, v, flags)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // memchr finds the candidate tags many at a time, a segment without one
+    // is passed over without decoding a single kv. The first match is the
+    // latest kv of the key in the segment. Arrays of kvs are indexed by the
+    // tag position.
+    static bool Lookup(const bytes &block, const bytes &key, uint8_t tag, bytes &value, uint32_t &flags) {
+        auto &header = Header(block);
+        if (header.count == HT_UNTAGGED) {
+            auto found = false;
+            Visit(block, [&](const bytes &k, const bytes &v, uint32_t f) {
+                if (!(k == key)) {
+                    return true;
+                }
+                found = true;
+                value = v;
+                flags = f;
+                return false;
+            });
+            return found;
+        }
+
+        auto tags = block.data + Tags(header);
+        auto end = tags + header.count;
+        auto kvs = block.data + KVs(block);
+        auto p = kvs;
+        auto pos = tags;
+        for (auto t = tags; (t = static_cast<char *>(memchr(t, tag, end-t))); t++) {
+            if (Stride) {
+                p = kvs + (t-tags)*Stride;
+            } else {
+                for (; pos < t; pos++) {
+                    KT::Get(p);
+                    bytes v;
+                    uint32_t f;
+                    VT::Get(p, v, f);
+                }
+            }
+
+            if (KT::Equal(p, key)) {
+                auto i = t-tags;
+                KT::Get(p);
+                VT::Get(p, value, flags);
+                auto deleted = Deleted(block);
+                if (deleted && (deleted[i/8] & (1 << i%8))) {
+                    value.size = 0;
+                }
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+// Number of merge operators a table can have registered
+const int HT_MERGE_OPERATORS = 16;
+// Operand id of the operands of a key that could not be folded because
+// an operator was not registered. They are packed into a single operand
+// together with the value they apply to.
+const uint8_t HT_MERGE_PACKED = UINT8_MAX;
+
+// Folds the merge operands of a key into its value, see HashTable::Merge
+class MergeOperator {
+public:
+    virtual ~MergeOperator() {}
+
+    // Set result to value with the operands applied oldest first. Value is
+    // null for keys that are not in the table.
+    virtual void Merge(const bytes &key, const bytes *value, const vector<bytes> &operands, string &result) = 0;
+};
+
+// Adds 64 bit little endian integers to a counter, missing counters are 0
+class CounterMergeOperator: public MergeOperator {
+public:
+    void Merge(const bytes &key, const bytes *value, const vector<bytes> &operands, string &result) {
+        int64_t n = 0;
+        if (value && value->size == sizeof(n)) {
+            memcpy(&n, value->data, sizeof(n));
+        }
+        for (auto &op: operands) {
+            int64_t d = 0;
+            memcpy(&d, op.data, min(size_t(op.size), sizeof(d)));
+            n += d;
+        }
+        result.assign(reinterpret_cast<char *>(&n), sizeof(n));
+    }
+};
+
+// Appends the operands to the value
+class AppendMergeOperator: public MergeOperator {
 public:
+    void Merge(const bytes &key, const bytes *value, const vector<bytes> &operands, string &result) {
+        result.clear();
+        if (value) {
+            result.append(value->data, value->size);
+        }
+        for (auto &op: operands) {
+            result.append(op.data, op.size);
+        }
+    }
+};
 
-    HashTable(int nb, const string &filepath);
+template<class H>
+class BasicDedupKVCallback;
+
+template<class KeyTraits=VarKey, class ValueTraits=VarValue, class LogType=Log, class HashPolicy=Murmur32Hash>
+class BasicHashTable;
+
+// A set of updates applied with HashTable::Write. Keys and values are
+// copied into the batch, later updates of a key override earlier ones.
+class WriteBatch {
+public:
+    // Expires as in HashTable::Set
+    void Put(const bytes &key, const bytes &value, uint32_t expires=0);
 
     void Delete(const bytes &key);
 
-    void Set(const bytes &key, const bytes &value);
+    void Clear();
+
+    int Count() {
+        return int(entries.size());
+    }
+
+private:
+    template<class, class, class, class> friend class BasicHashTable;
+
+    struct entry {
+        size_t keyOffset;
+        int keySize;
+        size_t valOffset;
+        int valSize;
+        uint32_t expires;
+    };
+
+    string data;
+    vector<entry> entries;
+};
+
+
+const bytes deleteValue;
+
+// Log fragmentation (in percent) thresholds for the background compactor.
+// Compaction starts above highWatermark, or above lowWatermark once the
+// live log exceeds logBudget, and runs until the fragmentation drops below
+// lowWatermark. Writers are only stalled when the live log
+// exceeds logBudget and compaction can still reclaim space. With segregate
+// set live buckets are relocated into the cold log, otherwise to the tail
+// of the hot log.
+struct CompactionOptions {
+    float highWatermark;
+    float lowWatermark;
+    uint64_t logBudget;
+    bool segregate;
+
+    CompactionOptions() :highWatermark(30), lowWatermark(20), logBudget(LOG_MAXSIZE/2), segregate(true) {}
+};
+
+// Writers serialize on the stripe mutex, readers validate their copy of a
+// bucket against the stripe sequence number (seqlock) and never block
+struct alignas(64) HTLockStripe {
+    mutex m;
+    atomic<uint32_t> seq;
+
+    HTLockStripe() :seq(0) {}
+};
+
+// A value looked up with HashTable::Get. Values of tables in memory are
+// not copied, the log space they point into is pinned until the handle is
+// released, which has to happen before the table is destroyed. A thread
+// should only hold a few handles at a time, every handle takes one of the
+// LOG_MAX_READERS pin slots.
+class PinnedValue {
+public:
+    PinnedValue() :log(nullptr), slot(-1) {}
+
+    PinnedValue(const PinnedValue &) = delete;
+    PinnedValue &operator=(const PinnedValue &) = delete;
+
+    ~PinnedValue() {
+        Release();
+    }
+
+    const bytes &Value() {
+        return value;
+    }
+
+    void Release() {
+        if (log) {
+            log->Unpin(slot);
+            log = nullptr;
+        }
+        value = bytes();
+    }
+
+private:
+    template<class, class, class, class> friend class BasicHashTable;
+
+    Log *log;
+    int slot;
+    bytes value;
+    // Holds the value when it had to be read from disk
+    Buffer b;
+};
+
+// Counters of HTStats
+enum HTCounter {
+    HT_GETS,
+    HT_GET_HITS,
+    // Lookups ruled out by the bloom filter of the bucket, and lookups it
+    // let through for keys that are not in the bucket
+    HT_BLOOM_NEGATIVES,
+    HT_BLOOM_FALSE_POSITIVES,
+    // Segments searched by lookups, and the bytes of those that had to be
+    // read or copied out of the log
+    HT_SEGMENTS_READ,
+    HT_BYTES_READ,
+    HT_SETS,
+    HT_DELETES,
+    // Merge operands written
+    HT_OPERANDS,
+    // Bucket chains merged into a single segment
+    HT_MERGES,
+    HT_COMPACTIONS,
+    // Bytes trimmed from the logs and bytes rewritten by the compaction
+    HT_COMPACTED_BYTES,
+    HT_RELOCATED_BYTES,
+    // Expired kvs dropped by merges, and buckets rewritten because their
+    // expiry hint passed
+    HT_EXPIRED,
+    HT_EXPIRY_REWRITES,
+    // Reads of keys with operands of merge operators not registered, they
+    // read as missing
+    HT_UNRESOLVED,
+    HT_COUNTERS,
+};
+
+enum HTHistogram {
+    HT_GET_LATENCY,
+    HT_SET_LATENCY,
+    HT_COMPACT_LATENCY,
+    HT_HISTOGRAMS,
+};
+
+struct HTStats {
+    uint64_t counters[HT_COUNTERS];
+    Histogram histograms[HT_HISTOGRAMS];
+    // I/O of all logs of the table
+    LogStats log;
+
+    uint64_t buckets, items;
+    float fragmentation, writeAmplification;
+    // Bytes between head and tail of the logs and the live bytes in them
+    uint64_t hotSize, hotLive, coldSize, coldLive, valueSize, valueLive;
+    uint64_t cacheHits, cacheMisses;
+
+    // Number of buckets by the segments in their chain and by the items
+    // in them
+    vector<uint64_t> chainLengths, occupancy;
+
+    HTStats() :buckets(0), items(0), fragmentation(0), writeAmplification(0), hotSize(0), hotLive(0),
+        coldSize(0), coldLive(0), valueSize(0), valueLive(0), cacheHits(0), cacheMisses(0) {
+        memset(counters, 0, sizeof(counters));
+    }
+
+    void Print(ostream &os) const;
+};
+
+// A table of fixed size keys or values is declared with the traits of
+// their size, e.g. BasicHashTable<FixedKey<8>, FixedValue<16>>. Its keys
+// and values must have that size. A table bound to InMemoryLog or
+// PersistentLog with L reads its logs without virtual calls, and can only
+// be kept in memory or on disk respectively. Keys are hashed with hash
+// policy H, see hash.h. The tables are instantiated at the end of
+// hashtable.cc, other ones have to be added there.
+template<class KT, class VT, class L, class H>
+class BasicHashTable {
+public:
+
+    // With recover set the table is rebuilt from the existing log at
+    // filepath, nb is then taken from the log. The last checkpoint is
+    // loaded first when there is one. Log pages read from disk are cached
+    // in up to cacheSize bytes. Durability picks how the log is synced.
+    // Every bucket has a bloom filter of bloomBits (8, 16 or 32) bits.
+    // Values of valueThreshold bytes or more are written once to a value
+    // log and only referenced from the buckets, 0 keeps all values inline.
+    // Tables of fixed size values keep all values inline.
+    BasicHashTable(int nb, const string &filepath, bool recover=false, uint64_t cacheSize=BLOCK_CACHE_SIZE,
+            LogDurability durability=LOG_DURABLE_SYNC, int bloomBits=HT_BLOOM_BITS, uint32_t valueThreshold=0);
+
+    ~BasicHashTable();
+
+    // Updates return their sequence number for WaitDurable
+    LogOffset Delete(const bytes &key);
+
+    // Values with an expiry time, in seconds since the epoch, read as
+    // deleted from then on. Merges and compaction drop them.
+    LogOffset Set(const bytes &key, const bytes &value, uint32_t expires=0);
+
+    // Merge operators are registered by id before the table is used, a
+    // table recovered from a log that holds operands needs them again.
+    // Until then keys with their operands read as missing, and merges keep
+    // the operands as they are.
+    void RegisterMergeOperator(int id, MergeOperator *op) {
+        assert(id >= 0 && id < HT_MERGE_OPERATORS);
+        mergeOps[id] = op;
+    }
+
+    // Write operand for merge operator id to the key without reading its
+    // value. The operands of a key are folded into its value when its
+    // bucket chain is merged, split or relocated, and by reads until then.
+    // Tables of fixed size values take no operands.
+    LogOffset Merge(const bytes &key, const bytes &operand, int id=0);
+
+    // Apply a batch of updates, writing one segment per touched bucket
+    LogOffset Write(WriteBatch &batch);
+
+    // Wait until the update with sequence number seq and all updates
+    // before it are durable
+    void WaitDurable(LogOffset seq) {
+        // Values, and chain starts relocated into the cold log, are written
+        // before the hot segments that reference them
+        if (valueThreshold) {
+            log->WaitTailDurable(log->ValueTailOffset());
+        }
+        log->WaitTailDurable(log->ColdTailOffset());
+        log->WaitDurable(seq);
+    }
 
     bytes Get(const bytes &key, Buffer &b);
 
+    // Look up key without copying the value out of an in memory log.
+    // Returns false if the key was not found.
+    bool Get(const bytes &key, PinnedValue &v);
+
+    // Look up a set of keys, the found values are placed into b and
+    // missing keys get an empty value
+    void MultiGet(const vector<bytes> &keys, vector<bytes> &values, Buffer &b);
+
+    // Returns false if the bloom filter rules out key, without reading
+    // the log
+    bool MayContain(const bytes &key);
+
     float GetLogFragmentation();
 
-    void writeHTData(int id, HTBucketInfo *bInfo, vector<kv> &kvs, int maxSegments);
+    // Bytes written to the log per byte of user data
+    float GetWriteAmplification();
+
+    // The caller must hold the lock stripe of the bucket. Cold writes start
+    // a new chain in the cold log. Returns the log bytes written.
+    int writeHTData(int id, HTBucketInfo *bInfo, vector<kv> &kvs, int maxSegments, bool cold=false);
     void compactLog(float fragThreshold, Buffer &b);
 
-    //~HashTable();
+    void StartCompactor(const CompactionOptions &opts = CompactionOptions());
+    void StopCompactor();
+
+    // Write the bucket directory next to the log, so that recovery only
+    // replays the log written after it. Tables in memory have none.
+    void Checkpoint();
+
+    // Checkpoint in the background every interval bytes of log
+    void StartCheckpointer(uint64_t interval = HT_CHECKPOINT_INTERVAL);
+    void StopCheckpointer();
+
+    int NumBuckets() {
+        auto state = dirState.load();
+        return (initBuckets << (state >> 32)) + uint32_t(state);
+    }
+
+    // Cache of the log pages, null for tables in memory
+    BlockCache *Cache() {
+        return log->Cache();
+    }
+
+    // With buckets set the bucket distributions are taken as well, which
+    // walks the directory
+    HTStats GetStats(bool buckets=true);
 
     void Dump();
+    // Print GetStats
     void Stats();
 
 private:
+    friend class ShardedHashTable;
+
+    typedef HTSegment<KT, VT> segment;
+
+    // Kept next to the initial directory size in the log, bucket ids
+    // depend on the hash policy and segments on the layout
+    static uint64_t formatID() {
+        return H::ID | uint64_t(KT::Size) << 8 | uint64_t(VT::Size) << 20;
+    }
+
     uint32_t hash(const bytes &key) {
-        uint32_t h {0};
-        MurmurHash3_x86_32(key.data, key.size, 0, &h);
-        return h;
+        return keyHash<H>(key);
     }
 
-    int numBuckets;
+    // Tag of the key in its segment
+    static uint8_t tag(uint32_t h) {
+        return h >> 24;
+    }
+
+    // Linear hashing: buckets below the split pointer have already been
+    // split for the current level and are addressed with the next level.
+    // The directory state packs the level and the split pointer.
+    uint32_t bucketID(uint32_t h, uint64_t state) {
+        uint32_t n = initBuckets << (state >> 32);
+        uint32_t id = h % n;
+        if (id < uint32_t(state)) {
+            id = h % (n*2);
+        }
+        return id;
+    }
+
+    // Bloom.Load reads a whole word past the last filter
+    uint64_t bloomDirSize() {
+        return uint64_t(bloom.Bytes())*HT_MAX_BUCKETS + sizeof(uint32_t);
+    }
+
+    HTLockStripe &stripe(uint32_t id) {
+        return stripes[id % HT_LOCK_STRIPES];
+    }
+
+    bool lookup(const bytes &key, Buffer &b, bytes &value);
+    bool findKV(const bytes &key, uint32_t h, LogOffset &from, Buffer &b, bytes &value, uint32_t &flags);
+    bool hasKey(const bytes &key, uint32_t h, const HTBucketInfo &info, uint32_t filter, uint32_t now, Buffer &b);
+    bool resolve(const bytes &key, uint32_t h, LogOffset next, Buffer &b, bytes &value, uint32_t &flags);
+    bool fold(const bytes &key, const bytes *value, const vector<bytes> &operands, uint32_t now, string &result,
+            uint32_t &expires);
+    bool applyOperands(const bytes &key, const vector<bytes> &operands, uint32_t now, string &cur, bool &has,
+            uint32_t &expires);
+    void resolveMerged(BasicDedupKVCallback<H> &d, Buffer &b, Arena &a);
+    bool readValue(const bytes &key, const bytes &ref, Buffer &b, bytes &value);
+    bool keepMerged(const bytes &k, const bytes &v, uint32_t flags, uint32_t now, uint64_t &dropped);
+    kv valueKV(const bytes &key, const bytes &value, uint32_t expires, Arena &a);
+    void writeValue(const bytes &key, const bytes &value, HTValueRef &ref);
+    void compactValue(LogOffset offset, Buffer &b);
+    uint32_t lockBucket(uint32_t h);
+    void readBucket(uint32_t h, HTBucketInfo &info, uint32_t &filter);
+    void beginUpdate(HTLockStripe &st);
+    void endUpdate(HTLockStripe &st);
+    void publish(uint32_t id, const HTBucketInfo &info, uint32_t filter, const HTExpiryHint &hint);
+
+    struct segmentWrite;
+    void prepareSegment(segmentWrite &w, const HTBucketInfo &cur, int maxSegments, Buffer &b, Arena &a);
+    int segmentSize(segmentWrite &w);
+    void fillSegment(segmentWrite &w, LogSpace &space, int size);
+    HTBucketInfo writeSegment(int id, const HTBucketInfo &cur, vector<kv> &kvs, uint32_t &filter, HTExpiryHint &hint);
+    bool splitBucket();
+    void recover(PersistentLog *hot, PersistentLog *cold, PersistentLog *values);
+    bool loadCheckpoint(HTCheckpointHeader &hdr);
+    void runCheckpointer();
+    bool compactStep(Buffer &b);
+    void expireBuckets();
+
+    static void addExpiry(HTExpiryHint &hint, uint32_t expires) {
+        if (expires) {
+            hint.expires = hint.expires ? min(hint.expires, expires) : expires;
+            hint.count = min(int(UINT8_MAX), hint.count+1);
+        }
+    }
+
+    void lowerNextExpiry(uint32_t expires) {
+        auto cur = nextExpiry.load(memory_order_relaxed);
+        while (expires && expires < cur && !nextExpiry.compare_exchange_weak(cur, expires)) {}
+    }
+
+    uint64_t logSize();
+    bool compactionDue();
+    void runCompactor();
+    void throttle();
+    void beforeWrite();
+    void afterWrite(int n);
+
+    uint32_t initBuckets;
+    atomic<uint64_t> dirState;
     int maxSegments;
-    int numHashes;
     HTBucketInfo *bucketDir;
-    Log *log;
-
-    vector<struct kv> kvs;
-    Buffer wBuf;
+    // Bucket filters, indexed like the directory
+    BloomFilter bloom;
+    uint8_t *bloomDir;
+    // Expiry hints, indexed like the directory. They are saved in the
+    // checkpoint with the filters and mapped back from it on recovery.
+    HTExpiryHint *expiryDir;
+    // Earliest expiry hint of the directory, and the time of the last
+    // sweep. Swept under the compaction lock, expiryCursor is the next
+    // bucket of the running sweep and sweepExpiry the earliest hint it
+    // left behind.
+    atomic<uint32_t> nextExpiry;
+    uint32_t lastExpirySweep;
+    bool sweeping;
+    uint32_t expiryCursor, sweepExpiry;
+    HTLockStripe *stripes;
+    BasicHotColdLog<L> *log;
 
     atomic<uint64_t> DataSize;
+    // Part of DataSize in the cold log
+    atomic<uint64_t> coldDataSize;
+    // Bytes of the value log referenced from the buckets
+    atomic<uint64_t> valueDataSize;
+    uint32_t valueThreshold;
+    MergeOperator *mergeOps[HT_MERGE_OPERATORS];
+    // Sum of HTBucketInfo::count over the directory
+    atomic<uint64_t> numItems;
+    atomic<uint64_t> userBytes, logBytes;
+    Metrics metrics;
+
+    // Serializes bucket splits and log compaction respectively
+    mutex splitLock, compactLock;
+
+    mutex m;
+    thread compactor;
+    atomic<bool> compactorRunning;
+    CompactionOptions compactOpts;
+    // Signalled to wake up the compactor and the stalled writers
+    condition_variable compactCond, stallCond;
+
+    string checkpointPath;
+    mutex checkpointLock;
+    thread checkpointer;
+    atomic<bool> checkpointerRunning;
+    uint64_t checkpointInterval;
+    atomic<uint64_t> checkpointTail;
+    condition_variable checkpointCond;
 };
 
+typedef BasicHashTable<> HashTable;
+typedef BasicHashTable<VarKey, VarValue, InMemoryLog> InMemoryHashTable;
+typedef BasicHashTable<VarKey, VarValue, PersistentLog> PersistentHashTable;
+
+// Callbacks get the kvs as stored in the segments with their
+// HT_VALUE_FLAGS, with HT_VALUE_REF set v holds an HTValueRef
 class KVCallback {
 public:
-    virtual bool Call(const bytes &k, const bytes &v) {
+    virtual bool Call(const bytes &k, const bytes &v, uint32_t flags) {
         return true;
     }
 };
 
-class PrintKVCallback: public KVCallback{
-    bool Call(const bytes &k, const bytes &v) {
+class PrintKVCallback final: public KVCallback{
+public:
+    bool Call(const bytes &k, const bytes &v, uint32_t flags) {
+        if (flags & HT_VALUE_EXPIRES) {
+            cout<<"kv pair :"<<string(k.data, k.size)<<" expires "<<htExpiry(v, flags)<<endl;
+            return Call(k, htValue(v, flags), flags & ~HT_VALUE_EXPIRES);
+        }
+        if (flags & HT_VALUE_REF) {
+            HTValueRef r;
+            memcpy(&r, v.data, sizeof(r));
+            cout<<"kv pair :"<<string(k.data, k.size)<<" value log "<<(r.offset & ~LOG_STREAM_BITS)<<endl;
+            return true;
+        }
+        if (flags & HT_VALUE_OPERAND) {
+            cout<<"kv pair :"<<string(k.data, k.size)<<" operand "<<int(uint8_t(v.data[0]))<<" "
+                <<string(v.data+1, v.size-1)<<endl;
+            return true;
+        }
         cout<<"kv pair :"<<string(k.data, k.size)<<" "<<string(v.data, v.size)<<endl;
         return true;
     }
 };
 
-class LookupKVCallback: public KVCallback{
+class LookupKVCallback final: public KVCallback{
 public:
-    LookupKVCallback(const bytes &k) :lookup(k), Found(false) {}
-    bool Call(const bytes &k, const bytes &v) {
+    LookupKVCallback(const bytes &k) :lookup(k), Found(false), Flags(0) {}
+    bool Call(const bytes &k, const bytes &v, uint32_t flags) {
         if (k == lookup) {
             Found = v.size != 0;
             Value = v;
+            Flags = flags;
             return false;
         }
 
@@ -113,29 +928,170 @@ public:
 
     bytes Value;
     bool Found;
+    uint32_t Flags;
     bytes lookup;
 
 };
 
-class DedupKVCallback: public KVCallback {
+// Keeps the first kv seen of every key, hashed with hash policy H. The kvs
+// and the open addressing table are allocated from the arena, they are
+// valid until it is reset. The value log bytes of the dropped references
+// add up in DroppedValues. Merge operands are collected until the next
+// older kv of their key, which the table folds them into.
+template<class H>
+class BasicDedupKVCallback final: public KVCallback {
 public:
+    struct operand {
+        bytes v;
+        operand *next;
+    };
+
+    struct entry {
+        bytes k, v;
+        uint32_t h;
+        uint32_t flags;
+        // Operands newer than v, oldest first. While open no older kv of
+        // the key was seen and v is empty.
+        operand *operands;
+        bool open;
+    };
+
+    BasicDedupKVCallback() :DroppedValues(0), arena(nullptr), entries(nullptr), slots(nullptr), n(0), capacity(0) {}
+
+    // Start over with room for about count kvs
+    void Reset(Arena &a, size_t count) {
+        arena = &a;
+        n = 0;
+        DroppedValues = 0;
+        capacity = 16;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        entries = reinterpret_cast<entry *>(a.Alloc(sizeof(entry)*capacity));
+        slots = reinterpret_cast<uint32_t *>(a.Alloc(sizeof(uint32_t)*capacity*2));
+        memset(slots, 0, sizeof(uint32_t)*capacity*2);
+    }
 
-    bool Call(const bytes &k, const bytes &v) {
-        if (Map.find(k) == Map.end()) {
-            Map[bytes_dup(k)] = bytes_dup(v);
+    // Kvs come newest first, older operands are prepended to keep their
+    // list oldest first
+    bool Call(const bytes &k, const bytes &v, uint32_t flags) {
+        auto h = keyHash<H>(k);
+        auto mask = capacity*2-1;
+        auto i = h & mask;
+        for (; slots[i]; i = (i+1) & mask) {
+            auto &x = entries[slots[i]-1];
+            if (x.h == h && x.k == k) {
+                if (x.open && (flags & HT_VALUE_OPERAND)) {
+                    x.operands = newOperand(v, x.operands);
+                } else if (x.open) {
+                    x.v = arena->Dup(v);
+                    x.flags = flags;
+                    x.open = false;
+                } else if (flags & HT_VALUE_REF) {
+                    DroppedValues += valueRecordSize(k, htValue(v, flags));
+                }
+                return true;
+            }
         }
 
+        if (n == capacity) {
+            grow();
+            mask = capacity*2-1;
+            for (i = h & mask; slots[i]; i = (i+1) & mask) {
+            }
+        }
+
+        if (flags & HT_VALUE_OPERAND) {
+            new (&entries[n]) entry{arena->Dup(k), bytes(), h, 0, newOperand(v, nullptr), true};
+        } else {
+            new (&entries[n]) entry{arena->Dup(k), arena->Dup(v), h, flags, nullptr, false};
+        }
+        slots[i] = ++n;
         return true;
     }
 
-    ~DedupKVCallback() {
-        for (auto x: Map) {
-            bytes_free(x.first);
-            bytes_free(x.second);
+    entry *begin() {
+        return entries;
+    }
+
+    entry *end() {
+        return entries + n;
+    }
+
+    uint64_t DroppedValues;
+
+private:
+    // The table is kept at most half full. Growing leaves the old arrays
+    // in the arena.
+    void grow() {
+        auto old = entries;
+        capacity *= 2;
+        entries = reinterpret_cast<entry *>(arena->Alloc(sizeof(entry)*capacity));
+        memcpy(static_cast<void *>(entries), old, sizeof(entry)*n);
+        slots = reinterpret_cast<uint32_t *>(arena->Alloc(sizeof(uint32_t)*capacity*2));
+        memset(slots, 0, sizeof(uint32_t)*capacity*2);
+
+        auto mask = capacity*2-1;
+        for (uint32_t e=0; e<n; e++) {
+            auto i = entries[e].h & mask;
+            while (slots[i]) {
+                i = (i+1) & mask;
+            }
+            slots[i] = e+1;
         }
     }
 
-    unordered_map<bytes, bytes, bytesHasher> Map;
+    operand *newOperand(const bytes &v, operand *next) {
+        auto o = reinterpret_cast<operand *>(arena->Alloc(sizeof(operand)));
+        new (o) operand{arena->Dup(v), next};
+        return o;
+    }
+
+    Arena *arena;
+    entry *entries;
+    // Index+1 of the entry in every slot, 0 for empty slots
+    uint32_t *slots;
+    uint32_t n, capacity;
 };
 
-int VisitBucketKVs(Log *log, Buffer &b, HTBucketInfo *info, KVCallback *callb);
+typedef BasicDedupKVCallback<Murmur32Hash> DedupKVCallback;
+
+// The functions below read the segments of tables of the default layout.
+// Visit the kvs of a single segment, returns false if the callback stopped
+bool VisitSegmentKVs(const bytes &block, KVCallback *callb);
+
+// Look up the key with the given tag in a single segment. Returns false if
+// the segment does not hold the key, the value of a deleted key is empty.
+// Flags are the HT_VALUE_FLAGS of the kv.
+bool LookupSegmentKV(const bytes &block, const bytes &key, uint8_t tag, bytes &value, uint32_t &flags);
+
+// Visit the kvs of a bucket chain in the segments of a table of layout
+// KT and VT. Calls to callbacks of a final class and to logs of a final
+// class are inlined. Returns the bytes of the segments read, the ones of
+// the cold log are added to coldBytes.
+template<class KT=VarKey, class VT=VarValue, class L, class CB>
+int VisitBucketKVs(L *log, Buffer &b, HTBucketInfo *info, CB *callb, int *coldBytes=nullptr) {
+    int readBytes = 0;
+    for (auto logOff = info->offset; logOff; ) {
+        auto block = log->ReadInPlace(logOff);
+        if (!block.data) {
+            block = log->Read(logOff, b);
+        }
+        readBytes += logBlockSize(block.size);
+        if (coldBytes && (logOff & LOG_COLD_BIT)) {
+            *coldBytes += logBlockSize(block.size);
+        }
+        logOff = (*(HTData*)(block.data)).nextOffset;
+        auto more = HTSegment<KT, VT>::Visit(block, [callb](const bytes &k, const bytes &v, uint32_t flags) {
+            return callb->Call(k, v, flags);
+        });
+        if (!more) {
+            break;
+        }
+    }
+
+    return readBytes;
+}
+
+// Visit with virtual calls to the log and the callback
+int VisitBucketKVs(Log *log, Buffer &b, HTBucketInfo *info, KVCallback *callb, int *coldBytes=nullptr);
@@ -1,10 +1,35 @@
 #include <iostream>
 #include <chrono>
+#include <algorithm>
+#include <thread>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <math.h>
 #include "hashtable.h"
+#include "sharded.h"
 
 
 using namespace std;
 
+// Heap allocations of the process, for the merge bench
+static atomic<uint64_t> heapAllocs(0);
+
+void *operator new(size_t n) {
+    heapAllocs++;
+    auto p = malloc(n);
+    if (!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
 char alnum[] = "0123456789abcdefghijklmnopqrstuvwxyz";
 
 void randKey(char *buf, int len) {
@@ -14,61 +39,773 @@ void randKey(char *buf, int len) {
     buf[len-1] = '\0';
 }
 
-void testbench_hashtable() {
-    auto n = 100000000;
+// Grow the table 10x past its initial directory size and report Set/Get
+// latency per window, which should stay flat as buckets get split
+void testbench_growth() {
+    auto nb = 10000;
+    auto n = nb*HT_SPLIT_LOAD*10;
+    auto window = n/10;
+    Buffer b;
+    HashTable ht(nb, "");
+    char kbuf[32];
+
+    std::chrono::time_point<std::chrono::system_clock> t0, t1;
+    for (auto w=0; w<n/window; w++) {
+        t0 = std::chrono::system_clock::now();
+        for (auto i=w*window; i<(w+1)*window; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+        }
+        t1 = std::chrono::system_clock::now();
+        std::chrono::duration<double, std::nano> setDur = t1-t0;
+
+        srand(w);
+        t0 = std::chrono::system_clock::now();
+        for (auto i=0; i<window; i++) {
+            auto nk = sprintf(kbuf, "key-%d", rand()%((w+1)*window));
+            auto out = ht.Get(bytes(kbuf, nk), b);
+            if (!(out == bytes(kbuf, nk))) {
+                cout<<"Mismatch: "<<bytes(kbuf, nk)<<" "<<out<<endl;
+            }
+        }
+        t1 = std::chrono::system_clock::now();
+        std::chrono::duration<double, std::nano> getDur = t1-t0;
+
+        cout<<"items: "<<(w+1)*window<<" buckets: "<<ht.NumBuckets()
+            <<" set latency(ns): "<<setDur.count()/window
+            <<" get latency(ns): "<<getDur.count()/window<<endl;
+    }
+}
+
+void printLatencies(const string &name, vector<double> &lat) {
+    sort(lat.begin(), lat.end());
+    auto pct = [&](double p) { return lat[min(lat.size()-1, size_t(p*lat.size()))]; };
+    cout<<name<<" latency(ns) p50: "<<pct(0.5)<<" p99: "<<pct(0.99)
+        <<" p99.9: "<<pct(0.999)<<" max: "<<lat.back()<<endl;
+}
+
+// Overwrite a fixed key set so that the log keeps fragmenting and compare
+// the Set latency distribution of inline and background compaction
+void testbench_compaction(bool background) {
+    auto n = 2000000;
+    auto nkeys = 200000;
+    HashTable ht(10000, "");
+    char kbuf[64];
+    vector<double> lat;
+    lat.reserve(n);
+
+    if (background) {
+        ht.StartCompactor();
+    }
+
+    srand(0);
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", rand()%nkeys);
+        auto t0 = std::chrono::system_clock::now();
+        ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+        std::chrono::duration<double, std::nano> dur = std::chrono::system_clock::now()-t0;
+        lat.push_back(dur.count());
+    }
+
+    ht.Stats();
+    printLatencies(background ? "background compaction set" : "inline compaction set", lat);
+}
+
+// 90/10 Get/Set mix over a preloaded table, reports aggregate throughput
+void testbench_concurrent(int nthreads) {
+    auto nkeys = 1000000;
+    auto ops = 2000000;
+    HashTable ht(100000, "");
+    char kbuf[64];
+
+    for (auto i=0; i<nkeys; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+    }
+    ht.StartCompactor();
+
+    vector<thread> threads;
+    auto start = std::chrono::system_clock::now();
+    for (auto t=0; t<nthreads; t++) {
+        threads.push_back(thread([&ht, t, nthreads, nkeys, ops]() {
+            Buffer b;
+            char kbuf[64];
+            unsigned int seed = t;
+            for (auto i=0; i<ops/nthreads; i++) {
+                auto nk = sprintf(kbuf, "key-%d", rand_r(&seed)%nkeys);
+                if (rand_r(&seed)%10 == 0) {
+                    ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+                } else {
+                    ht.Get(bytes(kbuf, nk), b);
+                }
+            }
+        }));
+    }
+
+    for (auto &t: threads) {
+        t.join();
+    }
+
+    std::chrono::duration<double> dur = std::chrono::system_clock::now()-start;
+    cout<<"threads: "<<nthreads<<" throughput: "<<double(ops)/dur.count()<<" ops/sec"<<endl;
+}
+
+// Throughput of the sharded table with direct calls and with per shard
+// workers, against a single table with the same number of threads
+void testbench_sharded(int nthreads) {
+    auto nkeys = 1000000;
+    auto ops = 2000000;
+    auto batch = 64;
+    for (auto mode=0; mode<3; mode++) {
+        ShardedHashTable ht(mode ? nthreads : 1, 100000/(mode ? nthreads : 1), "");
+        char kbuf[64];
+        for (auto i=0; i<nkeys; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+        }
+        ht.StartCompactor();
+        if (mode == 2) {
+            ht.StartWorkers();
+        }
+
+        vector<thread> threads;
+        auto start = std::chrono::system_clock::now();
+        for (auto t=0; t<nthreads; t++) {
+            threads.push_back(thread([&ht, t, nthreads, nkeys, ops, batch, mode]() {
+                Buffer b;
+                unsigned int seed = t;
+                unique_ptr<ShardedHashTable::Request[]> reqs(new ShardedHashTable::Request[batch]);
+                vector<string> keys(batch);
+                for (auto i=0; i<ops/nthreads; i+=batch) {
+                    for (auto j=0; j<batch; j++) {
+                        keys[j] = "key-" + to_string(rand_r(&seed)%nkeys);
+                        auto &r = reqs[j];
+                        r.key = bytes(&keys[j][0], keys[j].size());
+                        r.op = rand_r(&seed)%10 == 0 ? ShardedHashTable::SHARD_SET : ShardedHashTable::SHARD_GET;
+                        r.value = r.key;
+                        if (mode == 2) {
+                            continue;
+                        }
+                        if (r.op == ShardedHashTable::SHARD_SET) {
+                            ht.Set(r.key, r.value);
+                        } else {
+                            ht.Get(r.key, b);
+                        }
+                    }
+                    if (mode == 2) {
+                        ht.Run(reqs.get(), batch);
+                    }
+                }
+            }));
+        }
+
+        for (auto &t: threads) {
+            t.join();
+        }
+
+        std::chrono::duration<double> dur = std::chrono::system_clock::now()-start;
+        const char *modes[] = {"single table", "direct", "workers"};
+        cout<<"threads: "<<nthreads<<" "<<modes[mode]<<" throughput: "<<double(ops)/dur.count()<<" ops/sec"<<endl;
+    }
+}
+
+// Set throughput and latency of the log durability modes. In group commit
+// every Set waits until it is durable.
+void testbench_durability(LogDurability durability, const string &name, int nthreads) {
+    auto ops = 40000;
+    HashTable ht(100000, "test.data", false, BLOCK_CACHE_SIZE, durability);
+    ht.StartCompactor();
+
+    vector<thread> threads;
+    vector<vector<double>> lats(nthreads);
+    auto start = std::chrono::system_clock::now();
+    for (auto t=0; t<nthreads; t++) {
+        threads.push_back(thread([&ht, &lats, t, nthreads, ops, durability]() {
+            char kbuf[64];
+            for (auto i=0; i<ops/nthreads; i++) {
+                auto nk = sprintf(kbuf, "key-%d-%d", t, i);
+                auto t0 = std::chrono::system_clock::now();
+                auto seq = ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+                if (durability == LOG_DURABLE_GROUP_COMMIT) {
+                    ht.WaitDurable(seq);
+                }
+                std::chrono::duration<double, std::nano> d = std::chrono::system_clock::now()-t0;
+                lats[t].push_back(d.count());
+            }
+        }));
+    }
+
+    for (auto &t: threads) {
+        t.join();
+    }
+
+    std::chrono::duration<double> dur = std::chrono::system_clock::now()-start;
+    vector<double> lat;
+    for (auto &l: lats) {
+        lat.insert(lat.end(), l.begin(), l.end());
+    }
+    cout<<name<<" threads: "<<nthreads<<" set throughput: "<<double(ops)/dur.count()<<endl;
+    printLatencies(name, lat);
+}
+
+// Single key Set against WriteBatch ingestion of the same keys
+void testbench_writebatch(const string &filepath, int batchSize) {
+    auto n = 1000000;
+    char kbuf[64], vbuf[64];
+
+    for (auto batched=0; batched<2; batched++) {
+        HashTable ht(10000, filepath);
+        WriteBatch batch;
+
+        auto start = std::chrono::system_clock::now();
+        for (auto i=0; i<n; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            auto nv = sprintf(vbuf, "val-%d", i);
+            if (batched) {
+                batch.Put(bytes(kbuf, nk), bytes(vbuf, nv));
+                if (batch.Count() == batchSize) {
+                    ht.Write(batch);
+                    batch.Clear();
+                }
+            } else {
+                ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+            }
+        }
+        ht.Write(batch);
+
+        std::chrono::duration<double> dur = std::chrono::system_clock::now()-start;
+        cout<<(batched ? "batch write" : "single set")<<" throughput: "<<double(n)/dur.count()
+            <<" write amplification: "<<ht.GetWriteAmplification()<<endl;
+    }
+}
+
+// Latency of looking up batches of keys with Get one by one against MultiGet
+void testbench_multiget(const string &filepath, int batchSize) {
+    auto nkeys = 200000;
+    auto nbatches = 2000;
+    char kbuf[64];
+    HashTable ht(10000, filepath);
+    WriteBatch batch;
+
+    for (auto i=0; i<nkeys; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        batch.Put(bytes(kbuf, nk), bytes(kbuf, nk));
+        if (batch.Count() == 10000) {
+            ht.Write(batch);
+            batch.Clear();
+        }
+    }
+    ht.Write(batch);
+
+    vector<string> keyData(batchSize);
+    vector<bytes> keys(batchSize), values;
+    Buffer b;
+    for (auto multi=0; multi<2; multi++) {
+        srand(0);
+        std::chrono::duration<double, std::micro> total(0);
+        for (auto j=0; j<nbatches; j++) {
+            for (auto i=0; i<batchSize; i++) {
+                keyData[i] = "key-" + to_string(rand()%nkeys);
+                keys[i] = bytes(&keyData[i][0], keyData[i].size());
+            }
+
+            auto t0 = std::chrono::system_clock::now();
+            if (multi) {
+                ht.MultiGet(keys, values, b);
+            } else {
+                for (auto &k: keys) {
+                    ht.Get(k, b);
+                }
+            }
+            total += std::chrono::system_clock::now()-t0;
+        }
+
+        cout<<(multi ? "multiget" : "get")<<" batch of "<<batchSize<<" latency(us): "
+            <<total.count()/nbatches<<endl;
+    }
+}
+
+// Zipfian ranks in [0, n) as in YCSB (Gray et al., Quickly Generating
+// Billion-Record Synthetic Databases)
+class ZipfGenerator {
+public:
+    ZipfGenerator(uint64_t n, double theta=0.99) :n(n), theta(theta) {
+        zetan = zeta(n);
+        alpha = 1.0/(1.0-theta);
+        eta = (1-pow(2.0/n, 1-theta))/(1-zeta(2)/zetan);
+    }
+
+    uint64_t Next() {
+        auto u = double(rand())/RAND_MAX;
+        auto uz = u*zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + pow(0.5, theta)) {
+            return 1;
+        }
+        return min(n-1, uint64_t(n*pow(eta*u-eta+1, alpha)));
+    }
+
+private:
+    double zeta(uint64_t m) {
+        double sum = 0;
+        for (uint64_t i=1; i<=m; i++) {
+            sum += 1/pow(double(i), theta);
+        }
+        return sum;
+    }
+
+    uint64_t n;
+    double theta, zetan, alpha, eta;
+};
+
+// Pages read from disk per Get on a Zipfian workload with and without the
+// block cache
+void testbench_cache(const string &filepath, uint64_t cacheSize) {
+    auto nkeys = 500000;
+    auto ngets = 200000;
+    char kbuf[64], vbuf[100];
+    HashTable ht(10000, filepath, false, cacheSize);
+    WriteBatch batch;
+    for (auto i=0; i<nkeys; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        randKey(vbuf, 100);
+        batch.Put(bytes(kbuf, nk), bytes(vbuf, 100));
+        if (batch.Count() == 10000) {
+            ht.Write(batch);
+            batch.Clear();
+        }
+    }
+    ht.Write(batch);
+
+    srand(0);
+    ZipfGenerator zipf(nkeys);
+    Buffer b;
+    auto cache = ht.Cache();
+    auto misses = cache->Misses();
+    auto t0 = std::chrono::system_clock::now();
+    for (auto i=0; i<ngets; i++) {
+        auto nk = sprintf(kbuf, "key-%llu", (unsigned long long)zipf.Next());
+        ht.Get(bytes(kbuf, nk), b);
+    }
+    std::chrono::duration<double> dur = std::chrono::system_clock::now()-t0;
+    cout<<"cache "<<(cacheSize>>20)<<"MB: "<<double(cache->Misses()-misses)/ngets<<" disk pages/get, "
+        <<ngets/dur.count()<<" gets/s"<<endl;
+}
+
+// Gets of large values from a table in memory, copied into a buffer and
+// pinned in place
+void testbench_pinned(int valueSize) {
+    auto nkeys = 100000;
+    auto ngets = 1000000;
+    char kbuf[64];
+    string val(valueSize, 'v');
+    HashTable ht(nkeys/4, "");
+    for (auto i=0; i<nkeys; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(&val[0], valueSize));
+    }
+
     Buffer b;
-    HashTable ht(100000, "test.data");
+    srand(0);
+    auto t0 = std::chrono::system_clock::now();
+    for (auto i=0; i<ngets; i++) {
+        auto nk = sprintf(kbuf, "key-%d", rand()%nkeys);
+        ht.Get(bytes(kbuf, nk), b);
+    }
+    std::chrono::duration<double> copyDur = std::chrono::system_clock::now()-t0;
 
-    std::chrono::time_point<std::chrono::system_clock> start, end;
-    char *buf = new char[64];
+    PinnedValue v;
     srand(0);
+    t0 = std::chrono::system_clock::now();
+    for (auto i=0; i<ngets; i++) {
+        auto nk = sprintf(kbuf, "key-%d", rand()%nkeys);
+        ht.Get(bytes(kbuf, nk), v);
+    }
+    std::chrono::duration<double> pinDur = std::chrono::system_clock::now()-t0;
+    v.Release();
+
+    cout<<"value size: "<<valueSize<<" copied gets/s: "<<ngets/copyDur.count()
+        <<" pinned gets/s: "<<ngets/pinDur.count()<<endl;
+}
+
+// Overwrites of a table in memory, every third update of a bucket merges
+// its chain
+void testbench_merge(int valueSize) {
+    auto nkeys = 100000;
+    auto n = 2000000;
+    char kbuf[64];
+    string val(valueSize, 'v');
+    HashTable ht(nkeys/HT_SPLIT_LOAD, "");
+    for (auto i=0; i<nkeys; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(&val[0], valueSize));
+    }
 
-    start = std::chrono::system_clock::now();
+    srand(0);
+    auto allocs = heapAllocs.load();
     auto t0 = std::chrono::system_clock::now();
-    for (auto i=0; i<n;i++) {
-        randKey(buf, 64);
-        auto key = bytes(buf, 64);
-        //ht.Get(key,b);
-        ht.Set(key, key);
-        if (i%1000000==0) {
-            ht.Stats();
-            auto now = std::chrono::system_clock::now();
-            std::chrono::duration<double> dur = (now-t0);
-            t0 = now;
-            cout<<"write throughput: "<<double(1000000)/double(dur.count())<<endl;
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", rand()%nkeys);
+        ht.Set(bytes(kbuf, nk), bytes(&val[0], valueSize));
+    }
+    std::chrono::duration<double> dur = std::chrono::system_clock::now()-t0;
+
+    cout<<"merge value size: "<<valueSize<<" sets/s: "<<n/dur.count()<<" heap allocations/set: "
+        <<double(heapAllocs-allocs)/n<<endl;
+}
+
+// Counter increments as Get plus Set, as merge operands and as blind Sets,
+// followed by Gets of all counters
+void testbench_counters() {
+    auto nkeys = 100000;
+    auto n = 1000000;
+    char kbuf[64];
+    CounterMergeOperator counter;
+    const char *modes[] = {"get+set", "merge", "blind set"};
+    for (auto mode=0; mode<3; mode++) {
+        HashTable ht(nkeys/HT_SPLIT_LOAD, "");
+        ht.RegisterMergeOperator(0, &counter);
+        Buffer b;
+        srand(0);
+        auto t0 = std::chrono::system_clock::now();
+        for (auto i=0; i<n; i++) {
+            auto nk = sprintf(kbuf, "key-%d", rand()%nkeys);
+            int64_t c = 1;
+            if (mode == 0) {
+                auto v = ht.Get(bytes(kbuf, nk), b);
+                if (v.size == sizeof(c)) {
+                    memcpy(&c, v.data, sizeof(c));
+                    c++;
+                }
+            }
+            if (mode == 1) {
+                ht.Merge(bytes(kbuf, nk), bytes(reinterpret_cast<char *>(&c), sizeof(c)));
+            } else {
+                ht.Set(bytes(kbuf, nk), bytes(reinterpret_cast<char *>(&c), sizeof(c)));
+            }
+        }
+        std::chrono::duration<double> dur = std::chrono::system_clock::now()-t0;
+
+        t0 = std::chrono::system_clock::now();
+        for (auto i=0; i<nkeys; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            ht.Get(bytes(kbuf, nk), b);
+        }
+        std::chrono::duration<double, std::nano> getDur = std::chrono::system_clock::now()-t0;
+
+        cout<<"counters "<<modes[mode]<<" increments/s: "<<n/dur.count()<<" get latency(ns): "
+            <<getDur.count()/nkeys<<endl;
+    }
+}
+
+// Bloom filter false positives against the CPU time of Gets that hit and
+// Gets of missing keys
+void testbench_bloom(int bloomBits) {
+    auto nkeys = 1000000;
+    auto ngets = 1000000;
+    char kbuf[64];
+    string val(100, 'v');
+    HashTable ht(nkeys/HT_SPLIT_LOAD/4, "", false, BLOCK_CACHE_SIZE, LOG_DURABLE_SYNC, bloomBits);
+    for (auto i=0; i<nkeys; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(&val[0], val.size()));
+    }
+
+    auto fp = 0;
+    for (auto i=0; i<ngets; i++) {
+        auto nk = sprintf(kbuf, "missing-%d", i);
+        fp += ht.MayContain(bytes(kbuf, nk));
+    }
+
+    Buffer b;
+    double ns[2];
+    for (auto miss=0; miss<2; miss++) {
+        srand(0);
+        auto t0 = std::chrono::system_clock::now();
+        for (auto i=0; i<ngets; i++) {
+            auto nk = sprintf(kbuf, miss ? "missing-%d" : "key-%d", rand()%nkeys);
+            ht.Get(bytes(kbuf, nk), b);
+        }
+        std::chrono::duration<double> dur = std::chrono::system_clock::now()-t0;
+        ns[miss] = dur.count()*1e9/ngets;
+    }
+
+    cout<<"bloom bits: "<<bloomBits<<" false positives: "<<100.0*fp/ngets<<"%, ns/get hit: "
+        <<ns[0]<<" miss: "<<ns[1]<<endl;
+}
+
+// Write amplification of the compactor under a skewed workload, 90% of
+// the updates go to 10% of the keys
+void testbench_hotcold(bool segregate) {
+    auto nkeys = 200000;
+    auto n = 4000000;
+    char kbuf[64];
+    string val(100, 'v');
+    HashTable ht(nkeys/HT_SPLIT_LOAD, "");
+    CompactionOptions opts;
+    opts.segregate = segregate;
+    ht.StartCompactor(opts);
+
+    srand(0);
+    auto t0 = std::chrono::system_clock::now();
+    for (auto i=0; i<n; i++) {
+        auto k = rand()%10 ? rand()%(nkeys/10) : rand()%nkeys;
+        auto nk = sprintf(kbuf, "key-%d", k);
+        ht.Set(bytes(kbuf, nk), bytes(&val[0], val.size()));
+    }
+    std::chrono::duration<double> dur = std::chrono::system_clock::now()-t0;
+    ht.StopCompactor();
+
+    cout<<(segregate ? "hot/cold" : "single log")<<" compaction sets/s: "<<n/dur.count()
+        <<" write amplification: "<<ht.GetWriteAmplification()<<endl;
+    ht.Stats();
+}
+
+// Updates of large values, kept inline or in the value log with the given
+// threshold. Every run writes 2 GB over 200 MB of live values.
+void testbench_valuelog(int valueSize, uint32_t threshold) {
+    auto nkeys = 200*1024*1024/valueSize;
+    auto n = 10*nkeys;
+    char kbuf[64];
+    string val(valueSize, 'v');
+    HashTable ht(nkeys/HT_SPLIT_LOAD, "", false, BLOCK_CACHE_SIZE, LOG_DURABLE_SYNC, HT_BLOOM_BITS, threshold);
+    ht.StartCompactor();
+
+    srand(0);
+    auto t0 = std::chrono::system_clock::now();
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", rand()%nkeys);
+        ht.Set(bytes(kbuf, nk), bytes(&val[0], val.size()));
+    }
+    std::chrono::duration<double> dur = std::chrono::system_clock::now()-t0;
+    ht.StopCompactor();
+
+    cout<<"value size: "<<valueSize<<(threshold ? " value log" : " inline")<<" sets/s: "<<n/dur.count()
+        <<" write amplification: "<<ht.GetWriteAmplification()<<endl;
+}
+
+// Nanoseconds per hash of keys of one size
+template<class H>
+double hashNs(const vector<string> &keys, int n) {
+    uint64_t sum = 0;
+    auto t0 = std::chrono::system_clock::now();
+    for (auto i=0; i<n; i++) {
+        auto &k = keys[i % keys.size()];
+        sum += H::Hash(k.data(), k.size());
+    }
+    std::chrono::duration<double, std::nano> dur = std::chrono::system_clock::now()-t0;
+    // Keeps the loop from being optimized away
+    volatile uint64_t sink = sum;
+    (void)sink;
+    return dur.count()/n;
+}
+
+// Cost of the hash policies over key sizes from 8 bytes to 1 KB
+void testbench_hash() {
+    cout<<"crc32c: "<<(crc32cAccelerated() ? "sse4.2" : "software")<<endl;
+    for (auto size=8; size<=1024; size*=2) {
+        vector<string> keys(64);
+        for (auto &k: keys) {
+            k.resize(size);
+            randKey(&k[0], size);
         }
+        auto n = 64*1024*1024/size;
+        cout<<"key size: "<<size<<" ns/hash murmur32: "<<hashNs<Murmur32Hash>(keys, n)
+            <<" murmur128: "<<hashNs<Murmur128Hash>(keys, n)<<" crc32c: "<<hashNs<CRC32CHash>(keys, n)
+            <<" wyhash: "<<hashNs<WyHash>(keys, n)<<endl;
+    }
+}
+
+typedef BasicHashTable<FixedKey<8>, FixedValue<16>> FixedHashTable;
+typedef BasicHashTable<VarKey, VarValue, Log, CRC32CHash> CRC32CHashTable;
+
+// Key i and its value in version v of the fixed size tables
+void fixedKV(uint64_t i, int v, char *key, char *value) {
+    uint64_t x[2] = {i*31 + v, ~i};
+    memcpy(key, &i, sizeof(i));
+    memcpy(value, x, sizeof(x));
+}
+
+// Set and Get latency and live log bytes per item of a table layout
+template<class T>
+void benchLayout(const char *name, int n, int gets) {
+    T ht(n/HT_SPLIT_LOAD, "");
+    Buffer b;
+    char k[8], v[16];
+
+    auto t0 = std::chrono::system_clock::now();
+    for (auto i=0; i<n; i++) {
+        fixedKV(i, 0, k, v);
+        ht.Set(bytes(k, sizeof(k)), bytes(v, sizeof(v)));
+    }
+    std::chrono::duration<double, std::nano> setDur = std::chrono::system_clock::now()-t0;
+
+    srand(0);
+    t0 = std::chrono::system_clock::now();
+    for (auto i=0; i<gets; i++) {
+        fixedKV(rand()%n, 0, k, v);
+        ht.Get(bytes(k, sizeof(k)), b);
     }
+    std::chrono::duration<double, std::nano> getDur = std::chrono::system_clock::now()-t0;
+
+    auto s = ht.GetStats(false);
+    cout<<name<<" items: "<<n<<" set latency(ns): "<<setDur.count()/n<<" get latency(ns): "<<getDur.count()/gets
+        <<" log bytes/item: "<<double(s.hotLive)/n<<endl;
+}
 
-    end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end-start;
-    cout<<"=================================================="<<endl;
-    cout<<"Execution took "<<elapsed_seconds.count()<<"seconds"<<endl;
-    cout<<"Avg write throughput: "<<float(n)/float(elapsed_seconds.count())<<endl;
+// 8 byte keys and 16 byte values in the default and the fixed layout, with
+// the table in the CPU caches and far beyond them
+void testbench_fixed() {
+    for (auto n: {10000, 1000000}) {
+        benchLayout<HashTable>("variable 8/16", n, 2000000);
+        benchLayout<FixedHashTable>("fixed 8/16", n, 2000000);
+    }
+}
 
+// Get and Set latency of a table that calls its logs and visitors
+// virtually and of one bound to its log type. Overwrites keep merging the
+// bucket chains, which visits every kv of the bucket.
+template<class T>
+void benchDispatch(const char *name) {
+    auto n = 10000, sets = 1000000, gets = 2000000;
+    T ht(n/HT_SPLIT_LOAD, "");
+    Buffer b;
+    char kbuf[32];
     srand(0);
-    start = std::chrono::system_clock::now();
+
+    auto t0 = std::chrono::system_clock::now();
+    for (auto i=0; i<sets; i++) {
+        auto nk = sprintf(kbuf, "key-%d", rand()%n);
+        ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+    }
+    std::chrono::duration<double, std::nano> setDur = std::chrono::system_clock::now()-t0;
+
     t0 = std::chrono::system_clock::now();
-    for (auto i=0; i<n;i++) {
-        randKey(buf, 64);
-        auto key = bytes(buf, 64);
-        auto out = ht.Get(key, b);
-        if (!(out == key)) {
-            cout<<"Mismatch: "<<key<<" "<<out<<endl;
+    for (auto i=0; i<gets; i++) {
+        auto nk = sprintf(kbuf, "key-%d", rand()%n);
+        ht.Get(bytes(kbuf, nk), b);
+    }
+    std::chrono::duration<double, std::nano> getDur = std::chrono::system_clock::now()-t0;
+
+    cout<<name<<" set latency(ns): "<<setDur.count()/sets<<" get latency(ns): "<<getDur.count()/gets<<endl;
+}
+
+// Adds up the sizes of the kvs
+class SizeKVCallback final: public KVCallback {
+public:
+    SizeKVCallback() :n(0) {}
+
+    bool Call(const bytes &k, const bytes &v, uint32_t flags) {
+        n += k.size + v.size;
+        return true;
+    }
+
+    uint64_t n;
+};
+
+// Visit bucket chains of 3 segments of 8 kvs each, held in the CPU caches,
+// through the virtual API and through the template bound to InMemoryLog
+// and the callback
+void testbench_visit() {
+    auto nb = 1000, rounds = 1000;
+    InMemoryLog log;
+    vector<HTBucketInfo> buckets(nb);
+    char kbuf[32];
+    for (auto id=0; id<nb; id++) {
+        for (auto seg=0; seg<3; seg++) {
+            string data;
+            for (auto i=0; i<8; i++) {
+                data.append(kbuf, sprintf(kbuf, "%06d%03d%03d", id, seg, i));
+            }
+            auto size = sizeof(HTData) + 8;
+            for (auto i=0; i<8; i++) {
+                size += keyLenSize + 12 + valLenSize + 12;
+            }
+            auto space = log.ReserveSpace(size);
+            HTData header {uint32_t(id), 0, 0, 8, buckets[id].offset};
+            memcpy(space.Buffer, &header, sizeof(header));
+            auto p = space.Buffer + sizeof(header) + 8;
+            for (auto i=0; i<8; i++) {
+                auto k = bytes(&data[i*12], 12);
+                p = VarKey::Put(p, k);
+                p = VarValue::Put(p, k, false);
+            }
+            log.FinalizeWrite(space);
+            buckets[id].offset = space.Offset;
+        }
+    }
+
+    Buffer b;
+    SizeKVCallback cb;
+    auto t0 = std::chrono::system_clock::now();
+    for (auto r=0; r<rounds; r++) {
+        for (auto &info: buckets) {
+            VisitBucketKVs(static_cast<Log *>(&log), b, &info, static_cast<KVCallback *>(&cb));
         }
+    }
+    std::chrono::duration<double, std::nano> virtualDur = std::chrono::system_clock::now()-t0;
 
-        if (i%1000000==0) {
-            ht.Stats();
-            auto now = std::chrono::system_clock::now();
-            std::chrono::duration<double> dur = (now-t0);
-            t0 = now;
-            cout<<"read throughput: "<<double(1000000)/double(dur.count())<<endl;
+    t0 = std::chrono::system_clock::now();
+    for (auto r=0; r<rounds; r++) {
+        for (auto &info: buckets) {
+            VisitBucketKVs(&log, b, &info, &cb);
+        }
+    }
+    std::chrono::duration<double, std::nano> inlineDur = std::chrono::system_clock::now()-t0;
+
+    auto kvs = double(nb)*rounds*3*8;
+    cout<<"visit ns/kv virtual: "<<virtualDur.count()/kvs<<" inlined: "<<inlineDur.count()/kvs
+        <<" bytes: "<<cb.n<<endl;
+}
+
+void testbench_dispatch() {
+    testbench_visit();
+    benchDispatch<HashTable>("Log");
+    benchDispatch<InMemoryHashTable>("InMemoryLog");
+}
+
+// Time reopening a table from its log, the scan should run at disk speed
+void testbench_recovery(const string &filepath, int nkeys) {
+    char kbuf[64], vbuf[200];
+    {
+        HashTable ht(10000, filepath);
+        WriteBatch batch;
+        for (auto i=0; i<nkeys; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            randKey(vbuf, 200);
+            batch.Put(bytes(kbuf, nk), bytes(vbuf, 200));
+            if (batch.Count() == 10000) {
+                ht.Write(batch);
+                batch.Clear();
+            }
+        }
+        ht.Write(batch);
+    }
+
+    struct stat st;
+    stat(filepath.c_str(), &st);
+    auto mb = double(st.st_size)/(1024*1024);
+
+    // The table was checkpointed on shutdown, the second run replays the
+    // whole log
+    for (auto replay=0; replay<2; replay++) {
+        if (replay) {
+            remove((filepath + ".ckpt").c_str());
+        }
+
+        auto t0 = std::chrono::system_clock::now();
+        HashTable ht(10000, filepath, true);
+        std::chrono::duration<double> dur = std::chrono::system_clock::now()-t0;
+        cout<<(replay ? "log replay: " : "checkpoint: ")<<"recovered "<<nkeys<<" keys in "
+            <<dur.count()<<"s";
+        if (replay) {
+            cout<<", "<<mb/dur.count()<<" MB/s";
         }
+        cout<<endl;
+        ht.Stats();
     }
-    end = std::chrono::system_clock::now();
-    elapsed_seconds = end-start;
-    cout<<"=================================================="<<endl;
-    cout<<"Execution took "<<elapsed_seconds.count()<<"seconds"<<endl;
-    cout<<"Avg read thhroughput: "<<float(n)/float(elapsed_seconds.count())<<endl;
 }
 
 void test_set_get(Buffer &b) {
@@ -93,13 +830,1292 @@ void test_set_get(Buffer &b) {
             cout<<vbs<<" != "<<out<<endl;
         }
     }
+
+    // Overwrites and deletes of the same keys neither add items nor split
+    HashTable ow(10, "");
+    auto keys = 70;
+    for (auto r=0; r<100; r++) {
+        for (auto i=0; i<keys; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            auto nv = sprintf(vbuf, "val-%d-%d", i, r);
+            bytes kbs(kbuf, nk);
+            if (r % 10 == 9 && i % 2) {
+                ow.Delete(kbs);
+            } else {
+                ow.Set(kbs, bytes(vbuf, nv));
+            }
+        }
+    }
+    auto s = ow.GetStats(false);
+    if (ow.NumBuckets() != 10 || s.items != uint64_t(keys/2)) {
+        cout<<"overwrites: buckets "<<ow.NumBuckets()<<" items "<<s.items<<endl;
+    }
 }
 
-int main() {
-    Buffer b;
-    test_set_get(b);
+void test_pinned_get(Buffer &b) {
+    char kbuf[100];
+    auto n = 1000;
+    string val(1024, 'a'), val2(1024, 'b');
+    bytes vbs(&val[0], val.size()), vbs2(&val2[0], val2.size());
+    HashTable ht(100, "");
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        ht.Set(bytes(kbuf, nk), vbs);
+    }
+
+    PinnedValue v;
+    auto nk = sprintf(kbuf, "key-%d", 0);
+    if (!ht.Get(bytes(kbuf, nk), v) || !(v.Value() == vbs)) {
+        cout<<"pinned: "<<vbs<<" != "<<v.Value()<<endl;
+    }
+
+    // Overwrite the table until the space of the pinned value is trimmed
+    // from the log, it must stay readable
+    for (auto r=0; r<3*int(LOG_RECLAIM_SIZE/(n*val2.size())); r++) {
+        for (auto i=0; i<n; i++) {
+            nk = sprintf(kbuf, "key-%d", i);
+            ht.Set(bytes(kbuf, nk), vbs2);
+        }
+    }
+    if (!(v.Value() == vbs)) {
+        cout<<"pinned after trim: "<<vbs<<" != "<<v.Value()<<endl;
+    }
+    v.Release();
+
+    nk = sprintf(kbuf, "key-%d", 0);
+    if (!ht.Get(bytes(kbuf, nk), v) || !(v.Value() == vbs2)) {
+        cout<<"pinned: "<<vbs2<<" != "<<v.Value()<<endl;
+    }
+    nk = sprintf(kbuf, "key-%d", n);
+    if (ht.Get(bytes(kbuf, nk), v)) {
+        cout<<"pinned: found missing key "<<bytes(kbuf, nk)<<endl;
+    }
+
+    // Values of tables on disk are copied into the handle
+    HashTable pht(100, "test.data");
+    nk = sprintf(kbuf, "key-%d", 0);
+    pht.Set(bytes(kbuf, nk), vbs);
+    if (!pht.Get(bytes(kbuf, nk), v) || !(v.Value() == vbs)) {
+        cout<<"pinned on disk: "<<vbs<<" != "<<v.Value()<<endl;
+    }
+    v.Release();
+}
+
+// Filters must never rule out a stored key, also once they are rebuilt
+// by splits, merges and recovery
+void test_bloom_filter(Buffer &b) {
+    char kbuf[100];
+    auto n = 20000;
+    int bits[] = {8, 16, 32};
+    for (auto bloomBits: bits) {
+        vector<int> fps;
+        for (auto reopen=0; reopen<3; reopen++) {
+            if (reopen == 2) {
+                remove("test.bloom.ckpt");
+            }
+
+            HashTable ht(10, "test.bloom", reopen > 0, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE, bloomBits);
+            for (auto i=0; i<n && !reopen; i++) {
+                auto nk = sprintf(kbuf, "key-%d", i);
+                ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+            }
+
+            auto fp = 0;
+            for (auto i=0; i<n; i++) {
+                auto nk = sprintf(kbuf, "key-%d", i);
+                if (!ht.MayContain(bytes(kbuf, nk))) {
+                    cout<<"bloom "<<bloomBits<<": rules out "<<bytes(kbuf, nk)<<endl;
+                }
+                nk = sprintf(kbuf, "missing-%d", i);
+                fp += ht.MayContain(bytes(kbuf, nk));
+            }
+            fps.push_back(fp);
+        }
+
+        // The checkpoint restores the filters, replay rebuilds them from
+        // the merged chains
+        if (fps[0] >= n || fps[1] != fps[0]) {
+            cout<<"bloom "<<bloomBits<<": false positives "<<fps[0]<<" "<<fps[1]<<" "<<fps[2]<<endl;
+        }
+    }
+
+    // Checkpoints with other filters are ignored
+    HashTable ht(10, "test.bloom", true, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE, 16);
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        auto out = ht.Get(bytes(kbuf, nk), b);
+        if (!(out == bytes(kbuf, nk))) {
+            cout<<bytes(kbuf, nk)<<" != "<<out<<endl;
+        }
+    }
+}
+
+void test_background_compaction(Buffer &b) {
+    char kbuf[100], vbuf[100];
+    auto n = 500000;
+    auto nkeys = 20000;
+    HashTable ht(100, "");
+    CompactionOptions opts;
+    opts.logBudget = 4*1024*1024;
+    ht.StartCompactor(opts);
+
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i%nkeys);
+        auto nv = sprintf(vbuf, "val-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+    }
+    ht.StopCompactor();
+
+    for (auto i=n-nkeys; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i%nkeys);
+        auto nv = sprintf(vbuf, "val-%d", i);
+        auto out = ht.Get(bytes(kbuf, nk), b);
+        if (!(out == bytes(vbuf, nv))) {
+            cout<<bytes(vbuf, nv)<<" != "<<out<<endl;
+        }
+    }
+    ht.Stats();
+}
+
+// A live log larger than the budget stalls the writer between the
+// watermarks, the compactor has to run down to lowWatermark to release it
+void test_log_budget(Buffer &b) {
+    char kbuf[100], vbuf[100];
+    auto n = 200000;
+    auto nkeys = 50000;
+    HashTable ht(100, "");
+    CompactionOptions opts;
+    opts.logBudget = 1024*1024;
+    ht.StartCompactor(opts);
+
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i%nkeys);
+        auto nv = sprintf(vbuf, "val-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+    }
+    ht.StopCompactor();
 
-    testbench_hashtable();
+    for (auto i=n-nkeys; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i%nkeys);
+        auto nv = sprintf(vbuf, "val-%d", i);
+        auto out = ht.Get(bytes(kbuf, nk), b);
+        if (!(out == bytes(vbuf, nv))) {
+            cout<<bytes(vbuf, nv)<<" != "<<out<<endl;
+        }
+    }
+}
+
+// Writers grow the table through many splits while readers verify that
+// every key they find carries the expected value
+void test_concurrent(Buffer &b) {
+    auto nwriters = 4;
+    auto nkeys = 20000;
+    HashTable ht(10, "");
+    ht.StartCompactor();
+    atomic<bool> done(false);
+    atomic<int> errors(0);
+
+    vector<thread> threads;
+    for (auto t=0; t<nwriters; t++) {
+        threads.push_back(thread([&ht, t, nkeys]() {
+            char kbuf[100], vbuf[100];
+            for (auto r=0; r<2; r++) {
+                for (auto i=t; i<nkeys; i+=4) {
+                    auto nk = sprintf(kbuf, "key-%d", i);
+                    auto nv = sprintf(vbuf, "val-%d", i);
+                    ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+                }
+            }
+        }));
+    }
+
+    thread reader([&]() {
+        Buffer rb;
+        char kbuf[100], vbuf[100];
+        while (!done) {
+            auto i = rand()%nkeys;
+            auto nk = sprintf(kbuf, "key-%d", i);
+            auto nv = sprintf(vbuf, "val-%d", i);
+            auto out = ht.Get(bytes(kbuf, nk), rb);
+            if (out.size && !(out == bytes(vbuf, nv))) {
+                errors++;
+            }
+        }
+    });
+
+    for (auto &t: threads) {
+        t.join();
+    }
+    done = true;
+    reader.join();
+    assert(errors == 0);
+
+    char kbuf[100], vbuf[100];
+    for (auto i=0; i<nkeys; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        auto nv = sprintf(vbuf, "val-%d", i);
+        auto out = ht.Get(bytes(kbuf, nk), b);
+        if (!(out == bytes(vbuf, nv))) {
+            cout<<bytes(vbuf, nv)<<" != "<<out<<endl;
+        }
+    }
+}
+
+void test_write_batch(Buffer &b) {
+    char kbuf[100], vbuf[100];
+    auto n = 10000;
+    HashTable ht(10, "test");
+    WriteBatch batch;
+
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        batch.Put(bytes(kbuf, nk), bytes(kbuf, nk));
+        auto nv = sprintf(vbuf, "val-%d", i);
+        batch.Put(bytes(kbuf, nk), bytes(vbuf, nv));
+        if (i%3 == 0) {
+            batch.Delete(bytes(kbuf, nk));
+        }
+
+        if (batch.Count() > 500) {
+            ht.Write(batch);
+            batch.Clear();
+        }
+    }
+    ht.Write(batch);
+
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        auto nv = sprintf(vbuf, "val-%d", i);
+        auto out = ht.Get(bytes(kbuf, nk), b);
+        auto expected = i%3 == 0 ? bytes() : bytes(vbuf, nv);
+        if (!(out == expected)) {
+            cout<<expected<<" != "<<out<<endl;
+        }
+    }
+
+    // A segment of more kvs than the tags can count is scanned in full
+    HashTable big(1, "");
+    batch.Clear();
+    for (auto i=0; i<HT_UNTAGGED+n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        batch.Put(bytes(kbuf, nk), bytes(kbuf, nk));
+    }
+    big.Write(batch);
+    for (auto i=0; i<HT_UNTAGGED+n; i += 7) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        auto out = big.Get(bytes(kbuf, nk), b);
+        if (!(out == bytes(kbuf, nk))) {
+            cout<<bytes(kbuf, nk)<<" != "<<out<<endl;
+        }
+    }
+}
+
+void test_multiget(Buffer &b) {
+    char kbuf[100], vbuf[100];
+    auto n = 10000;
+    HashTable ht(10, "test");
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        auto nv = sprintf(vbuf, "val-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+        if (i%5 == 0) {
+            ht.Delete(bytes(kbuf, nk));
+        }
+    }
+
+    vector<string> keyData;
+    for (auto i=0; i<200; i++) {
+        keyData.push_back("key-" + to_string(rand()%(n*2)));
+    }
+
+    vector<bytes> keys, values;
+    for (auto &k: keyData) {
+        keys.push_back(bytes(&k[0], k.size()));
+    }
+    ht.MultiGet(keys, values, b);
+
+    Buffer gb;
+    for (size_t i=0; i<keys.size(); i++) {
+        auto out = ht.Get(keys[i], gb);
+        if (!(out == values[i])) {
+            cout<<keys[i]<<": "<<out<<" != "<<values[i]<<endl;
+        }
+    }
+}
+
+void verify_recovery(HashTable &ht, int n, int version, Buffer &b) {
+    char kbuf[100], vbuf[100];
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        auto nv = sprintf(vbuf, "val-%d-%d", i, i%3 ? version : 0);
+        auto out = ht.Get(bytes(kbuf, nk), b);
+        auto expected = i%7 ? bytes(vbuf, nv) : bytes();
+        if (!(out == expected)) {
+            cout<<"recovery: "<<expected<<" != "<<out<<endl;
+        }
+    }
+}
+
+// Reopen a table from its log after a shutdown that left a torn buffer
+// behind the valid part of the log
+void test_recovery(Buffer &b) {
+    char kbuf[100], vbuf[100];
+    auto n = 20000;
+    {
+        HashTable ht(10, "test.recovery");
+        for (auto v=0; v<3; v++) {
+            for (auto i=0; i<n; i++) {
+                if (v && i%3 == 0) {
+                    continue;
+                }
+                auto nk = sprintf(kbuf, "key-%d", i);
+                auto nv = sprintf(vbuf, "val-%d-%d", i, v);
+                ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+                if (i%7 == 0) {
+                    ht.Delete(bytes(kbuf, nk));
+                }
+            }
+        }
+    }
+
+    auto f = fopen("test.recovery", "a");
+    for (auto i=0; i<WRITE_BUFFER_SIZE; i++) {
+        fputc(rand(), f);
+    }
+    fclose(f);
+
+    {
+        HashTable ht(1, "test.recovery", true);
+        verify_recovery(ht, n, 2, b);
+        for (auto i=0; i<n; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            auto nv = sprintf(vbuf, "val-%d-%d", i, i%3 ? 3 : 0);
+            if (i%7) {
+                ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+            }
+        }
+        verify_recovery(ht, n, 3, b);
+    }
+
+    HashTable ht(1, "test.recovery", true);
+    verify_recovery(ht, n, 3, b);
+    ht.Stats();
+}
+
+// WaitDurable covers the cold and value logs, streams without new writes
+// must not seal and sync empty buffers
+void test_wait_durable(Buffer &b) {
+    char kbuf[100];
+    auto n = 500;
+    HashTable ht(10, "test.wait", false, BLOCK_CACHE_SIZE, LOG_DURABLE_GROUP_COMMIT, HT_BLOOM_BITS, 64);
+    // Relocations go to the hot log, the cold log stays idle
+    CompactionOptions opts;
+    opts.segregate = false;
+    ht.StartCompactor(opts);
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        ht.WaitDurable(ht.Set(bytes(kbuf, nk), bytes(kbuf, nk)));
+    }
+    ht.StopCompactor();
+
+#ifdef USE_METRICS
+    auto s = ht.GetStats(false);
+    auto &l = s.log.counters;
+    if (l[LOG_SYNCS] > uint64_t(n + n/10) || l[LOG_DISK_WRITES] > uint64_t(n + n/10)) {
+        cout<<"wait durable syncs: "<<l[LOG_SYNCS]<<" writes: "<<l[LOG_DISK_WRITES]<<endl;
+    }
+#endif
+    struct stat st;
+    if (stat("test.wait.cold", &st) == 0 && st.st_size > 1024*1024) {
+        cout<<"wait durable cold log: "<<st.st_size<<endl;
+    }
+}
+
+// A child process updates a small set of keys, acknowledging every update
+// after WaitDurable, and is killed. The updates relocate chain starts into
+// the cold log, every acknowledged one has to survive the recovery.
+void test_crash_recovery(Buffer &b) {
+    char kbuf[100], vbuf[100];
+    auto n = 500;
+    // Acknowledged round of every key, shared with the children
+    auto acked = static_cast<int *>(mmap(0, n*sizeof(int), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0));
+    assert(acked != MAP_FAILED);
+    fill(acked, acked+n, -1);
+    remove("test.crash.ckpt");
+
+    auto lost = 0, start = 0;
+    for (auto crash=0; crash<3; crash++) {
+        auto pid = fork();
+        if (pid == 0) {
+            HashTable ht(10, "test.crash", crash > 0);
+            for (auto r=start; ; r++) {
+                for (auto i=0; i<n; i++) {
+                    auto nk = sprintf(kbuf, "key-%d", i);
+                    auto nv = sprintf(vbuf, "%d", r);
+                    ht.WaitDurable(ht.Set(bytes(kbuf, nk), bytes(vbuf, nv)));
+                    acked[i] = r;
+                }
+            }
+        }
+
+        this_thread::sleep_for(chrono::milliseconds(300));
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+
+        HashTable ht(10, "test.crash", true);
+        for (auto i=0; i<n; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            auto out = ht.Get(bytes(kbuf, nk), b);
+            auto r = out.size ? atoi(string(out.data, out.size).c_str()) : -1;
+            if (r < acked[i]) {
+                lost++;
+            }
+            start = max(start, r+1);
+        }
+    }
+    if (lost) {
+        cout<<"crash recovery lost updates: "<<lost<<endl;
+    }
+    munmap(acked, n*sizeof(int));
+}
+
+// Kill a writer that keeps compacting its log, chains relocated before the
+// crash must not come back as live and stall the compactor on reopen
+void test_crash_compaction(Buffer &b) {
+    char kbuf[100], vbuf[100];
+    auto n = 500;
+    remove("test.crashc.ckpt");
+    auto pid = fork();
+    if (pid == 0) {
+        HashTable ht(10, "test.crashc", false, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE);
+        for (auto r=0; ; r++) {
+            for (auto i=0; i<n; i++) {
+                auto nk = sprintf(kbuf, "key-%d", i);
+                auto nv = sprintf(vbuf, "%d", r);
+                ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+            }
+        }
+    }
+
+    this_thread::sleep_for(chrono::milliseconds(1500));
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    HashTable ht(10, "test.crashc", true, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE);
+    auto nk = sprintf(kbuf, "key-%d", 0);
+    ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+    if (ht.GetLogFragmentation() > CompactionOptions().highWatermark) {
+        cout<<"fragmentation after crash: "<<ht.GetLogFragmentation()<<endl;
+    }
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        if (!ht.Get(bytes(kbuf, nk), b).size) {
+            cout<<"key lost after crash: "<<i<<endl;
+        }
+    }
+}
+
+string readFile(const string &path) {
+    string data;
+    auto f = fopen(path.c_str(), "r");
+    for (auto c=fgetc(f); c != EOF; c=fgetc(f)) {
+        data.push_back(c);
+    }
+    fclose(f);
+    return data;
+}
+
+// Recover from a checkpoint taken while writers were running, so that the
+// log written after it has to be replayed on top of the directory
+void test_checkpoint(Buffer &b) {
+    char kbuf[100], vbuf[100];
+    auto n = 20000;
+    string ckpt;
+    {
+        HashTable ht(10, "test.recovery");
+        ht.StartCheckpointer(1024*1024);
+        for (auto v=0; v<3; v++) {
+            for (auto i=0; i<n; i++) {
+                if (v && i%3 == 0) {
+                    continue;
+                }
+                auto nk = sprintf(kbuf, "key-%d", i);
+                auto nv = sprintf(vbuf, "val-%d-%d", i, v);
+                ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+                if (i%7 == 0) {
+                    ht.Delete(bytes(kbuf, nk));
+                }
+            }
+
+            if (v == 0) {
+                ht.StopCheckpointer();
+                ht.Checkpoint();
+                ckpt = readFile("test.recovery.ckpt");
+            }
+        }
+    }
+
+    // Put back the first checkpoint in place of the one taken on shutdown
+    auto f = fopen("test.recovery.ckpt", "w");
+    fwrite(ckpt.data(), 1, ckpt.size(), f);
+    fclose(f);
+
+    HashTable ht(1, "test.recovery", true);
+    verify_recovery(ht, n, 2, b);
+    ht.Stats();
+}
+
+// Compact a table into the cold log while the hot keys keep changing,
+// then reopen it from the checkpoint and by replaying both logs
+void test_hot_cold(Buffer &b) {
+    char kbuf[100], vbuf[100];
+    auto n = 20000;
+    auto rounds = 30;
+    auto check = [&](HashTable &ht) {
+        for (auto i=0; i<n; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            auto nv = sprintf(vbuf, "val-%d-%d", i, i%10 ? 0 : rounds-1);
+            auto out = ht.Get(bytes(kbuf, nk), b);
+            if (!(out == bytes(vbuf, nv))) {
+                cout<<"hot/cold: "<<bytes(vbuf, nv)<<" != "<<out<<endl;
+            }
+        }
+    };
+
+    {
+        HashTable ht(10, "test.hotcold");
+        for (auto v=0; v<rounds; v++) {
+            for (auto i=0; i<n; i++) {
+                if (v && i%10) {
+                    continue;
+                }
+                auto nk = sprintf(kbuf, "key-%d", i);
+                auto nv = sprintf(vbuf, "val-%d-%d", i, v);
+                ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+            }
+        }
+        check(ht);
+        ht.Stats();
+    }
+
+    for (auto replay=0; replay<2; replay++) {
+        if (replay) {
+            remove("test.hotcold.ckpt");
+        }
+        HashTable ht(10, "test.hotcold", true);
+        check(ht);
+    }
+}
+
+// Values above the threshold are kept in the value log, they have to
+// survive merges, splits, collection of the value log and reopening
+void test_value_log(Buffer &b) {
+    char kbuf[100];
+    auto n = 2000;
+    auto rounds = 10;
+    // Every fourth value stays inline
+    auto value = [](int i, int v) {
+        return string(i%4 ? 2000 + i%3*1000 : 100, 'a' + (i+v)%26);
+    };
+    auto check = [&](HashTable &ht) {
+        vector<string> keys;
+        vector<bytes> kbs, values;
+        for (auto i=0; i<n; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            keys.push_back(string(kbuf, nk));
+        }
+        for (auto &k: keys) {
+            kbs.push_back(bytes(&k[0], k.size()));
+        }
+
+        ht.MultiGet(kbs, values, b);
+        Buffer gb;
+        for (auto i=0; i<n; i++) {
+            auto v = value(i, rounds-1);
+            auto expected = i%7 ? bytes(&v[0], v.size()) : bytes();
+            auto out = ht.Get(kbs[i], gb);
+            if (!(out == expected) || !(values[i] == expected)) {
+                cout<<"value log: "<<kbs[i]<<" "<<out.size<<" "<<values[i].size<<" != "<<expected.size<<endl;
+            }
+        }
+    };
+
+    string paths[] = {"", "test.values"};
+    for (auto &path: paths) {
+        {
+            HashTable ht(10, path, false, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE, HT_BLOOM_BITS, 1024);
+            for (auto v=0; v<rounds; v++) {
+                WriteBatch batch;
+                for (auto i=0; i<n; i++) {
+                    auto nk = sprintf(kbuf, "key-%d", i);
+                    auto val = value(i, v);
+                    if (v%2) {
+                        batch.Put(bytes(kbuf, nk), bytes(&val[0], val.size()));
+                    } else {
+                        ht.Set(bytes(kbuf, nk), bytes(&val[0], val.size()));
+                    }
+                    if (i%7 == 0 && v%2) {
+                        batch.Delete(bytes(kbuf, nk));
+                    } else if (i%7 == 0) {
+                        ht.Delete(bytes(kbuf, nk));
+                    }
+                }
+                ht.Write(batch);
+            }
+            check(ht);
+            ht.Stats();
+        }
+
+        if (path == "") {
+            continue;
+        }
+        for (auto replay=0; replay<2; replay++) {
+            if (replay) {
+                remove("test.values.ckpt");
+            }
+            HashTable ht(10, path, true, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE, HT_BLOOM_BITS, 1024);
+            check(ht);
+        }
+    }
+}
+
+void verify_sharded(ShardedHashTable &ht, int n, int round, Buffer &b) {
+    char kbuf[100], vbuf[100];
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        auto nv = sprintf(vbuf, "val-%d-%d", i, round);
+        auto v = ht.Get(bytes(kbuf, nk), b);
+        if (i%7 == 0 ? v.size != 0 : !(v == bytes(vbuf, nv))) {
+            cout<<"sharded key: "<<kbuf<<" round: "<<round<<endl;
+        }
+    }
+}
+
+// Direct calls and workers see the same shards, and every shard recovers
+// from its own logs
+void test_sharded(Buffer &b) {
+    auto n = 20000;
+    auto nthreads = 4;
+    {
+        ShardedHashTable ht(4, 10, "test.sharded");
+        char kbuf[100], vbuf[100];
+        for (auto i=0; i<n; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            auto nv = sprintf(vbuf, "val-%d-%d", i, 0);
+            ht.Set(bytes(kbuf, nk), bytes(vbuf, nv));
+            if (i%7 == 0) {
+                ht.Delete(bytes(kbuf, nk));
+            }
+        }
+        verify_sharded(ht, n, 0, b);
+        for (auto i=0; i<ht.NumShards(); i++) {
+            if (ht.Shard(i)->NumBuckets() <= 10) {
+                cout<<"sharded shard: "<<i<<" did not grow"<<endl;
+            }
+        }
+
+        // Threads update disjoint keys through the workers
+        ht.StartWorkers();
+        vector<thread> threads;
+        for (auto t=0; t<nthreads; t++) {
+            threads.push_back(thread([&ht, t, n, nthreads]() {
+                auto batch = 100;
+                unique_ptr<ShardedHashTable::Request[]> reqs(new ShardedHashTable::Request[batch]);
+                vector<string> keys(batch), values(batch);
+                for (auto i=t; i<n; ) {
+                    auto m = 0;
+                    for (; m<batch && i<n; m++, i+=nthreads) {
+                        keys[m] = "key-" + to_string(i);
+                        values[m] = "val-" + to_string(i) + "-1";
+                        auto &r = reqs[m];
+                        r.op = i%7 == 0 ? ShardedHashTable::SHARD_DELETE : ShardedHashTable::SHARD_SET;
+                        r.key = bytes(&keys[m][0], keys[m].size());
+                        r.value = bytes(&values[m][0], values[m].size());
+                    }
+                    ht.Run(reqs.get(), m);
+
+                    for (auto j=0; j<m; j++) {
+                        reqs[j].op = ShardedHashTable::SHARD_GET;
+                    }
+                    ht.Run(reqs.get(), m);
+                    for (auto j=0; j<m; j++) {
+                        auto &r = reqs[j];
+                        auto del = stoi(keys[j].substr(4))%7 == 0;
+                        if (r.found == del || (r.found && !(r.value == bytes(&values[j][0], values[j].size())))) {
+                            cout<<"sharded worker key: "<<keys[j]<<endl;
+                        }
+                    }
+                }
+            }));
+        }
+        for (auto &t: threads) {
+            t.join();
+        }
+        ht.StopWorkers();
+        verify_sharded(ht, n, 1, b);
+        ht.Checkpoint();
+    }
+
+    ShardedHashTable ht(4, 1, "test.sharded", true);
+    verify_sharded(ht, n, 1, b);
+    ht.Stats();
+}
+
+// Counters and histograms account for every operation, and the bucket
+// distributions cover the directory
+void test_metrics(Buffer &b) {
+    for (uint64_t v=1; v < (uint64_t(1) << 42); v = v*3/2 + 1) {
+        auto upper = Histogram::Value(Histogram::Bucket(v));
+        if (v < (uint64_t(1) << METRIC_MAX_BITS) && (upper < v || upper > v + v/16)) {
+            cout<<"metrics bucket of: "<<v<<" upper: "<<upper<<endl;
+        }
+    }
+
+    char kbuf[100];
+    auto n = 1000;
+    HashTable ht(10, "test.metrics", false, 0);
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+    }
+    for (auto i=0; i<n/10; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        ht.Delete(bytes(kbuf, nk));
+    }
+    // Push the segments out of the write buffers
+    string filler(4096, 'x');
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "filler-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(&filler[0], filler.size()));
+    }
+    for (auto i=0; i<2*n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        ht.Get(bytes(kbuf, nk), b);
+    }
+
+    auto s = ht.GetStats();
+    uint64_t buckets = 0, items = 0;
+    for (size_t i=0; i<s.chainLengths.size(); i++) {
+        buckets += s.chainLengths[i];
+    }
+    for (size_t i=0; i<s.occupancy.size(); i++) {
+        items += i*s.occupancy[i];
+    }
+    if (buckets != s.buckets || items != s.items) {
+        cout<<"metrics buckets: "<<buckets<<" items: "<<items<<endl;
+    }
+
+#ifdef USE_METRICS
+    auto &c = s.counters;
+    if (c[HT_SETS] != uint64_t(2*n) || c[HT_DELETES] != uint64_t(n/10) || c[HT_GETS] != uint64_t(2*n) ||
+            c[HT_GET_HITS] != uint64_t(n - n/10) || c[HT_SEGMENTS_READ] < c[HT_GET_HITS] || !c[HT_BYTES_READ]) {
+        cout<<"metrics counters"<<endl;
+    }
+    // Deleted keys are only found while their tombstones are not merged
+    // away
+    auto misses = c[HT_BLOOM_NEGATIVES] + c[HT_BLOOM_FALSE_POSITIVES];
+    if (misses < uint64_t(n) || misses > uint64_t(n + n/10)) {
+        cout<<"metrics counters"<<endl;
+    }
+    if (s.histograms[HT_GET_LATENCY].count != uint64_t(2*n) || s.histograms[HT_SET_LATENCY].count != uint64_t(2*n + n/10)) {
+        cout<<"metrics latency counts"<<endl;
+    }
+    auto &l = s.log.counters;
+    if (!l[LOG_DISK_READS] || !l[LOG_DISK_WRITES] || l[LOG_DISK_WRITE_BYTES] < uint64_t(n)*4096 ||
+            s.log.histograms[LOG_READ_LATENCY].count == 0) {
+        cout<<"metrics log counters"<<endl;
+    }
+#endif
+    ht.Stats();
+}
+
+// Keys spread evenly over the buckets with the folded hash
+template<class H>
+void checkHashSpread(const char *name) {
+    vector<int> buckets(1024);
+    char kbuf[64];
+    auto n = 100*int(buckets.size());
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        buckets[keyHash<H>(bytes(kbuf, nk)) % buckets.size()]++;
+    }
+
+    auto most = *max_element(buckets.begin(), buckets.end());
+    if (most > 2*n/int(buckets.size())) {
+        cout<<name<<": "<<most<<" keys in one bucket"<<endl;
+    }
+}
+
+// The crc32 instruction and the tables agree on any length and alignment
+void test_hash(Buffer &b) {
+    char buf[300];
+    randKey(buf, sizeof(buf));
+    if (crc32c(0, "123456789", 9) != 0xE3069283) {
+        cout<<"crc32c check value: "<<crc32c(0, "123456789", 9)<<endl;
+    }
+    for (auto off=0; off<8; off++) {
+        for (auto len=0; len<256; len++) {
+            if (crc32c(0, buf+off, len) != crc32cSoftware(0, buf+off, len)) {
+                cout<<"crc32c off: "<<off<<" len: "<<len<<endl;
+            }
+        }
+    }
+
+    checkHashSpread<Murmur32Hash>("murmur32");
+    checkHashSpread<Murmur128Hash>("murmur128");
+    checkHashSpread<CRC32CHash>("crc32c");
+    checkHashSpread<WyHash>("wyhash");
+
+    // A table of another policy splits, merges and recovers with it
+    char kbuf[100];
+    auto n = 20000;
+    for (auto recover=0; recover<2; recover++) {
+        CRC32CHashTable ht(10, "test.crc", recover, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE);
+        for (auto i=0; i<n && !recover; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+        }
+        for (auto i=0; i<n; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            auto out = ht.Get(bytes(kbuf, nk), b);
+            if (!(out == bytes(kbuf, nk))) {
+                cout<<"crc32c table: "<<bytes(kbuf, nk)<<" != "<<out<<endl;
+            }
+        }
+    }
+}
+
+void verify_fixed(FixedHashTable &ht, int n, int version, Buffer &b) {
+    char k[8], v[16];
+    for (auto i=0; i<n; i++) {
+        fixedKV(i, version, k, v);
+        auto out = ht.Get(bytes(k, sizeof(k)), b);
+        auto expected = i%7 ? bytes(v, sizeof(v)) : bytes();
+        if (!(out == expected)) {
+            cout<<"fixed: key "<<i<<" value size "<<out.size<<endl;
+        }
+    }
+}
+
+// Updates, deletes, batches, MultiGet and recovery of a table of fixed
+// size keys and values
+void test_fixed(Buffer &b) {
+    auto n = 20000;
+    char k[8], v[16];
+    {
+        FixedHashTable ht(10, "test.fixed");
+        for (auto ver=0; ver<3; ver++) {
+            for (auto i=0; i<n; i++) {
+                fixedKV(i, ver, k, v);
+                ht.Set(bytes(k, sizeof(k)), bytes(v, sizeof(v)));
+                if (i%7 == 0) {
+                    ht.Delete(bytes(k, sizeof(k)));
+                }
+            }
+        }
+        verify_fixed(ht, n, 2, b);
+
+        // The segments of the batch mix values and deleted keys
+        WriteBatch batch;
+        for (auto i=0; i<n; i++) {
+            fixedKV(i, 3, k, v);
+            if (i%7) {
+                batch.Put(bytes(k, sizeof(k)), bytes(v, sizeof(v)));
+            } else {
+                batch.Delete(bytes(k, sizeof(k)));
+            }
+        }
+        ht.Write(batch);
+        verify_fixed(ht, n, 3, b);
+
+        vector<uint64_t> ids;
+        vector<bytes> keys, values;
+        for (uint64_t i=0; i<uint64_t(n); i += 3) {
+            ids.push_back(i);
+        }
+        for (auto &i: ids) {
+            keys.push_back(bytes(reinterpret_cast<char *>(&i), sizeof(i)));
+        }
+        ht.MultiGet(keys, values, b);
+        for (size_t j=0; j<ids.size(); j++) {
+            fixedKV(ids[j], 3, k, v);
+            auto expected = ids[j]%7 ? bytes(v, sizeof(v)) : bytes();
+            if (!(values[j] == expected)) {
+                cout<<"fixed multiget: key "<<ids[j]<<endl;
+            }
+        }
+    }
+
+    FixedHashTable ht(1, "test.fixed", true);
+    verify_fixed(ht, n, 3, b);
+}
+
+template<class T>
+void verify_bound(T &ht, int n, Buffer &b) {
+    char kbuf[100];
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        auto out = ht.Get(bytes(kbuf, nk), b);
+        auto expected = i%5 ? bytes(kbuf, nk) : bytes();
+        if (!(out == expected)) {
+            cout<<"bound log: "<<expected<<" != "<<out<<endl;
+        }
+    }
+}
+
+template<class T>
+void fill_bound(T &ht, int n) {
+    char kbuf[100];
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+        if (i%5 == 0) {
+            ht.Delete(bytes(kbuf, nk));
+        }
+    }
+}
+
+// Tables bound to InMemoryLog and PersistentLog
+void test_bound_log(Buffer &b) {
+    auto n = 20000;
+    InMemoryHashTable mem(10, "");
+    fill_bound(mem, n);
+    verify_bound(mem, n, b);
+    {
+        PersistentHashTable ht(10, "test.bound");
+        fill_bound(ht, n);
+        verify_bound(ht, n, b);
+    }
+
+    PersistentHashTable ht(1, "test.bound", true);
+    verify_bound(ht, n, b);
+}
+
+// Every fourth key is set again with an expiry time in the past, which
+// hides its older value, the next ones expire in an hour, in two seconds
+// and never. Odd keys go through write batches.
+void test_ttl(Buffer &b) {
+    char kbuf[100];
+    auto n = 2000;
+    auto value = [](int i) {
+        return string(i%3 ? 100 : 10, 'a' + i%26);
+    };
+    auto check = [&](HashTable &ht, bool late) {
+        vector<string> keys;
+        vector<bytes> kbs, values;
+        for (auto i=0; i<n; i++) {
+            keys.push_back(string(kbuf, sprintf(kbuf, "key-%d", i)));
+        }
+        for (auto &k: keys) {
+            kbs.push_back(bytes(&k[0], k.size()));
+        }
+
+        ht.MultiGet(kbs, values, b);
+        Buffer gb;
+        for (auto i=0; i<n; i++) {
+            auto v = value(i);
+            auto expected = i%4 == 0 || (i%4 == 2 && late) ? bytes() : bytes(&v[0], v.size());
+            auto out = ht.Get(kbs[i], gb);
+            if (!(out == expected) || !(values[i] == expected)) {
+                cout<<"ttl: "<<kbs[i]<<" "<<out.size<<" "<<values[i].size<<" != "<<expected.size<<endl;
+            }
+        }
+    };
+
+    // The second table keeps the long values in the value log
+    string paths[] = {"", "test.ttl"};
+    for (auto &path: paths) {
+        {
+            HashTable ht(10, path, false, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE, HT_BLOOM_BITS, path == "" ? 0 : 64);
+            auto now = htNow();
+            uint32_t expires[] = {now-1, now+3600, now+2, 0};
+            WriteBatch batch;
+            for (auto i=0; i<n; i++) {
+                auto nk = sprintf(kbuf, "key-%d", i);
+                auto v = value(i);
+                if (i%4 == 0) {
+                    ht.Set(bytes(kbuf, nk), bytes(&v[0], v.size()));
+                }
+                if (i%2) {
+                    batch.Put(bytes(kbuf, nk), bytes(&v[0], v.size()), expires[i%4]);
+                } else {
+                    ht.Set(bytes(kbuf, nk), bytes(&v[0], v.size()), expires[i%4]);
+                }
+                if (batch.Count() == 100) {
+                    ht.Write(batch);
+                    batch.Clear();
+                }
+            }
+            ht.Write(batch);
+            check(ht, false);
+
+            // Writes sweep the buckets once their hints pass
+            this_thread::sleep_for(chrono::seconds(3));
+            check(ht, true);
+            for (auto i=0; i<n; i++) {
+                auto nk = sprintf(kbuf, "filler-%d", i);
+                ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+            }
+            check(ht, true);
+            auto s = ht.GetStats(false);
+            if (!s.counters[HT_EXPIRED] || !s.counters[HT_EXPIRY_REWRITES]) {
+                cout<<"ttl expired: "<<s.counters[HT_EXPIRED]<<" rewrites: "<<s.counters[HT_EXPIRY_REWRITES]<<endl;
+            }
+        }
+
+        if (path == "") {
+            continue;
+        }
+        for (auto replay=0; replay<2; replay++) {
+            if (replay) {
+                remove("test.ttl.ckpt");
+            }
+            HashTable ht(10, path, true, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE, HT_BLOOM_BITS, 64);
+            check(ht, true);
+        }
+    }
+
+    // Hints of a table opened before its keys expire come from the
+    // checkpoint, nothing is replayed to rebuild them
+    {
+        HashTable ht(10, "test.ttl", false, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE);
+        auto now = htNow();
+        for (auto i=0; i<n; i++) {
+            auto nk = sprintf(kbuf, "key-%d", i);
+            ht.Set(bytes(kbuf, nk), bytes(kbuf, nk), now+2);
+        }
+    }
+    HashTable ht(10, "test.ttl", true, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE);
+    this_thread::sleep_for(chrono::seconds(3));
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "filler-%d", i);
+        ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+    }
+    auto s = ht.GetStats(false);
+    if (!s.counters[HT_EXPIRY_REWRITES]) {
+        cout<<"ttl restart: no expiry rewrites"<<endl;
+    }
+    for (auto i=0; i<n; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        if (ht.Get(bytes(kbuf, nk), b).size) {
+            cout<<"ttl restart: "<<bytes(kbuf, nk)<<" not expired"<<endl;
+        }
+    }
+
+    // Sweeps of a large directory advance over several writes, and each
+    // step rewrites its own batch of buckets
+    HashTable large(4*HT_EXPIRE_SCAN, "");
+    auto now = htNow();
+    for (auto i=0; i<4*HT_EXPIRE_SCAN; i++) {
+        auto nk = sprintf(kbuf, "key-%d", i);
+        large.Set(bytes(kbuf, nk), bytes(kbuf, nk), now+1);
+    }
+    this_thread::sleep_for(chrono::seconds(2));
+    for (auto i=0; i<100; i++) {
+        auto nk = sprintf(kbuf, "filler-%d", i);
+        large.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+    }
+    s = large.GetStats(false);
+    if (s.counters[HT_EXPIRY_REWRITES] <= uint64_t(HT_EXPIRE_BATCH)) {
+        cout<<"ttl sweep: "<<s.counters[HT_EXPIRY_REWRITES]<<" rewrites"<<endl;
+    }
+}
+
+// Counters merged by operator 0 from a base of 1000 on every third key and
+// restarted by a delete halfway on every fourth, and values appended to
+// by operator 1
+void test_merge(Buffer &b) {
+    char kbuf[100];
+    auto n = 2000, rounds = 20;
+    CounterMergeOperator counter;
+    AppendMergeOperator appender;
+    auto appended = [](int i, int rounds) {
+        string v = i%5 ? "v" : "";
+        for (auto r=0; r<rounds; r++) {
+            v.append(8, 'a' + r);
+        }
+        return v;
+    };
+    auto check = [&](HashTable &ht) {
+        vector<string> keys;
+        vector<bytes> kbs, values;
+        for (auto i=0; i<n; i++) {
+            keys.push_back(string(kbuf, sprintf(kbuf, "cnt-%d", i)));
+            keys.push_back(string(kbuf, sprintf(kbuf, "app-%d", i)));
+        }
+        for (auto &k: keys) {
+            kbs.push_back(bytes(&k[0], k.size()));
+        }
+
+        ht.MultiGet(kbs, values, b);
+        Buffer gb;
+        for (auto i=0; i<n; i++) {
+            int64_t expected = i%4 ? rounds*(i%10+1) + (i%3 ? 0 : 1000) : rounds/2*(i%10+1), got = -1;
+            auto out = ht.Get(kbs[2*i], gb);
+            if (out.size == sizeof(got)) {
+                memcpy(&got, out.data, sizeof(got));
+            }
+            if (got != expected || !(values[2*i] == out)) {
+                cout<<"merge counter: "<<kbs[2*i]<<" "<<got<<" != "<<expected<<endl;
+            }
+
+            auto v = appended(i, rounds);
+            out = ht.Get(kbs[2*i+1], gb);
+            if (!(out == bytes(&v[0], v.size())) || !(values[2*i+1] == out)) {
+                cout<<"merge append: "<<kbs[2*i+1]<<" "<<out<<" != "<<v<<endl;
+            }
+        }
+    };
+
+    // The second table keeps the appended values in the value log
+    string paths[] = {"", "test.merge"};
+    for (auto &path: paths) {
+        {
+            HashTable ht(10, path, false, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE, HT_BLOOM_BITS, path == "" ? 0 : 64);
+            ht.RegisterMergeOperator(0, &counter);
+            ht.RegisterMergeOperator(1, &appender);
+            for (auto r=0; r<rounds; r++) {
+                for (auto i=0; i<n; i++) {
+                    auto nk = sprintf(kbuf, "cnt-%d", i);
+                    if (r == 0 && i%3 == 0) {
+                        int64_t base = 1000;
+                        ht.Set(bytes(kbuf, nk), bytes(reinterpret_cast<char *>(&base), sizeof(base)));
+                    }
+                    if (r == rounds/2 && i%4 == 0) {
+                        ht.Delete(bytes(kbuf, nk));
+                    }
+                    int64_t d = i%10+1;
+                    ht.Merge(bytes(kbuf, nk), bytes(reinterpret_cast<char *>(&d), sizeof(d)));
+
+                    nk = sprintf(kbuf, "app-%d", i);
+                    string op(8, 'a' + r), base("v");
+                    if (r == 0 && i%5) {
+                        ht.Set(bytes(kbuf, nk), bytes(&base[0], base.size()));
+                    }
+                    ht.Merge(bytes(kbuf, nk), bytes(&op[0], op.size()), 1);
+                }
+            }
+            check(ht);
+        }
+
+        if (path == "") {
+            continue;
+        }
+        for (auto replay=0; replay<2; replay++) {
+            if (replay) {
+                remove("test.merge.ckpt");
+            }
+            HashTable ht(10, path, true, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE, HT_BLOOM_BITS, 64);
+            ht.RegisterMergeOperator(0, &counter);
+            ht.RegisterMergeOperator(1, &appender);
+            check(ht);
+        }
+    }
+
+    // Without the appender its keys read as missing unless their operands
+    // were folded already. Merges, splits and compactions caused by other
+    // writes keep the operands until it is registered again.
+    remove("test.unreg.ckpt");
+    {
+        HashTable ht(10, "test.unreg", false, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE, HT_BLOOM_BITS, 64);
+        ht.RegisterMergeOperator(1, &appender);
+        for (auto r=0; r<rounds; r++) {
+            for (auto i=0; i<n; i++) {
+                auto nk = sprintf(kbuf, "app-%d", i);
+                string op(8, 'a' + r), base("v");
+                if (r == 0 && i%5) {
+                    ht.Set(bytes(kbuf, nk), bytes(&base[0], base.size()));
+                }
+                ht.Merge(bytes(kbuf, nk), bytes(&op[0], op.size()), 1);
+            }
+        }
+    }
+    for (auto registered=0; registered<2; registered++) {
+        HashTable ht(10, "test.unreg", true, BLOCK_CACHE_SIZE, LOG_DURABLE_NONE, HT_BLOOM_BITS, 64);
+        if (registered) {
+            ht.RegisterMergeOperator(1, &appender);
+        }
+        for (auto pass=0; pass<2-registered; pass++) {
+            for (auto i=0; i<n; i++) {
+                auto nk = sprintf(kbuf, "app-%d", i);
+                auto v = appended(i, rounds);
+                auto out = ht.Get(bytes(kbuf, nk), b);
+                if (!(out == bytes(&v[0], v.size())) && (registered || out.size)) {
+                    cout<<"merge unregistered: "<<bytes(kbuf, nk)<<" "<<out<<" != "<<v<<endl;
+                }
+            }
+            for (auto i=0; i<10*n && !registered && !pass; i++) {
+                auto nk = sprintf(kbuf, "filler-%d", i);
+                ht.Set(bytes(kbuf, nk), bytes(kbuf, nk));
+            }
+        }
+        if (!registered && !ht.GetStats(false).counters[HT_UNRESOLVED]) {
+            cout<<"merge unregistered: no unresolved reads"<<endl;
+        }
+    }
+}
+
+int main() {
+    Buffer b;
+    test_hash(b);
+    test_set_get(b);
+    test_pinned_get(b);
+    test_bloom_filter(b);
+    test_background_compaction(b);
+    test_log_budget(b);
+    test_concurrent(b);
+    test_write_batch(b);
+    test_multiget(b);
+    test_recovery(b);
+    test_wait_durable(b);
+    test_crash_recovery(b);
+    test_crash_compaction(b);
+    test_checkpoint(b);
+    test_hot_cold(b);
+    test_value_log(b);
+    test_sharded(b);
+    test_metrics(b);
+    test_fixed(b);
+    test_bound_log(b);
+    test_merge(b);
+    test_ttl(b);
+
+    testbench_hash();
+    testbench_fixed();
+    testbench_dispatch();
+    testbench_growth();
+    testbench_compaction(false);
+    testbench_compaction(true);
+    testbench_hotcold(false);
+    testbench_hotcold(true);
+    for (auto valueSize: {4096, 16384, 65536}) {
+        testbench_valuelog(valueSize, 0);
+        testbench_valuelog(valueSize, 1024);
+    }
+    testbench_writebatch("", 10000);
+    testbench_writebatch("test.data", 10000);
+    testbench_multiget("test.data", 100);
+    testbench_recovery("test.data", 1000000);
+    testbench_cache("test.data", 0);
+    testbench_cache("test.data", BLOCK_CACHE_SIZE);
+    testbench_pinned(1024);
+    testbench_pinned(4096);
+    testbench_merge(16);
+    testbench_merge(256);
+    testbench_counters();
+    testbench_bloom(8);
+    testbench_bloom(16);
+    testbench_bloom(32);
+    testbench_durability(LOG_DURABLE_SYNC, "sync", 8);
+    testbench_durability(LOG_DURABLE_NONE, "none", 8);
+    testbench_durability(LOG_DURABLE_PERIODIC, "periodic", 8);
+    testbench_durability(LOG_DURABLE_GROUP_COMMIT, "group commit", 8);
+    for (auto t=1; t<=16; t*=2) {
+        testbench_concurrent(t);
+    }
+    for (auto t=1; t<=16; t*=2) {
+        testbench_sharded(t);
+    }
 
     return 0;
 }
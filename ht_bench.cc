@@ -0,0 +1,492 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <math.h>
+#include "hashtable.h"
+
+// YCSB style benchmark of the table. A load phase inserts the records, then
+// each workload runs its mix of operations on the loaded table. Results are
+// printed as one JSON object per line:
+//   {"type":"interval", ...}  throughput of every reporting interval
+//   {"type":"latency", ...}   latency percentiles of one operation
+//   {"type":"summary", ...}   throughput and log statistics of a phase
+//
+// Usage: ht_bench [--name=value ...]
+//   --workload=load,a,b,...  workloads to run after the load, or all
+//   --dist=uniform|zipfian|latest  overrides the distribution of the workload
+//   --records=N --ops=N --threads=N --key-size=N --value-size=N
+//   --backend=memory|file --path=FILE --durability=none|sync|periodic|group
+//   --buckets=N --interval=SECONDS --compactor=0|1
+
+using namespace std;
+using namespace std::chrono;
+
+const double ZIPF_THETA = 0.99;
+// Workload E scans up to this many keys
+const int YCSB_MAX_SCAN = 100;
+
+enum ycsbOp {
+    OP_READ,
+    OP_UPDATE,
+    OP_INSERT,
+    OP_SCAN,
+    OP_RMW,
+    OP_COUNT,
+};
+
+const char *opNames[] = {"read", "update", "insert", "scan", "rmw"};
+
+enum keyDist {
+    DIST_UNIFORM,
+    DIST_ZIPFIAN,
+    DIST_LATEST,
+};
+
+const char *distNames[] = {"uniform", "zipfian", "latest"};
+
+struct workload {
+    const char *name;
+    // Share of each ycsbOp
+    double mix[OP_COUNT];
+    keyDist dist;
+};
+
+const workload workloads[] = {
+    {"a", {0.5, 0.5, 0, 0, 0}, DIST_ZIPFIAN},
+    {"b", {0.95, 0.05, 0, 0, 0}, DIST_ZIPFIAN},
+    {"c", {1, 0, 0, 0, 0}, DIST_ZIPFIAN},
+    {"d", {0.95, 0, 0.05, 0, 0}, DIST_LATEST},
+    {"e", {0, 0, 0.05, 0.95, 0}, DIST_ZIPFIAN},
+    {"f", {0.5, 0, 0, 0, 0.5}, DIST_ZIPFIAN},
+};
+
+struct options {
+    string workloads;
+    int dist;
+    uint64_t records;
+    uint64_t ops;
+    int threads;
+    int keySize;
+    int valueSize;
+    string backend;
+    string path;
+    LogDurability durability;
+    int buckets;
+    double interval;
+    bool compactor;
+
+    options() :workloads("all"), dist(-1), records(1000000), ops(1000000), threads(1), keySize(24),
+        valueSize(100), backend("memory"), path("bench.data"), durability(LOG_DURABLE_NONE),
+        buckets(100000), interval(1), compactor(true) {}
+};
+
+// splitmix64, one per thread
+struct rng {
+    uint64_t s;
+
+    rng(uint64_t seed) :s(seed) {}
+
+    uint64_t Next() {
+        auto z = (s += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    double NextDouble() {
+        return (Next() >> 11) * (1.0/9007199254740992.0);
+    }
+};
+
+// Zipfian ranks over [0, n) after Gray et al, as in YCSB. Rank 0 is the
+// most popular.
+class zipfian {
+public:
+    zipfian(uint64_t n, double theta=ZIPF_THETA) :n(n), theta(theta) {
+        zetan = 0;
+        for (uint64_t i=1; i<=n; i++) {
+            zetan += 1/pow(double(i), theta);
+        }
+        alpha = 1/(1-theta);
+        auto zeta2 = 1 + pow(0.5, theta);
+        eta = (1 - pow(2.0/n, 1-theta)) / (1 - zeta2/zetan);
+        half = pow(0.5, theta);
+    }
+
+    uint64_t Next(rng &r) {
+        auto u = r.NextDouble();
+        auto uz = u*zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + half) {
+            return 1;
+        }
+        return min(n-1, uint64_t(n * pow(eta*u - eta + 1, alpha)));
+    }
+
+private:
+    uint64_t n;
+    double theta, zetan, alpha, eta, half;
+};
+
+// Spreads the popular ranks over the key space
+uint64_t fnv64(uint64_t v) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (auto i=0; i<8; i++) {
+        h ^= v & 0xff;
+        h *= 0x100000001B3ULL;
+        v >>= 8;
+    }
+    return h;
+}
+
+// Latencies in 64 linear sub-buckets per power of two, percentiles are
+// within 1.6% of the recorded values
+class histogram {
+public:
+    static const int SUB_BITS = 6;
+    static const int SUB = 1 << SUB_BITS;
+
+    histogram() :counts((64-SUB_BITS+1)*SUB), n(0), sum(0), max(0) {}
+
+    void Add(uint64_t ns) {
+        counts[bucket(ns)]++;
+        n++;
+        sum += ns;
+        max = std::max(max, ns);
+    }
+
+    void Merge(const histogram &o) {
+        for (size_t i=0; i<counts.size(); i++) {
+            counts[i] += o.counts[i];
+        }
+        n += o.n;
+        sum += o.sum;
+        max = std::max(max, o.max);
+    }
+
+    uint64_t Count() const {
+        return n;
+    }
+
+    double Mean() const {
+        return n ? double(sum)/n : 0;
+    }
+
+    uint64_t Max() const {
+        return max;
+    }
+
+    uint64_t Percentile(double p) const {
+        uint64_t rank = ceil(p*n), seen = 0;
+        for (size_t i=0; i<counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank && seen) {
+                return std::min(max, value(i));
+            }
+        }
+        return max;
+    }
+
+private:
+    static int bucket(uint64_t v) {
+        if (v < SUB) {
+            return int(v);
+        }
+        auto e = 63 - __builtin_clzll(v);
+        return SUB + (e-SUB_BITS)*SUB + int((v >> (e-SUB_BITS)) - SUB);
+    }
+
+    // Upper bound of the values in bucket i
+    static uint64_t value(size_t i) {
+        if (i < SUB) {
+            return i;
+        }
+        auto e = (i-SUB)/SUB + SUB_BITS;
+        auto m = (i-SUB)%SUB + SUB;
+        return ((m+1) << (e-SUB_BITS)) - 1;
+    }
+
+    vector<uint64_t> counts;
+    uint64_t n, sum, max;
+};
+
+struct alignas(64) threadStats {
+    histogram lat[OP_COUNT];
+    atomic<uint64_t> ops;
+    uint64_t notFound;
+
+    threadStats() :ops(0), notFound(0) {}
+};
+
+class bench {
+public:
+    bench(const options &opts) :opts(opts), inserted(opts.records),
+        zipf(max(opts.records, uint64_t(2))) {
+        auto path = opts.backend == "file" ? opts.path : "";
+        ht = new HashTable(opts.buckets, path, false, BLOCK_CACHE_SIZE, opts.durability);
+        if (opts.compactor) {
+            ht->StartCompactor();
+        }
+
+        rng r(42);
+        valuePool.resize(opts.valueSize + 4096);
+        for (auto &c: valuePool) {
+            c = char(r.Next());
+        }
+    }
+
+    ~bench() {
+        delete ht;
+    }
+
+    void Load() {
+        run("load", nullptr, opts.records);
+    }
+
+    void Run(const workload &w) {
+        run(w.name, &w, opts.ops);
+    }
+
+private:
+    // The key of record id, zero padded to the key size. Ids too large
+    // for it make longer keys.
+    bytes key(uint64_t id, char *buf) {
+        auto n = sprintf(buf, "user%0*llu", opts.keySize-4, (unsigned long long)id);
+        return bytes(buf, n);
+    }
+
+    bytes value(rng &r) {
+        return bytes(&valuePool[r.Next() % 4096], opts.valueSize);
+    }
+
+    uint64_t nextKey(const workload &w, rng &r) {
+        auto n = inserted.load(memory_order_relaxed);
+        auto dist = opts.dist >= 0 ? keyDist(opts.dist) : w.dist;
+        switch (dist) {
+        case DIST_UNIFORM:
+            return r.Next() % n;
+        case DIST_ZIPFIAN:
+            return fnv64(zipf.Next(r)) % n;
+        case DIST_LATEST:
+            return n - 1 - min(n-1, zipf.Next(r));
+        }
+        return 0;
+    }
+
+    ycsbOp nextOp(const workload &w, rng &r) {
+        auto u = r.NextDouble();
+        for (auto i=0; i<OP_COUNT; i++) {
+            if (u < w.mix[i]) {
+                return ycsbOp(i);
+            }
+            u -= w.mix[i];
+        }
+        return OP_READ;
+    }
+
+    void worker(const workload *w, uint64_t from, uint64_t to, int t, threadStats &st) {
+        rng r(t*7919 + 1);
+        Buffer b;
+        char kbuf[64];
+        vector<string> scanKeys(YCSB_MAX_SCAN);
+        vector<bytes> keys, values;
+        for (auto i=from; i<to; i++) {
+            auto op = w ? nextOp(*w, r) : OP_INSERT;
+            auto t0 = steady_clock::now();
+            switch (op) {
+            case OP_READ:
+                if (!ht->Get(key(nextKey(*w, r), kbuf), b).size) {
+                    st.notFound++;
+                }
+                break;
+            case OP_UPDATE:
+                ht->Set(key(nextKey(*w, r), kbuf), value(r));
+                break;
+            case OP_INSERT:
+                ht->Set(key(w ? inserted.fetch_add(1) : i, kbuf), value(r));
+                break;
+            case OP_SCAN: {
+                // There is no key order to scan in, a scan reads a run of
+                // consecutive record ids
+                auto start = nextKey(*w, r);
+                auto n = 1 + r.Next() % YCSB_MAX_SCAN;
+                keys.clear();
+                for (uint64_t j=0; j<n; j++) {
+                    auto k = key(start+j, kbuf);
+                    scanKeys[j].assign(k.data, k.size);
+                    keys.push_back(bytes(&scanKeys[j][0], k.size));
+                }
+                ht->MultiGet(keys, values, b);
+                break;
+            }
+            case OP_RMW: {
+                auto k = key(nextKey(*w, r), kbuf);
+                if (!ht->Get(k, b).size) {
+                    st.notFound++;
+                }
+                ht->Set(k, value(r));
+                break;
+            }
+            default:
+                break;
+            }
+            st.lat[op].Add(duration_cast<nanoseconds>(steady_clock::now() - t0).count());
+            st.ops.store(st.ops.load(memory_order_relaxed)+1, memory_order_relaxed);
+        }
+    }
+
+    void run(const char *name, const workload *w, uint64_t n) {
+        vector<threadStats> stats(opts.threads);
+        vector<thread> threads;
+        auto start = steady_clock::now();
+        for (auto t=0; t<opts.threads; t++) {
+            threads.push_back(thread(&bench::worker, this, w, n*t/opts.threads, n*(t+1)/opts.threads, t, ref(stats[t])));
+        }
+
+        // Throughput of every interval until the workers are done
+        atomic<bool> done(false);
+        thread reporter([&]() {
+            uint64_t last = 0;
+            auto prev = start;
+            while (!done) {
+                auto next = prev + microseconds(uint64_t(opts.interval*1e6));
+                while (!done && steady_clock::now() < next) {
+                    this_thread::sleep_for(milliseconds(10));
+                }
+                auto now = steady_clock::now();
+                uint64_t total = 0;
+                for (auto &s: stats) {
+                    total += s.ops.load(memory_order_relaxed);
+                }
+                duration<double> d = now - prev, elapsed = now - start;
+                cout<<"{\"type\":\"interval\",\"phase\":\""<<name<<"\",\"time\":"<<elapsed.count()
+                    <<",\"ops\":"<<total-last<<",\"throughput\":"<<(total-last)/d.count()<<"}"<<endl;
+                last = total;
+                prev = now;
+            }
+        });
+
+        for (auto &t: threads) {
+            t.join();
+        }
+        duration<double> elapsed = steady_clock::now() - start;
+        done = true;
+        reporter.join();
+
+        histogram lat[OP_COUNT];
+        uint64_t notFound = 0;
+        for (auto &s: stats) {
+            for (auto i=0; i<OP_COUNT; i++) {
+                lat[i].Merge(s.lat[i]);
+            }
+            notFound += s.notFound;
+        }
+
+        for (auto i=0; i<OP_COUNT; i++) {
+            auto &h = lat[i];
+            if (!h.Count()) {
+                continue;
+            }
+            cout<<"{\"type\":\"latency\",\"phase\":\""<<name<<"\",\"op\":\""<<opNames[i]<<"\",\"count\":"<<h.Count()
+                <<",\"mean_ns\":"<<h.Mean()<<",\"p50_ns\":"<<h.Percentile(0.5)<<",\"p90_ns\":"<<h.Percentile(0.9)
+                <<",\"p99_ns\":"<<h.Percentile(0.99)<<",\"p999_ns\":"<<h.Percentile(0.999)
+                <<",\"max_ns\":"<<h.Max()<<"}"<<endl;
+        }
+
+        auto dist = opts.dist >= 0 ? opts.dist : w ? int(w->dist) : DIST_UNIFORM;
+        cout<<"{\"type\":\"summary\",\"phase\":\""<<name<<"\",\"dist\":\""<<(w ? distNames[dist] : "sequential")
+            <<"\",\"backend\":\""<<opts.backend<<"\",\"threads\":"<<opts.threads<<",\"records\":"<<inserted
+            <<",\"key_size\":"<<opts.keySize<<",\"value_size\":"<<opts.valueSize<<",\"ops\":"<<n
+            <<",\"seconds\":"<<elapsed.count()<<",\"throughput\":"<<n/elapsed.count()<<",\"not_found\":"<<notFound
+            <<",\"buckets\":"<<ht->NumBuckets()<<",\"fragmentation\":"<<ht->GetLogFragmentation()
+            <<",\"write_amplification\":"<<ht->GetWriteAmplification()<<"}"<<endl;
+    }
+
+    options opts;
+    HashTable *ht;
+    atomic<uint64_t> inserted;
+    zipfian zipf;
+    string valuePool;
+};
+
+bool parseArgs(int argc, char **argv, options &opts) {
+    for (auto i=1; i<argc; i++) {
+        string arg = argv[i];
+        auto eq = arg.find('=');
+        if (arg.compare(0, 2, "--") || eq == string::npos) {
+            return false;
+        }
+        auto name = arg.substr(2, eq-2), v = arg.substr(eq+1);
+        if (name == "workload") {
+            opts.workloads = v;
+        } else if (name == "dist") {
+            auto d = find(begin(distNames), end(distNames), v);
+            if (d == end(distNames)) {
+                return false;
+            }
+            opts.dist = int(d - begin(distNames));
+        } else if (name == "records") {
+            opts.records = stoull(v);
+        } else if (name == "ops") {
+            opts.ops = stoull(v);
+        } else if (name == "threads") {
+            opts.threads = max(1, stoi(v));
+        } else if (name == "key-size") {
+            opts.keySize = min(max(8, stoi(v)), 60);
+        } else if (name == "value-size") {
+            opts.valueSize = max(1, stoi(v));
+        } else if (name == "backend" && (v == "memory" || v == "file")) {
+            opts.backend = v;
+        } else if (name == "path") {
+            opts.path = v;
+        } else if (name == "durability") {
+            const char *modes[] = {"none", "sync", "periodic", "group"};
+            const LogDurability values[] = {LOG_DURABLE_NONE, LOG_DURABLE_SYNC, LOG_DURABLE_PERIODIC, LOG_DURABLE_GROUP_COMMIT};
+            auto m = find(begin(modes), end(modes), v);
+            if (m == end(modes)) {
+                return false;
+            }
+            opts.durability = values[m - begin(modes)];
+        } else if (name == "buckets") {
+            opts.buckets = min(max(1, stoi(v)), int(HT_MAX_BUCKETS));
+        } else if (name == "interval") {
+            opts.interval = max(0.01, stod(v));
+        } else if (name == "compactor") {
+            opts.compactor = v != "0";
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    options opts;
+    if (!parseArgs(argc, argv, opts)) {
+        cerr<<"usage: ht_bench [--workload=load,a,b,c,d,e,f|all] [--dist=uniform|zipfian|latest]"<<endl
+            <<"    [--records=N] [--ops=N] [--threads=N] [--key-size=N] [--value-size=N]"<<endl
+            <<"    [--backend=memory|file] [--path=FILE] [--durability=none|sync|periodic|group]"<<endl
+            <<"    [--buckets=N] [--interval=SECONDS] [--compactor=0|1]"<<endl;
+        return 1;
+    }
+
+    vector<const workload *> run;
+    for (auto &w: workloads) {
+        auto names = "," + opts.workloads + ",";
+        if (opts.workloads == "all" || names.find(string(",") + w.name + ",") != string::npos) {
+            run.push_back(&w);
+        }
+    }
+
+    bench b(opts);
+    b.Load();
+    for (auto w: run) {
+        b.Run(*w);
+    }
+
+    return 0;
+}
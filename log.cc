@@ -2,23 +2,102 @@
 #include <assert.h>
 #include <atomic>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <stddef.h>
+
+LogReclaimer::LogReclaimer() :epoch(1), retiredOffset(0), safeOffset(0) {
+    for (auto i=0; i<LOG_MAX_READERS; i++) {
+        slots[i].epoch = 0;
+    }
+}
+
+int LogReclaimer::Pin() {
+    static thread_local int hint = hash<thread::id>()(this_thread::get_id()) % LOG_MAX_READERS;
+    while (true) {
+        for (auto i=0; i<LOG_MAX_READERS; i++) {
+            auto slot = (hint+i) % LOG_MAX_READERS;
+            uint64_t free = 0;
+            if (slots[slot].epoch.load(memory_order_relaxed) == 0 &&
+                    slots[slot].epoch.compare_exchange_strong(free, epoch.load())) {
+                hint = slot;
+                return slot;
+            }
+        }
+        this_thread::yield();
+    }
+}
+
+void LogReclaimer::Unpin(int slot) {
+    slots[slot].epoch.store(0, memory_order_release);
+}
+
+uint64_t LogReclaimer::minPinned() {
+    uint64_t e = UINT64_MAX;
+    for (auto i=0; i<LOG_MAX_READERS; i++) {
+        auto x = slots[i].epoch.load();
+        if (x && x < e) {
+            e = x;
+        }
+    }
+    return e;
+}
+
+LogOffset LogReclaimer::Retire(LogOffset off) {
+    lock_guard<mutex> lock(m);
+
+    // Space is released in LOG_RECLAIM_SIZE units, so there is no need to
+    // track every trim call
+    if (off >= retiredOffset + LOG_RECLAIM_SIZE) {
+        retired.push_back(make_pair(epoch.fetch_add(1), off));
+        retiredOffset = off;
+    }
+
+    if (!retired.empty()) {
+        auto e = minPinned();
+        while (!retired.empty() && retired.front().first < e) {
+            safeOffset = retired.front().second;
+            retired.pop_front();
+        }
+    }
+
+    return safeOffset;
+}
 
 InMemoryLog::InMemoryLog() :head(LOG_BEGIN_OFFSET), tail(LOG_BEGIN_OFFSET), phyHead(LOG_BEGIN_OFFSET) {
-    logBuf = static_cast<char *>(mmap(0, LOG_MAXSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+    logBuf = static_cast<char *>(mmap(0, LOG_MAXSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0));
 }
 
 LogSpace InMemoryLog::ReserveSpace(int size) {
-    auto r = LogSpace{tail, logBuf+tail+logBlockHeaderSize};
-    uint32_t *blockLen = reinterpret_cast<uint32_t*>(logBuf+tail);
+    uint64_t off = tail.fetch_add(size + logBlockHeaderSize);
+    auto r = LogSpace{off, logBuf+off+logBlockHeaderSize};
+    uint32_t *blockLen = reinterpret_cast<uint32_t*>(logBuf+off);
     *blockLen = static_cast<uint32_t>(size);
-    tail += size + logBlockHeaderSize;
     return r;
 }
 
+int InMemoryLog::ReserveSpace(const int *sizes, int n, LogSpace *spaces) {
+    uint64_t total = 0;
+    for (auto i=0; i<n; i++) {
+        total += sizes[i] + logBlockHeaderSize;
+    }
+
+    uint64_t off = tail.fetch_add(total);
+    for (auto i=0; i<n; i++) {
+        spaces[i] = LogSpace{off, logBuf+off+logBlockHeaderSize};
+        *reinterpret_cast<uint32_t*>(logBuf+off) = static_cast<uint32_t>(sizes[i]);
+        off += sizes[i] + logBlockHeaderSize;
+    }
+
+    return n;
+}
+
 void InMemoryLog::FinalizeWrite(LogSpace &s) {
 }
 
@@ -36,6 +115,22 @@ bytes InMemoryLog::Read(LogOffset off, int n, Buffer &b, int &blkSz) {
     return buf;
 }
 
+void InMemoryLog::ReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out) {
+    uint64_t total = 0;
+    for (auto i=0; i<n; i++) {
+        total += *reinterpret_cast<uint32_t*>(logBuf + offs[i]);
+    }
+
+    auto buf = b.Alloc(total);
+    uint64_t pos = 0;
+    for (auto i=0; i<n; i++) {
+        int len = static_cast<int>(*reinterpret_cast<uint32_t*>(logBuf + offs[i]));
+        memcpy(buf.data+pos, logBuf + offs[i] + logBlockHeaderSize, len);
+        out[i] = bytes(buf.data+pos, len);
+        pos += len;
+    }
+}
+
 LogOffset InMemoryLog::HeadOffset() {
     return head;
 }
@@ -46,7 +141,12 @@ LogOffset InMemoryLog::TailOffset() {
 
 void InMemoryLog::TrimLog(LogOffset off) {
     head = off;
-    auto diff = (head - phyHead)/LOG_RECLAIM_SIZE;
+    auto limit = reclaimer.Retire(off);
+    if (limit < phyHead) {
+        return;
+    }
+
+    auto diff = (limit - phyHead)/LOG_RECLAIM_SIZE;
     if (diff) {
         auto n = diff*LOG_RECLAIM_SIZE;
         auto r = madvise(logBuf+phyHead, n, MADV_DONTNEED);
@@ -60,21 +160,92 @@ InMemoryLog::~InMemoryLog() {
     munmap(logBuf, LOG_MAXSIZE);
 }
 
+void Log::ReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out) {
+    Buffer tb;
+    string staged;
+    vector<int> len(n);
+    for (auto i=0; i<n; i++) {
+        auto blk = Read(offs[i], tb);
+        len[i] = blk.size;
+        staged.append(blk.data, blk.size);
+    }
+
+    auto buf = b.Alloc(staged.size());
+    memcpy(buf.data, staged.data(), staged.size());
+    size_t pos = 0;
+    for (auto i=0; i<n; i++) {
+        out[i] = bytes(buf.data+pos, len[i]);
+        pos += len[i];
+    }
+}
+
+// The blocks of every log are read with one batch and then gathered into
+// b, a batch within one log is passed on as it is
+template<class L>
+void BasicHotColdLog<L>::ReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out) {
+    static thread_local Buffer lb[3];
+    vector<LogOffset> logOffs[3];
+    vector<int> idx[3];
+    for (auto i=0; i<n; i++) {
+        auto l = streamOf(offs[i]);
+        logOffs[l].push_back(offs[i] & ~LOG_STREAM_BITS);
+        idx[l].push_back(i);
+    }
+
+    for (auto l=0; l<3; l++) {
+        if (int(logOffs[l].size()) == n) {
+            logs[l]->ReadBatch(logOffs[l].data(), n, b, out);
+            return;
+        }
+    }
+
+    vector<bytes> blocks[3];
+    uint64_t total = 0;
+    for (auto l=0; l<3; l++) {
+        blocks[l].resize(logOffs[l].size());
+        if (!logOffs[l].empty()) {
+            logs[l]->ReadBatch(logOffs[l].data(), logOffs[l].size(), lb[l], blocks[l].data());
+        }
+        for (auto &blk: blocks[l]) {
+            total += blk.size;
+        }
+    }
+
+    auto buf = b.Alloc(total);
+    uint64_t pos = 0;
+    for (auto l=0; l<3; l++) {
+        for (size_t j=0; j<idx[l].size(); j++) {
+            auto &blk = blocks[l][j];
+            memcpy(buf.data+pos, blk.data, blk.size);
+            out[idx[l][j]] = bytes(buf.data+pos, blk.size);
+            pos += blk.size;
+        }
+    }
+}
+
 int logBlockSize(int size) {
     return size+logBlockHeaderSize;
 }
 
-PersistentLog::PersistentLog(string filepath, int wbsize) {
-    head = LOG_BEGIN_OFFSET;
-    tail = LOG_BEGIN_OFFSET;
-    phyHead = LOG_BEGIN_OFFSET;
-    phyTail = LOG_BEGIN_OFFSET;
-
+PersistentLog::PersistentLog(string filepath, int wbsize, bool recover, uint64_t cacheSize,
+        LogIOBackend io, LogDurability durability) :durability(durability), peer(nullptr), cache(cacheSize),
+    metrics(LOG_COUNTERS, LOG_HISTOGRAMS) {
     bufSize = wbsize;
-    bufOffset = 0;
-    bufClosed = false;
-    rc = 0;
-    int flags = O_RDWR | O_CREAT | O_SYNC;
+    stopping = false;
+    syncing = false;
+    syncInterval = LOG_SYNC_INTERVAL_MS;
+    syncBytes = LOG_SYNC_BYTES;
+    durableTrim = LOG_BEGIN_OFFSET;
+    // Trims and recovery parts have to start at buffer boundaries
+    assert(LOG_RECLAIM_SIZE % bufSize == 0 && LOG_RECOVER_READ_SIZE % bufSize == 0);
+
+    int flags = O_RDWR;
+    if (durability == LOG_DURABLE_SYNC) {
+        flags |= O_SYNC;
+    }
+    if (!recover) {
+        flags |= O_CREAT | O_TRUNC;
+    }
 
 #ifdef __linux__
     flags |= O_DIRECT;
@@ -82,83 +253,357 @@ PersistentLog::PersistentLog(string filepath, int wbsize) {
 
     fd = open(filepath.c_str(), flags, 0755);
     assert(fd > 0);
-    auto r = posix_memalign(reinterpret_cast<void **>(&buf), ALIGN_SIZE, bufSize);
+    iovec iovs[LOG_WRITE_BUFFERS];
+    int r;
+    for (auto i=0; i<LOG_WRITE_BUFFERS; i++) {
+        r = posix_memalign(reinterpret_cast<void **>(&frames[i]), ALIGN_SIZE, bufSize);
+        assert(r == 0);
+        bufs[i].state = BUF_FREE;
+        iovs[i] = iovec{frames[i], size_t(bufSize)};
+    }
+    cur = 0;
+
+    ring = new IORing(fd, io == LOG_IO_URING);
+    framesRegistered = ring->RegisterBuffers(iovs, LOG_WRITE_BUFFERS);
+
+    if (recover) {
+        char *page;
+        r = posix_memalign(reinterpret_cast<void **>(&page), ALIGN_SIZE, ALIGN_SIZE);
+        assert(r == 0);
+        auto n = pread(fd, page, ALIGN_SIZE, 0);
+        assert(n == ALIGN_SIZE);
+        memcpy(&super, page, sizeof(super));
+        free(page);
+        assert(super.magic == LOG_MAGIC && super.bufSize == uint64_t(bufSize));
+    } else {
+        super = LogSuperBlock{LOG_MAGIC, uint64_t(bufSize), LOG_BEGIN_OFFSET, 0};
+        writeSuper();
+    }
+
+    head = super.head;
+    phyHead = super.head;
+    phyTail = super.head;
+    durable = super.head;
+    startBuf(phyTail);
+    flusher = thread(&PersistentLog::runFlusher, this);
+}
+
+void PersistentLog::writeSuper() {
+    char *page;
+    auto r = posix_memalign(reinterpret_cast<void **>(&page), ALIGN_SIZE, ALIGN_SIZE);
     assert(r == 0);
+    memset(page, 0, ALIGN_SIZE);
+    memcpy(page, &super, sizeof(super));
+    auto n = pwrite(fd, page, ALIGN_SIZE, 0);
+    assert(n == ALIGN_SIZE);
+    free(page);
+    if (durability != LOG_DURABLE_SYNC) {
+        auto r = fdatasync(fd);
+        assert(r == 0);
+    }
+}
+
+void PersistentLog::SetSyncPeriod(int ms, uint64_t bytes) {
+    lock_guard<mutex> lock(m);
+    syncInterval = ms;
+    syncBytes = bytes;
+    flushCond.notify_one();
+}
+
+void PersistentLog::SetUserData(uint64_t data) {
+    super.userData = data;
+    writeSuper();
+}
+
+// Allocate a block from the current write buffer if it has room for it
+bool PersistentLog::allocate(int size, LogSpace &s) {
+    auto &wb = bufs[cur];
+    auto woffset = wb.used + size + logBlockHeaderSize;
+    auto capacity = wb.end - wb.offset;
+    if (wb.state == BUF_FILLING && (woffset <= capacity-logBlockHeaderSize || woffset == capacity)) {
+        auto allocOffset = wb.used;
+        wb.used += size + logBlockHeaderSize;
+        tail = wb.offset + wb.used;
+        wb.rc++;
+        auto data = memOf(wb.offset+allocOffset);
+        *reinterpret_cast<int32_t*>(data) = static_cast<int32_t>(size);
+        s = LogSpace{wb.offset+allocOffset, data+logBlockHeaderSize};
+        return true;
+    }
+
+    return false;
+}
+
+// A buffer sealed before it is full ends at the page after its last block
+LogOffset PersistentLog::sealedEnd(writeBuffer &wb) {
+    auto used = (wb.used+logBlockHeaderSize+ALIGN_SIZE-1)/ALIGN_SIZE*ALIGN_SIZE;
+    return min(wb.end, wb.offset+used);
+}
+
+// The next buffer needs a free descriptor, and the memory of its frame
+// once it starts a new frame
+bool PersistentLog::canStart(LogOffset off) {
+    auto &next = bufs[(cur+1) % LOG_WRITE_BUFFERS];
+    return next.state == BUF_FREE &&
+        (off != bufStart(off) || phyTail + uint64_t(LOG_WRITE_BUFFERS-1)*bufSize >= off);
+}
+
+// Seal the current buffer for the flusher and start the next one. The next
+// buffer may have to wait for a buffer to be written out, that is only done
+// with wait set. Returns false if the next buffer could not be started.
+bool PersistentLog::rotate(unique_lock<std::mutex> &lock, bool wait) {
+    auto prev = cur;
+    auto &wb = bufs[cur];
+    if (!wait && !canStart(wb.state == BUF_FILLING ? sealedEnd(wb) : wb.end)) {
+        return false;
+    }
+
+    if (wb.state == BUF_FILLING) {
+        // The padding goes in right away, the compactor may reach it
+        // before the buffer is written out
+        wb.end = sealedEnd(wb);
+        if (wb.used < wb.end-wb.offset) {
+            auto pad = wb.end-wb.offset-wb.used-logBlockHeaderSize;
+            *reinterpret_cast<int32_t*>(memOf(wb.offset+wb.used)) = -static_cast<int32_t>(pad);
+        }
+        wb.state = BUF_SEALED;
+        tail = wb.end;
+        flushCond.notify_one();
+    }
+
+    if (cur == prev && !canStart(wb.end)) {
+        MetricTimer t;
+        while (cur == prev && !canStart(wb.end)) {
+            cond.wait(lock);
+        }
+        metrics.Add(LOG_FLUSH_WAITS);
+        metrics.Record(LOG_FLUSH_WAIT_LATENCY, t);
+    }
+
+    // Somebody else may have moved on while we waited
+    if (cur == prev) {
+        startBuf(wb.end);
+    }
+    return true;
+}
+
+// Start filling the next buffer at off behind its header block
+void PersistentLog::startBuf(LogOffset off) {
+    cur = (cur+1) % LOG_WRITE_BUFFERS;
+    auto &wb = bufs[cur];
+    *reinterpret_cast<int32_t*>(memOf(off)) = -static_cast<int32_t>(sizeof(LogBufHeader)-logBlockHeaderSize);
+    wb.offset = off;
+    wb.end = bufStart(off) + bufSize;
+    wb.used = sizeof(LogBufHeader);
+    wb.rc = 0;
+    wb.state = BUF_FILLING;
+    tail = off + wb.used;
+}
+
+// The buffer holding off, null if it was not started or was written out
+PersistentLog::writeBuffer *PersistentLog::bufAt(LogOffset off) {
+    for (auto i=0; i<LOG_WRITE_BUFFERS; i++) {
+        auto &wb = bufs[i];
+        if (wb.state != BUF_FREE && off >= wb.offset && off < wb.end) {
+            return &wb;
+        }
+    }
+
+    return nullptr;
+}
+
+LogSpace PersistentLog::reserve(int size, unique_lock<std::mutex> &lock) {
+    LogSpace s;
+    while (!allocate(size, s)) {
+        rotate(lock, true);
+    }
+
+    return s;
 }
 
 LogSpace PersistentLog::ReserveSpace(int size) {
     unique_lock<std::mutex> lock(m);
+    return reserve(size, lock);
+}
 
-    tail += logBlockHeaderSize + size;
+// Blocks after the first one only move on to the next buffer if it is free,
+// waiting for a buffer to be written out could deadlock on the reservations
+// held by the caller
+int PersistentLog::ReserveSpace(const int *sizes, int n, LogSpace *spaces) {
+    unique_lock<std::mutex> lock(m);
+    spaces[0] = reserve(sizes[0], lock);
+
+    auto i = 1;
+    while (i < n) {
+        if (allocate(sizes[i], spaces[i])) {
+            i++;
+        } else if (!rotate(lock, false)) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+// Buffers are written out one at a time in log order, so that a torn write
+// can only ever cut off the end of the log. In the periodic mode the
+// flusher also seals the current buffer and syncs when the period is over.
+void PersistentLog::runFlusher() {
+    unique_lock<std::mutex> lock(m);
+    auto nextSync = chrono::steady_clock::now() + chrono::milliseconds(syncInterval);
+    auto syncDue = false;
     while (true) {
-        auto woffset = bufOffset + size + logBlockHeaderSize;
-        // Buffer has space, allocate
-        if (woffset <= bufSize-logBlockHeaderSize ||  woffset == bufSize) {
-            auto allocOffset = bufOffset;
-            bufOffset += size + logBlockHeaderSize;
-            rc++;
-            int32_t *blockLen = reinterpret_cast<int32_t*>(buf+allocOffset);
-            *blockLen = static_cast<int32_t>(size);
-            return LogSpace{phyTail+allocOffset, buf+allocOffset+logBlockHeaderSize};
-        // Write out the buffer if it has no users
-        } else if (rc == 0) {
-            writeBuf();
-        // Wait for the writer to release the buffer
-        } else {
-                bufClosed = true;
-                cond.wait(lock);
+        auto wb = bufAt(phyTail);
+        if (wb && wb->state == BUF_SEALED && wb->rc == 0) {
+            lock.unlock();
+            writeBuf(*wb);
+            lock.lock();
+            wb->state = BUF_FREE;
+            phyTail = wb->end;
+            if (durability == LOG_DURABLE_SYNC) {
+                durable = phyTail.load();
+            }
+            cond.notify_all();
+            continue;
+        }
+
+        if (stopping) {
+            break;
+        }
+
+        if (durability != LOG_DURABLE_PERIODIC) {
+            flushCond.wait(lock);
+            continue;
         }
+
+        auto now = chrono::steady_clock::now();
+        if (now >= nextSync) {
+            nextSync = now + chrono::milliseconds(syncInterval);
+            syncDue = true;
+            if (bufs[cur].used > sizeof(LogBufHeader) && rotate(lock, false)) {
+                continue;
+            }
+        }
+
+        if (phyTail > durable && (syncDue || phyTail - durable >= syncBytes)) {
+            syncTo(lock, phyTail);
+            syncDue = false;
+            continue;
+        }
+        syncDue = false;
+        flushCond.wait_until(lock, nextSync);
+    }
+}
+
+// Sync the written buffers until off is durable. The caller must have
+// written off out already. A sync in progress may cover off, so only one
+// thread syncs at a time and the others wait for it.
+void PersistentLog::syncTo(unique_lock<std::mutex> &lock, LogOffset off) {
+    while (durable < off) {
+        if (syncing) {
+            cond.wait(lock);
+            continue;
+        }
+
+        syncing = true;
+        LogOffset written = phyTail;
+        lock.unlock();
+        MetricTimer t;
+        auto r = fdatasync(fd);
+        assert(r == 0);
+        metrics.Add(LOG_SYNCS);
+        metrics.Record(LOG_SYNC_LATENCY, t);
+        lock.lock();
+        syncing = false;
+        if (written > durable) {
+            durable = written;
+        }
+        cond.notify_all();
     }
 }
 
-void PersistentLog::writeBuf() {
-    if (bufOffset < bufSize) {
-            int32_t *blockLen = reinterpret_cast<int32_t*>(buf+bufOffset);
-            *blockLen = -static_cast<int32_t>(bufSize-bufOffset-logBlockHeaderSize);
-            bufOffset += bufSize-bufOffset;
+void PersistentLog::WaitDurable(LogOffset off) {
+    if (durability == LOG_DURABLE_NONE || off < durable) {
+        return;
     }
 
-    auto r = pwrite(fd, static_cast<void*>(buf), bufSize, phyTail);
-    assert(r > 0);
-    phyTail += bufOffset;
-    bufOffset = 0;
-    bufClosed = false;
+    unique_lock<std::mutex> lock(m);
+    auto &wb = bufs[cur];
+    if (off >= wb.offset && wb.state == BUF_FILLING) {
+        // Offsets past the header of an empty buffer, like the tail, only
+        // wait for the buffers before it
+        if (wb.used > sizeof(LogBufHeader)) {
+            rotate(lock, true);
+        } else {
+            off = wb.offset-1;
+        }
+    }
+    while (off >= phyTail) {
+        cond.wait(lock);
+    }
+    syncTo(lock, off+1);
+}
+
+void PersistentLog::writeBuf(writeBuffer &wb) {
+    auto data = memOf(wb.offset);
+    auto hdr = reinterpret_cast<LogBufHeader*>(data);
+    auto sumStart = offsetof(LogBufHeader, magic);
+    hdr->magic = LOG_MAGIC;
+    hdr->offset = wb.offset;
+    hdr->used = wb.used;
+    hdr->size = wb.end - wb.offset;
+    hdr->crc = crc32c(0, data+sumStart, wb.used-sumStart);
+
+    IORing::Request req {data, hdr->size, wb.offset, true, framesRegistered ? frameOf(wb.offset) : -1};
+    MetricTimer t;
+    ring->Run(&req, 1);
+    assert(req.result == int(hdr->size));
+    metrics.Add(LOG_DISK_WRITES);
+    metrics.Add(LOG_DISK_WRITE_BYTES, hdr->size);
+    metrics.Record(LOG_WRITE_LATENCY, t);
 }
 
 void PersistentLog::FinalizeWrite(LogSpace &s) {
     unique_lock<std::mutex> lock(m);
 
-    rc--;
-    if (rc==0 && bufClosed) {
-        writeBuf();
+    auto wb = bufAt(s.Offset);
+    wb->rc--;
+    if (wb->rc == 0 && wb->state == BUF_SEALED) {
+        flushCond.notify_one();
     }
 }
 
 bytes PersistentLog::Read(LogOffset off, int n, Buffer &b, int &blockLen) {
-    // Data is in the memory buffer
-    // Perform optimistic read
-    do {
-        uint64_t phyOff = phyTail;
-        if (off >= phyOff) {
-            auto bs = b.Alloc(logBlockHeaderSize);
-            memcpy(bs.data, buf+off-phyOff, bs.size);
-            blockLen = static_cast<int>(*reinterpret_cast<int32_t*>(bs.data));
-
-            if (!n) {
-                n = blockLen;
+    // Data is in a write buffer
+    // Perform optimistic read, the frame is not reused before its buffers
+    // are written out, which moves phyTail past the block
+    while (off >= phyTail) {
+        auto start = bufStart(off);
+        auto data = memOf(off);
+        auto bs = b.Alloc(logBlockHeaderSize);
+        memcpy(bs.data, data, bs.size);
+        blockLen = static_cast<int>(*reinterpret_cast<int32_t*>(bs.data));
+
+        // Padding block, ignore it
+        if (blockLen < 0 && !n) {
+            if (off >= phyTail) {
+                return bytes{nullptr, 0};
             }
+            continue;
+        }
 
-            // Block len could be invalid as we do not use any synchronization
-            // Verify it before proceeding
-            if (off + n <= phyOff + bufSize) {
-                bs = b.Alloc(n);
-                memcpy(bs.data, buf+off-phyOff+logBlockHeaderSize, n);
-                if (phyOff == phyTail) {
-                    return bs;
-                }
-           }
+        auto len = n ? n : blockLen;
+
+        // Block len could be invalid as we do not use any synchronization
+        // Verify it before proceeding
+        if (off + logBlockHeaderSize + len <= start + bufSize) {
+            bs = b.Alloc(len);
+            memcpy(bs.data, data+logBlockHeaderSize, len);
+            if (off >= phyTail) {
+                return bs;
+            }
         }
-    } while (off > phyTail);
+    }
 
     // Data is in the persistent log
     auto alignOff = (off / 4096)*4096;
@@ -168,8 +613,7 @@ bytes PersistentLog::Read(LogOffset off, int n, Buffer &b, int &blockLen) {
     }
 
     auto buf = b.Alloc(rdSize);
-    auto r = pread(fd, buf.data, buf.size, alignOff);
-    assert(r >= 0);
+    readPages(buf.data, alignOff, rdSize);
 
     blockLen = static_cast<int>(*reinterpret_cast<int32_t*>(buf.data + off%4096));
 
@@ -182,19 +626,169 @@ bytes PersistentLog::Read(LogOffset off, int n, Buffer &b, int &blockLen) {
         n = blockLen;
     }
 
-    auto remaining = off+logBlockHeaderSize+n - alignOff+rdSize;
+    int64_t remaining = int64_t(off+logBlockHeaderSize+n) - int64_t(alignOff+rdSize);
     if (remaining > 0) {
         if (remaining % 4096) {
             remaining = 4096*(remaining/4096) + 4096;
         }
         buf = b.Resize(buf.size + remaining);
-        auto r = pread(fd, buf.data+rdSize, remaining, alignOff+rdSize);
-        assert(r >= 0);
+        readPages(buf.data+rdSize, alignOff+rdSize, remaining);
     }
 
     return bytes{buf.data+off%4096+logBlockHeaderSize, n};
 }
 
+// Blocks on disk are read with one request per run of adjacent pages,
+// all of them in flight together. Blocks that turn out to be larger than
+// the pages read for them get a second read, blocks still in the write
+// buffer are copied.
+void PersistentLog::ReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out) {
+    LogReadState st;
+    StartReadBatch(offs, n, b, out, st);
+    FinishReadBatch(st);
+}
+
+void PersistentLog::StartReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out, LogReadState &st) {
+    static thread_local Buffer tb;
+    st.offs = offs;
+    st.n = n;
+    st.b = &b;
+    st.out = out;
+    st.limit = phyTail;
+    st.pos.assign(n, 0);
+    st.len.assign(n, 0);
+    st.runOf.assign(n, -1);
+
+    for (auto i=0; i<n; i++) {
+        if (offs[i] >= st.limit) {
+            auto blk = Read(offs[i], tb);
+            st.pos[i] = st.staged.size();
+            st.len[i] = blk.size;
+            st.staged.append(blk.data, blk.size);
+        } else {
+            st.order.push_back(i);
+        }
+    }
+
+    sort(st.order.begin(), st.order.end(), [offs](int x, int y) { return offs[x] < offs[y]; });
+
+    auto &runs = st.runs;
+    st.total = 0;
+    for (auto i: st.order) {
+        LogOffset start = (offs[i]/ALIGN_SIZE)*ALIGN_SIZE;
+        LogOffset end = ((offs[i]+LOG_READ_GUESS)/ALIGN_SIZE)*ALIGN_SIZE + ALIGN_SIZE;
+        if (runs.size() && start <= runs.back().off + runs.back().size) {
+            auto &r = runs.back();
+            if (end > r.off + r.size) {
+                st.total += end - (r.off + r.size);
+                r.size = end - r.off;
+            }
+        } else {
+            runs.push_back(LogPageRun{start, end-start, st.total});
+            st.total += end-start;
+        }
+        st.runOf[i] = runs.size()-1;
+    }
+
+    st.data = st.total ? b.Alloc(st.total).data : nullptr;
+    startPages(st.data, runs.data(), runs.size(), st.reqs);
+}
+
+void PersistentLog::FinishReadBatch(LogReadState &st) {
+    finishPages(st.reqs, st.limit);
+
+    // Second round for blocks that spill over the pages read so far
+    auto offs = st.offs;
+    auto data = st.data;
+    vector<LogPageRun> extra;
+    auto extraTotal = st.total;
+    for (auto i: st.order) {
+        auto &r = st.runs[st.runOf[i]];
+        auto p = r.pos + offs[i] - r.off;
+        st.len[i] = static_cast<int>(*reinterpret_cast<int32_t*>(data+p));
+        st.pos[i] = p;
+        if (offs[i] + logBlockHeaderSize + st.len[i] > r.off + r.size) {
+            LogOffset start = (offs[i]/ALIGN_SIZE)*ALIGN_SIZE;
+            LogOffset end = ((offs[i]+logBlockHeaderSize+st.len[i]+ALIGN_SIZE-1)/ALIGN_SIZE)*ALIGN_SIZE;
+            extra.push_back(LogPageRun{start, end-start, extraTotal});
+            st.pos[i] = extraTotal + offs[i] - start;
+            extraTotal += end-start;
+        }
+    }
+
+    auto size = extraTotal + st.staged.size();
+    if (size > st.total) {
+        data = st.b->Resize(size).data;
+    }
+
+    if (extra.size()) {
+        vector<IORing::Request> reqs;
+        startPages(data, extra.data(), extra.size(), reqs);
+        finishPages(reqs, st.limit);
+    }
+
+    if (st.staged.size()) {
+        memcpy(data+extraTotal, st.staged.data(), st.staged.size());
+    }
+
+    for (auto i=0; i<st.n; i++) {
+        if (st.runOf[i] < 0) {
+            st.out[i] = bytes(data+extraTotal+st.pos[i], st.len[i]);
+        } else {
+            st.out[i] = bytes(data+st.pos[i]+logBlockHeaderSize, st.len[i]);
+        }
+    }
+}
+
+// Read whole pages through the block cache. Every run of missing pages is
+// read with one request, and only pages below the written tail are cached
+// as the others may still change.
+void PersistentLog::readPages(char *dst, LogOffset off, uint64_t size) {
+    LogPageRun run {off, size, 0};
+    vector<IORing::Request> reqs;
+    LogOffset limit = phyTail;
+    MetricTimer t;
+    startPages(dst, &run, 1, reqs);
+    finishPages(reqs, limit);
+    if (reqs.size()) {
+        metrics.Record(LOG_READ_LATENCY, t);
+    }
+}
+
+// Issue the reads of the pages missing in the cache, reqs must not change
+// until finishPages
+void PersistentLog::startPages(char *data, const LogPageRun *runs, int n, vector<IORing::Request> &reqs) {
+    for (auto i=0; i<n; i++) {
+        auto &r = runs[i];
+        auto missing = false;
+        for (uint64_t pos=0; pos<r.size; pos += ALIGN_SIZE) {
+            auto dst = data+r.pos+pos;
+            if (cache.Lookup(r.off+pos, dst)) {
+                missing = false;
+            } else if (missing) {
+                reqs.back().len += ALIGN_SIZE;
+            } else {
+                reqs.push_back(IORing::Request{dst, uint64_t(ALIGN_SIZE), r.off+pos, false, -1});
+                missing = true;
+            }
+        }
+    }
+
+    ring->Submit(reqs.data(), reqs.size());
+}
+
+void PersistentLog::finishPages(vector<IORing::Request> &reqs, LogOffset limit) {
+    ring->Wait(reqs.data(), reqs.size());
+    for (auto &r: reqs) {
+        assert(r.result >= 0);
+        metrics.Add(LOG_DISK_READS);
+        metrics.Add(LOG_DISK_READ_BYTES, r.result);
+        for (uint64_t pos=0; pos+ALIGN_SIZE <= uint64_t(r.result) && r.off+pos+ALIGN_SIZE <= limit; pos += ALIGN_SIZE) {
+            cache.Insert(r.off+pos, r.buf+pos);
+        }
+    }
+}
+
 bytes PersistentLog::Read(LogOffset off, Buffer &b) {
     int _;
     return Read(off, 0, b, _);
@@ -202,18 +796,192 @@ bytes PersistentLog::Read(LogOffset off, Buffer &b) {
 
 void PersistentLog::TrimLog(LogOffset off) {
     head = off;
-    auto diff = (head - phyHead)/LOG_RECLAIM_SIZE;
+
+    auto last = trims.empty() ? durableTrim : trims.back().first;
+    if (off >= last + LOG_HEAD_PERSIST_SIZE) {
+        trims.push_back(make_pair(off, LogOffset(tail)));
+    }
+
+    while (!trims.empty() && trims.front().second <= phyTail) {
+        if (trims.front().second > durable) {
+            unique_lock<std::mutex> lock(m);
+            syncTo(lock, trims.front().second);
+        }
+        if (peer) {
+            peer->Sync();
+        }
+        durableTrim = trims.front().first;
+        trims.pop_front();
+    }
+
+    // Move the recovery start past trimmed blocks, so a crash does not
+    // bring back chains that were already relocated
+    if (bufStart(durableTrim) >= super.head + LOG_HEAD_PERSIST_SIZE) {
+        super.head = bufStart(durableTrim);
+        writeSuper();
+    }
+
+    auto limit = min(reclaimer.Retire(off), durableTrim);
+    if (limit < phyHead) {
+        return;
+    }
+
+    auto diff = (limit - phyHead)/LOG_RECLAIM_SIZE;
     if (diff) {
         auto n = diff*LOG_RECLAIM_SIZE;
+
+        // Move the recovery start past the space before it is released
+        if (super.head < phyHead + n) {
+            super.head = phyHead + n;
+            writeSuper();
+        }
 #ifdef __linux__
         auto r = fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, phyHead, n);
         assert(r == 0);
 #endif
+        cache.Invalidate(phyHead, phyHead+n);
 
         phyHead += n;
     }
 }
 
+// Returns the end of the valid buffers read at off
+LogOffset PersistentLog::validBufs(char *data, LogOffset off, uint64_t size) {
+    auto sumStart = offsetof(LogBufHeader, magic);
+    uint64_t pos = 0;
+    while (pos+sizeof(LogBufHeader) <= size) {
+        auto hdr = reinterpret_cast<LogBufHeader*>(data+pos);
+        if (hdr->magic != LOG_MAGIC || hdr->offset != off+pos ||
+                pos+hdr->size > size ||
+                off+pos+hdr->size > bufStart(off+pos)+bufSize ||
+                hdr->used < sizeof(LogBufHeader) || hdr->used > hdr->size ||
+                hdr->crc != crc32c(0, data+pos+sumStart, hdr->used-sumStart)) {
+            break;
+        }
+        pos += hdr->size;
+    }
+
+    return off+pos;
+}
+
+// Every thread reads and validates whole parts of the log, the parts are
+// then handed to the callback one at a time in log order
+void PersistentLog::Recover(int nthreads, const LogBlockCallback &fn, LogOffset head, LogOffset from) {
+    mutex rm;
+    condition_variable turn;
+    uint64_t next = 0;
+    atomic<uint64_t> parts(0);
+    atomic<LogOffset> end(UINT64_MAX);
+    auto start = max(LogOffset(super.head), bufStart(from));
+
+    auto worker = [&]() {
+        char *data;
+        auto r = posix_memalign(reinterpret_cast<void **>(&data), ALIGN_SIZE, LOG_RECOVER_READ_SIZE);
+        assert(r == 0);
+
+        while (true) {
+            auto part = parts.fetch_add(1);
+            auto off = start + part*LOG_RECOVER_READ_SIZE;
+            auto valid = off;
+            if (off < end) {
+                auto n = pread(fd, data, LOG_RECOVER_READ_SIZE, off);
+                valid = validBufs(data, off, n > 0 ? n : 0);
+            }
+
+            unique_lock<mutex> lock(rm);
+            turn.wait(lock, [&]() { return next == part; });
+            lock.unlock();
+
+            auto done = off >= end;
+            if (!done) {
+                for (auto b=off; b<valid; b += reinterpret_cast<LogBufHeader*>(data+(b-off))->size) {
+                    auto bdata = data+(b-off);
+                    auto used = reinterpret_cast<LogBufHeader*>(bdata)->used;
+                    for (uint64_t pos=sizeof(LogBufHeader); pos+logBlockHeaderSize <= used; ) {
+                        auto len = *reinterpret_cast<int32_t*>(bdata+pos);
+                        if (len >= 0) {
+                            fn(b+pos, bytes(bdata+pos+logBlockHeaderSize, len));
+                        }
+                        pos += logBlockHeaderSize + abs(len);
+                    }
+                }
+
+                if (valid < off+LOG_RECOVER_READ_SIZE) {
+                    end = valid;
+                    done = true;
+                }
+            }
+
+            lock.lock();
+            next++;
+            turn.notify_all();
+            if (done) {
+                break;
+            }
+        }
+
+        free(data);
+    };
+
+    vector<thread> threads;
+    for (auto i=0; i<max(nthreads, 1); i++) {
+        threads.push_back(thread(worker));
+    }
+
+    for (auto &t: threads) {
+        t.join();
+    }
+
+    lock_guard<mutex> lock(m);
+    this->head = max(LogOffset(super.head), bufStart(head));
+    phyHead = this->head.load();
+    phyTail = max(end.load(), phyHead.load());
+
+    // Buffers past a torn one may have made it to disk when the log was not
+    // synced on every write. Drop them, they would look valid once the
+    // buffers before them are written again.
+    struct stat st;
+    auto r = fstat(fd, &st);
+    assert(r == 0);
+#ifdef __linux__
+    if (uint64_t(st.st_size) > phyTail) {
+        r = fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, phyTail, st.st_size-phyTail);
+        assert(r == 0);
+        r = fdatasync(fd);
+        assert(r == 0);
+    }
+#endif
+    durable = phyTail.load();
+    for (auto i=0; i<LOG_WRITE_BUFFERS; i++) {
+        bufs[i].state = BUF_FREE;
+    }
+    startBuf(phyTail);
+}
+
+LogOffset PersistentLog::bufStart(LogOffset off) {
+    if (off < LOG_BEGIN_OFFSET) {
+        return LOG_BEGIN_OFFSET;
+    }
+    return LOG_BEGIN_OFFSET + ((off-LOG_BEGIN_OFFSET)/bufSize)*bufSize;
+}
+
+// Seal the current buffer and wait until everything reserved before the
+// call is durable, in every mode
+void PersistentLog::Sync() {
+    unique_lock<std::mutex> lock(m);
+    auto &wb = bufs[cur];
+    auto target = wb.offset;
+    if (wb.used > sizeof(LogBufHeader)) {
+        target = sealedEnd(wb);
+        rotate(lock, true);
+    }
+
+    while (phyTail < target) {
+        cond.wait(lock);
+    }
+    syncTo(lock, target);
+}
+
 LogOffset PersistentLog::HeadOffset(){
     return head;
 
@@ -224,6 +992,24 @@ LogOffset PersistentLog::TailOffset() {
 }
 
 PersistentLog::~PersistentLog() {
-    free(buf);
+    Sync();
+    {
+        lock_guard<mutex> lock(m);
+        stopping = true;
+        flushCond.notify_one();
+    }
+    flusher.join();
+
+    super.head = bufStart(head);
+    writeSuper();
+    delete ring;
+    for (auto i=0; i<LOG_WRITE_BUFFERS; i++) {
+        free(frames[i]);
+    }
     close(fd);
 }
+
+// Log types the tables are bound to
+template class BasicHotColdLog<Log>;
+template class BasicHotColdLog<InMemoryLog>;
+template class BasicHotColdLog<PersistentLog>;
@@ -4,18 +4,87 @@
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <vector>
+#include <thread>
 #include <string.h>
 #include "common.h"
+#include "blockcache.h"
+#include "uring.h"
+#include "metrics.h"
 
 using namespace std;
 
 typedef uint64_t LogOffset;
 const uint64_t LOG_MAXSIZE = static_cast<uint64_t>(1024)*1024*1024*100;
 const uint64_t LOG_RECLAIM_SIZE = static_cast<uint64_t>(1024)*1024*64;
+// Head advance between superblock writes, recovery starts at most this far
+// behind the durable head
+const uint64_t LOG_HEAD_PERSIST_SIZE = static_cast<uint64_t>(1024)*1024*4;
 const uint64_t LOG_BEGIN_OFFSET = 4096;
+const int LOG_MAX_READERS = 256;
+// Bytes read past a block offset when its size is not known yet
+const int LOG_READ_GUESS = 512;
+// Mark the offsets of the cold log and of the value log of a HotColdLog
+const LogOffset LOG_COLD_BIT = static_cast<uint64_t>(1) << 63;
+const LogOffset LOG_VALUE_BIT = static_cast<uint64_t>(1) << 62;
+const LogOffset LOG_STREAM_BITS = LOG_COLD_BIT | LOG_VALUE_BIT;
+
+// Size of the parts read by each recovery thread
+const uint64_t LOG_RECOVER_READ_SIZE = static_cast<uint64_t>(1024)*1024*16;
+const uint64_t LOG_MAGIC = 0x676f6c687361706cULL;
+// Write buffers of a persistent log, full buffers are written out in the
+// background while writers fill the next one
+const int LOG_WRITE_BUFFERS = 4;
+// Defaults of the LOG_DURABLE_PERIODIC mode
+const int LOG_SYNC_INTERVAL_MS = 10;
+const uint64_t LOG_SYNC_BYTES = static_cast<uint64_t>(1024)*1024*16;
 
 const int logBlockHeaderSize = 4;
 
+// Counters of LogStats
+enum LogCounter {
+    // Requests to the disk and their bytes, cache hits are not counted
+    LOG_DISK_READS,
+    LOG_DISK_READ_BYTES,
+    LOG_DISK_WRITES,
+    LOG_DISK_WRITE_BYTES,
+    // Reservations that waited for a write buffer to be written out
+    LOG_FLUSH_WAITS,
+    LOG_SYNCS,
+    LOG_COUNTERS,
+};
+
+enum LogHistogram {
+    // Reads of single blocks that missed the cache, batched reads are only
+    // counted
+    LOG_READ_LATENCY,
+    LOG_WRITE_LATENCY,
+    LOG_FLUSH_WAIT_LATENCY,
+    LOG_SYNC_LATENCY,
+    LOG_HISTOGRAMS,
+};
+
+struct LogStats {
+    uint64_t counters[LOG_COUNTERS];
+    Histogram histograms[LOG_HISTOGRAMS];
+
+    LogStats() {
+        memset(counters, 0, sizeof(counters));
+    }
+
+    // Add the metrics to the stats
+    void Add(const Metrics &m) {
+        for (auto i=0; i<LOG_COUNTERS; i++) {
+            counters[i] += m.Counter(i);
+        }
+        for (auto i=0; i<LOG_HISTOGRAMS; i++) {
+            m.GetHistogram(i, histograms[i]);
+        }
+    }
+};
+
 int logBlockSize(int size);
 
 struct LogSpace{
@@ -23,26 +92,179 @@ struct LogSpace{
     char *Buffer;
 };
 
+// Persisted in the first page of a persistent log
+struct LogSuperBlock {
+    uint64_t magic;
+    uint64_t bufSize;
+    // Recovery scans the log from this offset
+    LogOffset head;
+    // Owned by the user of the log
+    uint64_t userData;
+};
+
+// Every write buffer of a persistent log starts with this header. It is
+// disguised as a padding block, so readers and the compactor skip it.
+// The checksum covers the buffer from magic up to used bytes. Buffers
+// take up to wbsize aligned bytes of the log and never cross a multiple
+// of wbsize, a buffer written before it is full ends at the next page.
+struct LogBufHeader {
+    int32_t len;
+    uint32_t crc;
+    uint64_t magic;
+    LogOffset offset;
+    uint32_t used;
+    uint32_t size;
+};
+
+enum LogIOBackend {
+    LOG_IO_SYNC,
+    // Falls back to LOG_IO_SYNC where io_uring is not available
+    LOG_IO_URING,
+};
+
+enum LogDurability {
+    // Every buffer is durable once it is written out (O_SYNC)
+    LOG_DURABLE_SYNC,
+    // Only Sync makes the log durable, WaitDurable returns right away
+    LOG_DURABLE_NONE,
+    // The written buffers are synced every few milliseconds or bytes
+    LOG_DURABLE_PERIODIC,
+    // Writers wait for their blocks with WaitDurable, the waiters share
+    // one fdatasync
+    LOG_DURABLE_GROUP_COMMIT,
+};
+
+// Pages [off, off+size) read to pos in the destination buffer
+struct LogPageRun {
+    LogOffset off;
+    uint64_t size;
+    uint64_t pos;
+};
+
+// A ReadBatch in flight, see Log::StartReadBatch
+struct LogReadState {
+    const LogOffset *offs;
+    int n;
+    Buffer *b;
+    bytes *out;
+
+    char *data;
+    uint64_t total;
+    LogOffset limit;
+    vector<uint64_t> pos;
+    vector<int> len, runOf, order;
+    vector<LogPageRun> runs;
+    string staged;
+    vector<IORing::Request> reqs;
+};
+
+// Receives the blocks found by PersistentLog::Recover in log order
+typedef function<void(LogOffset off, const bytes &block)> LogBlockCallback;
+
+// Epoch based protection of trimmed log space. Readers pin the current
+// epoch while they follow offsets read from the bucket directory, and
+// trimmed space is only handed back to the OS once every reader that could
+// have observed it has unpinned.
+class LogReclaimer {
+public:
+    LogReclaimer();
+
+    int Pin();
+
+    void Unpin(int slot);
+
+    // Record that the log before off is no longer referenced and return the
+    // offset up to which the space can be released safely
+    LogOffset Retire(LogOffset off);
+
+private:
+    uint64_t minPinned();
+
+    struct alignas(64) slot {
+        atomic<uint64_t> epoch;
+    };
+
+    slot slots[LOG_MAX_READERS];
+    atomic<uint64_t> epoch;
+
+    mutex m;
+    deque<pair<uint64_t, LogOffset>> retired;
+    LogOffset retiredOffset, safeOffset;
+};
+
 class Log {
 public:
     virtual ~Log() {}
 
+    virtual int Pin() {
+        return reclaimer.Pin();
+    }
+
+    virtual void Unpin(int slot) {
+        reclaimer.Unpin(slot);
+    }
+
     virtual LogSpace ReserveSpace(int size) = 0;
 
+    // Reserve a run of blocks with one call. Returns the number of blocks
+    // reserved, the caller reserves the remaining ones after finalizing.
+    virtual int ReserveSpace(const int *sizes, int n, LogSpace *spaces) {
+        for (auto i=0; i<n; i++) {
+            spaces[i] = ReserveSpace(sizes[i]);
+        }
+        return n;
+    }
+
     virtual void FinalizeWrite(LogSpace &s) = 0;
 
     virtual bytes Read(LogOffset off, Buffer &b) = 0;
 
     virtual bytes Read(LogOffset off, int n, Buffer &b, int &blockLen) = 0;
 
+    // The block at off where it is kept, for logs in memory. Returns an
+    // empty block for other logs. The caller must hold a pin while it uses
+    // the block.
+    virtual bytes ReadInPlace(LogOffset off) {
+        return bytes();
+    }
+
+    // Read a set of blocks into one buffer, out[i] is the block at offs[i]
+    virtual void ReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out);
+
+    // ReadBatch in two steps. StartReadBatch issues the reads and returns,
+    // the blocks in out are valid once FinishReadBatch returns. Callers can
+    // start more batches or do other work in between.
+    virtual void StartReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out, LogReadState &st) {
+        ReadBatch(offs, n, b, out);
+    }
+
+    virtual void FinishReadBatch(LogReadState &st) {}
+
     virtual void TrimLog(LogOffset off) = 0;
 
+    // Make the blocks reserved so far durable
+    virtual void Sync() {}
+
+    // Wait until the block at off and all blocks before it are durable
+    virtual void WaitDurable(LogOffset off) {}
+
+    // Cache in front of the log reads, if any
+    virtual BlockCache *Cache() {
+        return nullptr;
+    }
+
+    // Add the I/O metrics of the log to s, logs in memory have none
+    virtual void GetStats(LogStats &s) {}
+
     virtual LogOffset HeadOffset() = 0;
 
     virtual LogOffset TailOffset() = 0;
+
+protected:
+    LogReclaimer reclaimer;
 };
 
-class InMemoryLog: public Log {
+class InMemoryLog final: public Log {
 public:
     InMemoryLog();
 
@@ -50,12 +272,21 @@ public:
 
     LogSpace ReserveSpace(int size);
 
+    int ReserveSpace(const int *sizes, int n, LogSpace *spaces);
+
     void FinalizeWrite(LogSpace &s);
 
     bytes Read(LogOffset off, Buffer &b);
 
     bytes Read(LogOffset off, int n, Buffer &b, int &blockLen);
 
+    bytes ReadInPlace(LogOffset off) {
+        auto n = static_cast<int>(*reinterpret_cast<uint32_t*>(logBuf + off));
+        return bytes(logBuf + off + logBlockHeaderSize, n);
+    }
+
+    void ReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out);
+
     void TrimLog(LogOffset off);
 
     LogOffset HeadOffset();
@@ -63,43 +294,310 @@ public:
     LogOffset TailOffset();
 private:
     char *logBuf;
-    uint64_t head, tail;
+    atomic<uint64_t> head, tail;
     uint64_t phyHead;
 };
 
-class PersistentLog: public Log {
+class PersistentLog final: public Log {
 public:
-    PersistentLog(string filepath, int wbsize);
+    // Create a new log, or open an existing one with recover set. An
+    // existing log has to be replayed with Recover before it is written.
+    // Pages read from disk are kept in a cache of cacheSize bytes.
+    PersistentLog(string filepath, int wbsize, bool recover=false, uint64_t cacheSize=0,
+            LogIOBackend io=LOG_IO_URING, LogDurability durability=LOG_DURABLE_SYNC);
 
     ~PersistentLog();
 
     LogSpace ReserveSpace(int size);
 
+    int ReserveSpace(const int *sizes, int n, LogSpace *spaces);
+
     void FinalizeWrite(LogSpace &s);
 
     bytes Read(LogOffset off, Buffer &b);
 
     bytes Read(LogOffset off, int n, Buffer &b, int &blkSz);
 
+    void ReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out);
+
+    void StartReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out, LogReadState &st);
+
+    void FinishReadBatch(LogReadState &st);
+
     void TrimLog(LogOffset off);
 
     LogOffset HeadOffset();
 
     LogOffset TailOffset();
 
+    void Sync();
+
+    // The buffer holding off is written out right away, and its sync is
+    // shared with the other waiters
+    void WaitDurable(LogOffset off);
+
+    // Sync interval of the LOG_DURABLE_PERIODIC mode
+    void SetSyncPeriod(int ms, uint64_t bytes);
+
+    bool AsyncIO() {
+        return ring->Enabled();
+    }
+
+    // Scan the log with nthreads readers and pass every block to fn in log
+    // order, skipping padding. The scan stops at the first buffer that
+    // fails validation, which drops a torn tail. The scan starts from the
+    // persisted head or from the buffer holding from if it is later, and
+    // the log head is raised to the buffer holding head the same way.
+    void Recover(int nthreads, const LogBlockCallback &fn, LogOffset head=0, LogOffset from=0);
+
+    uint64_t UserData() {
+        return super.userData;
+    }
+
+    void SetUserData(uint64_t data);
+
+    // Data relocated between this log and the peer has to be durable in
+    // both before trimmed space is released, trims sync the peer as well
+    void SetPeer(Log *p) {
+        peer = p;
+    }
+
+    BlockCache *Cache() {
+        return &cache;
+    }
+
+    void GetStats(LogStats &s) {
+        s.Add(metrics);
+    }
+
 private:
-    void writeBuf();
+    enum bufState {
+        BUF_FREE,
+        BUF_FILLING,
+        BUF_SEALED,
+    };
+
+    struct writeBuffer {
+        LogOffset offset;
+        // End of the log space of the buffer, it is cut short when the
+        // buffer is sealed before it is full
+        LogOffset end;
+        uint64_t used;
+        // Reservations not finalized yet
+        int rc;
+        bufState state;
+    };
+
+    bool allocate(int size, LogSpace &s);
+    LogSpace reserve(int size, unique_lock<std::mutex> &lock);
+    bool rotate(unique_lock<std::mutex> &lock, bool wait);
+    LogOffset sealedEnd(writeBuffer &wb);
+    bool canStart(LogOffset off);
+    void startBuf(LogOffset off);
+    writeBuffer *bufAt(LogOffset off);
+    void writeBuf(writeBuffer &wb);
+    void syncTo(unique_lock<std::mutex> &lock, LogOffset off);
+    void runFlusher();
+    LogOffset bufStart(LogOffset off);
+    int frameOf(LogOffset off) {
+        return ((off-LOG_BEGIN_OFFSET)/bufSize) % LOG_WRITE_BUFFERS;
+    }
+    char *memOf(LogOffset off) {
+        return frames[frameOf(off)] + (off-bufStart(off));
+    }
+    void writeSuper();
+    void readPages(char *dst, LogOffset off, uint64_t size);
+    void startPages(char *data, const LogPageRun *runs, int n, vector<IORing::Request> &reqs);
+    void finishPages(vector<IORing::Request> &reqs, LogOffset limit);
+    LogOffset validBufs(char *data, LogOffset off, uint64_t size);
 
     int fd;
-    char *buf;
     int bufSize;
-    uint64_t bufOffset;
-
+    // The wbsize aligned part of the log holding off is kept in memory
+    // frameOf(off) until all of its buffers are written out
+    char *frames[LOG_WRITE_BUFFERS];
+    // Buffers are used round robin, cur is being filled
+    writeBuffer bufs[LOG_WRITE_BUFFERS];
+    int cur;
+
+    // Everything before phyTail is on disk
     atomic<uint64_t> head, tail;
     atomic<uint64_t> phyHead, phyTail;
 
     mutex m;
-    condition_variable cond;
-    bool bufClosed;
-    int rc;
+    // Signalled when a buffer was written out, and to wake up the flusher
+    condition_variable cond, flushCond;
+    thread flusher;
+    bool stopping;
+
+    LogDurability durability;
+    // Everything before durable is synced, one thread syncs at a time
+    atomic<uint64_t> durable;
+    bool syncing;
+    int syncInterval;
+    uint64_t syncBytes;
+
+    LogSuperBlock super;
+    // Trimmed offsets and the tail at the time of the trim. Space is only
+    // punched, and recovery only skips it, once the relocated data written
+    // before the trim is on disk.
+    deque<pair<LogOffset, LogOffset>> trims;
+    LogOffset durableTrim;
+    Log *peer;
+
+    BlockCache cache;
+    IORing *ring;
+    // Frames are registered with the ring by index
+    bool framesRegistered;
+
+    Metrics metrics;
+};
+
+// Fresh writes go to the hot log and relocated data to the cold one, so
+// that data which outlived a pass of the compactor is not mixed with data
+// about to be overwritten. Values stored apart from their keys go to a
+// third log. Offsets of the cold and value logs carry LOG_COLD_BIT and
+// LOG_VALUE_BIT, reads, trims and syncs are routed by them. HeadOffset and
+// TailOffset are those of the hot log. The logs are owned by the
+// HotColdLog. Bound to a final log class with L, the calls to the logs are
+// not dispatched virtually.
+template<class L>
+class BasicHotColdLog final: public Log {
+public:
+    BasicHotColdLog(L *hot, L *cold, L *values) {
+        logs[0] = hot;
+        logs[1] = values;
+        logs[2] = cold;
+    }
+
+    ~BasicHotColdLog() {
+        for (auto l: logs) {
+            delete l;
+        }
+    }
+
+    // Pins all logs, the slots are packed into one
+    int Pin() {
+        static_assert(LOG_MAX_READERS <= 256, "pin slots are packed in 8 bits");
+        return logs[0]->Pin() | (logs[1]->Pin() << 8) | (logs[2]->Pin() << 16);
+    }
+
+    void Unpin(int slot) {
+        for (auto i=0; i<3; i++) {
+            logs[i]->Unpin((slot >> (i*8)) & 0xff);
+        }
+    }
+
+    LogSpace ReserveSpace(int size) {
+        return logs[0]->ReserveSpace(size);
+    }
+
+    int ReserveSpace(const int *sizes, int n, LogSpace *spaces) {
+        return logs[0]->ReserveSpace(sizes, n, spaces);
+    }
+
+    LogSpace ReserveColdSpace(int size) {
+        auto s = logs[2]->ReserveSpace(size);
+        s.Offset |= LOG_COLD_BIT;
+        return s;
+    }
+
+    LogSpace ReserveValueSpace(int size) {
+        auto s = logs[1]->ReserveSpace(size);
+        s.Offset |= LOG_VALUE_BIT;
+        return s;
+    }
+
+    void FinalizeWrite(LogSpace &s) {
+        auto inner = LogSpace{s.Offset & ~LOG_STREAM_BITS, s.Buffer};
+        logOf(s.Offset)->FinalizeWrite(inner);
+    }
+
+    bytes Read(LogOffset off, Buffer &b) {
+        return logOf(off)->Read(off & ~LOG_STREAM_BITS, b);
+    }
+
+    bytes Read(LogOffset off, int n, Buffer &b, int &blockLen) {
+        return logOf(off)->Read(off & ~LOG_STREAM_BITS, n, b, blockLen);
+    }
+
+    bytes ReadInPlace(LogOffset off) {
+        return logOf(off)->ReadInPlace(off & ~LOG_STREAM_BITS);
+    }
+
+    void ReadBatch(const LogOffset *offs, int n, Buffer &b, bytes *out);
+
+    void TrimLog(LogOffset off) {
+        logOf(off)->TrimLog(off & ~LOG_STREAM_BITS);
+    }
+
+    void Sync() {
+        for (auto l: logs) {
+            l->Sync();
+        }
+    }
+
+    void WaitDurable(LogOffset off) {
+        logOf(off)->WaitDurable(off & ~LOG_STREAM_BITS);
+    }
+
+    // Wait for everything written to a stream before its tail offset
+    void WaitTailDurable(LogOffset tail) {
+        if (tail & ~LOG_STREAM_BITS) {
+            WaitDurable(tail-1);
+        }
+    }
+
+    BlockCache *Cache() {
+        return logs[0]->Cache();
+    }
+
+    void GetStats(LogStats &s) {
+        for (auto l: logs) {
+            l->GetStats(s);
+        }
+    }
+
+    LogOffset HeadOffset() {
+        return logs[0]->HeadOffset();
+    }
+
+    LogOffset TailOffset() {
+        return logs[0]->TailOffset();
+    }
+
+    LogOffset ColdHeadOffset() {
+        return logs[2]->HeadOffset() | LOG_COLD_BIT;
+    }
+
+    LogOffset ColdTailOffset() {
+        return logs[2]->TailOffset() | LOG_COLD_BIT;
+    }
+
+    LogOffset ValueHeadOffset() {
+        return logs[1]->HeadOffset() | LOG_VALUE_BIT;
+    }
+
+    LogOffset ValueTailOffset() {
+        return logs[1]->TailOffset() | LOG_VALUE_BIT;
+    }
+
+private:
+    // Index in logs of the stream of the offset, offsets carry at most
+    // one stream bit
+    static int streamOf(LogOffset off) {
+        assert((off & LOG_STREAM_BITS) != LOG_STREAM_BITS);
+        if (off & LOG_COLD_BIT) {
+            return 2;
+        }
+        return (off & LOG_VALUE_BIT) ? 1 : 0;
+    }
+
+    L *logOf(LogOffset off) {
+        return logs[streamOf(off)];
+    }
+
+    L *logs[3];
 };
+
+typedef BasicHotColdLog<Log> HotColdLog;
@@ -1,6 +1,11 @@
 #include <iostream>
 #include <vector>
 #include <assert.h>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
 #include "log.h"
 
 using namespace std;
@@ -46,9 +51,365 @@ void test_log_write_read(bool inmemory){
     delete log;
 }
 
+// Reopen a persistent log and check that recovery returns every block in
+// order, including the ones left in the write buffer at shutdown
+void test_log_recover() {
+    auto log = new PersistentLog("test.data", 1024);
+    char buf[1000];
+    vector<LogOffset> off;
+    auto numItems = 100000;
+
+    for (auto i=0; i< numItems; i++) {
+        auto n = sprintf(buf, "%d", i);
+        auto space = log->ReserveSpace(n);
+        memcpy(space.Buffer, buf, n);
+        log->FinalizeWrite(space);
+        off.push_back(space.Offset);
+    }
+    delete log;
+
+    log = new PersistentLog("test.data", 1024, true);
+    auto i = 0;
+    log->Recover(4, [&](LogOffset o, const bytes &block) {
+        auto n = sprintf(buf, "%d", i);
+        assert(i < numItems && o == off[i] && block == bytes(buf, n));
+        i++;
+    });
+    assert(i == numItems);
+
+    // New blocks go after the recovered ones
+    Buffer b;
+    auto n = sprintf(buf, "new");
+    auto space = log->ReserveSpace(n);
+    memcpy(space.Buffer, buf, n);
+    log->FinalizeWrite(space);
+    assert(space.Offset > off.back());
+    assert(log->Read(space.Offset, b) == bytes(buf, n));
+    n = sprintf(buf, "%d", 10);
+    assert(log->Read(off[10], b) == bytes(buf, n));
+    delete log;
+}
+
+void test_block_cache() {
+    char page[ALIGN_SIZE], out[ALIGN_SIZE];
+    auto frames = 4;
+    BlockCache cache(ALIGN_SIZE*CACHE_SHARDS*frames);
+
+    // Pages beyond the capacity push out older ones
+    auto n = CACHE_SHARDS*frames*4;
+    for (auto i=0; i<n; i++) {
+        memset(page, i, ALIGN_SIZE);
+        cache.Insert(uint64_t(i)*ALIGN_SIZE, page);
+    }
+
+    auto found = 0;
+    for (auto i=0; i<n; i++) {
+        if (cache.Lookup(uint64_t(i)*ALIGN_SIZE, out)) {
+            memset(page, i, ALIGN_SIZE);
+            assert(memcmp(page, out, ALIGN_SIZE) == 0);
+            found++;
+        }
+    }
+    assert(found > 0 && found <= CACHE_SHARDS*frames);
+    assert(int(cache.Hits()) == found && int(cache.Misses()) == n-found);
+
+    cache.Invalidate(0, uint64_t(n)*ALIGN_SIZE);
+    for (auto i=0; i<n; i++) {
+        assert(!cache.Lookup(uint64_t(i)*ALIGN_SIZE, out));
+    }
+
+    // Reads of the log are served from the cache the second time
+    auto log = new PersistentLog("test.data", 4096, false, 1024*1024);
+    Buffer b;
+    char buf[100];
+    vector<LogOffset> off;
+    for (auto i=0; i<10000; i++) {
+        auto n = sprintf(buf, "%d", i);
+        auto space = log->ReserveSpace(n);
+        memcpy(space.Buffer, buf, n);
+        log->FinalizeWrite(space);
+        off.push_back(space.Offset);
+    }
+    log->Sync();
+
+    for (auto pass=0; pass<2; pass++) {
+        auto misses = log->Cache()->Misses();
+        for (auto i=0; i<10000; i++) {
+            auto n = sprintf(buf, "%d", i);
+            assert(log->Read(off[i], b) == bytes(buf, n));
+        }
+        assert(pass == 0 || log->Cache()->Misses() == misses);
+    }
+    delete log;
+}
+
+// Batches of reads from several threads, with overlapping batches in flight
+// on each of them
+void test_async_reads(LogIOBackend io) {
+    auto log = new PersistentLog("test.data", 4096, false, 0, io);
+    if (io == LOG_IO_URING && !log->AsyncIO()) {
+        cout<<"io_uring is not available"<<endl;
+    }
+
+    char buf[100];
+    vector<LogOffset> off;
+    auto numItems = 100000;
+    for (auto i=0; i<numItems; i++) {
+        auto n = sprintf(buf, "%d", i);
+        auto space = log->ReserveSpace(n);
+        memcpy(space.Buffer, buf, n);
+        log->FinalizeWrite(space);
+        off.push_back(space.Offset);
+    }
+
+    auto reader = [&](int seed) {
+        char buf[100];
+        Buffer b[2];
+        LogReadState st[2];
+        vector<bytes> out[2];
+        vector<LogOffset> offs[2];
+        vector<int> idx[2];
+        srand(seed);
+        for (auto round=0; round<200; round++) {
+            for (auto j=0; j<2; j++) {
+                idx[j].clear();
+                offs[j].clear();
+                for (auto k=0; k<64; k++) {
+                    idx[j].push_back(rand()%numItems);
+                    offs[j].push_back(off[idx[j].back()]);
+                }
+                out[j].resize(64);
+                st[j] = LogReadState();
+                log->StartReadBatch(offs[j].data(), 64, b[j], out[j].data(), st[j]);
+            }
+
+            for (auto j=0; j<2; j++) {
+                log->FinishReadBatch(st[j]);
+                for (auto k=0; k<64; k++) {
+                    auto n = sprintf(buf, "%d", idx[j][k]);
+                    assert(out[j][k] == bytes(buf, n));
+                }
+            }
+        }
+    };
+
+    vector<thread> threads;
+    for (auto i=0; i<4; i++) {
+        threads.push_back(thread(reader, i));
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+
+    delete log;
+}
+
+void test_write_buffers() {
+    auto bufSize = 4096;
+    auto log = new PersistentLog("test.data", bufSize);
+    Buffer b;
+    char buf[1000];
+
+    // An open reservation keeps its buffer from being written out, the
+    // buffers sealed after it must still be readable
+    auto pinned = log->ReserveSpace(8);
+    memcpy(pinned.Buffer, "pinned!!", 8);
+    vector<LogOffset> off;
+    auto i = 0;
+    while (log->TailOffset() < pinned.Offset + bufSize*(LOG_WRITE_BUFFERS-2)) {
+        auto n = sprintf(buf, "%d", i++);
+        auto space = log->ReserveSpace(n);
+        memcpy(space.Buffer, buf, n);
+        log->FinalizeWrite(space);
+        off.push_back(space.Offset);
+    }
+
+    for (i=0; i<int(off.size()); i++) {
+        auto n = sprintf(buf, "%d", i);
+        assert(log->Read(off[i], b) == bytes(buf, n));
+    }
+    log->FinalizeWrite(pinned);
+    log->Sync();
+    memcpy(buf, "pinned!!", 8);
+    assert(log->Read(pinned.Offset, b) == bytes(buf, 8));
+
+    // Writers run through the buffers while reading back their own blocks
+    vector<thread> writers;
+    for (auto t=0; t<4; t++) {
+        writers.push_back(thread([log, t]() {
+            Buffer b;
+            char buf[100];
+            vector<LogOffset> off;
+            for (auto i=0; i<20000; i++) {
+                auto n = sprintf(buf, "%d-%d", t, i);
+                auto space = log->ReserveSpace(n);
+                memcpy(space.Buffer, buf, n);
+                log->FinalizeWrite(space);
+                off.push_back(space.Offset);
+                n = sprintf(buf, "%d-%d", t, i/2);
+                assert(log->Read(off[i/2], b) == bytes(buf, n));
+            }
+        }));
+    }
+    for (auto &w: writers) {
+        w.join();
+    }
+    delete log;
+}
+
+void test_durability(LogDurability durability) {
+    auto log = new PersistentLog("test.data", 4096, false, 0, LOG_IO_URING, durability);
+    auto nthreads = 4, n = 1000;
+    vector<LogOffset> off(nthreads*n);
+
+    vector<thread> writers;
+    for (auto t=0; t<nthreads; t++) {
+        writers.push_back(thread([log, &off, t, n]() {
+            char buf[100];
+            for (auto i=0; i<n; i++) {
+                auto len = sprintf(buf, "%d-%d", t, i);
+                auto space = log->ReserveSpace(len);
+                memcpy(space.Buffer, buf, len);
+                log->FinalizeWrite(space);
+                log->WaitDurable(space.Offset);
+                off[t*n+i] = space.Offset;
+            }
+        }));
+    }
+    for (auto &w: writers) {
+        w.join();
+    }
+
+    if (durability == LOG_DURABLE_PERIODIC) {
+        this_thread::sleep_for(chrono::milliseconds(LOG_SYNC_INTERVAL_MS*5));
+    }
+
+    // Every block is on disk before the log is closed
+    if (durability != LOG_DURABLE_NONE) {
+        auto reader = new PersistentLog("test.data", 4096, true);
+        vector<LogOffset> found;
+        reader->Recover(1, [&](LogOffset o, const bytes &block) {
+            found.push_back(o);
+        });
+        delete reader;
+        sort(off.begin(), off.end());
+        assert(found == off);
+    }
+    delete log;
+}
+
+void test_torn_tail() {
+    auto log = new PersistentLog("test.data", 4096, false, 0, LOG_IO_URING, LOG_DURABLE_GROUP_COMMIT);
+    char buf[1000];
+    vector<LogOffset> off;
+    auto write = [&](const char *prefix, int i) {
+        auto n = sprintf(buf, "%s-%d", prefix, i);
+        auto space = log->ReserveSpace(n);
+        memcpy(space.Buffer, buf, n);
+        log->FinalizeWrite(space);
+        // Buffers of all sizes
+        if (i%7 == 0) {
+            log->WaitDurable(space.Offset);
+        }
+        off.push_back(space.Offset);
+    };
+
+    for (auto i=0; i<3000; i++) {
+        write("old", i);
+    }
+    delete log;
+
+    // Lose a buffer in the middle, the ones after it are gone with it
+    auto torn = (off[1500]/4096)*4096;
+    auto fd = open("test.data", O_WRONLY);
+    memset(buf, 0, sizeof(buf));
+    auto r = pwrite(fd, buf, sizeof(buf), torn);
+    assert(r == sizeof(buf));
+    close(fd);
+    while (off.back() >= torn) {
+        off.pop_back();
+    }
+
+    log = new PersistentLog("test.data", 4096, true, 0, LOG_IO_URING, LOG_DURABLE_GROUP_COMMIT);
+    log->Recover(4, [&](LogOffset o, const bytes &block) {});
+    for (auto i=0; i<100; i++) {
+        write("new", i);
+    }
+    delete log;
+
+    log = new PersistentLog("test.data", 4096, true);
+    auto i = 0;
+    log->Recover(4, [&](LogOffset o, const bytes &block) {
+        assert(i < int(off.size()) && o == off[i]);
+        i++;
+    });
+    assert(i == int(off.size()));
+    delete log;
+}
+
+// Blocks written to any log of a HotColdLog are read back through the
+// tagged offsets, alone and mixed in one batch, and trims only move the
+// log they belong to
+void test_hot_cold_log() {
+    HotColdLog log(new InMemoryLog(), new InMemoryLog(), new InMemoryLog());
+    Buffer b;
+    char buf[100];
+    vector<LogOffset> off;
+    auto numItems = 10000;
+    LogOffset bits[] = {LOG_COLD_BIT, LOG_VALUE_BIT, 0};
+
+    for (auto i=0; i<numItems; i++) {
+        auto n = sprintf(buf, "%d", i);
+        LogSpace space;
+        if (i%3 == 0) {
+            space = log.ReserveColdSpace(n);
+        } else if (i%3 == 1) {
+            space = log.ReserveValueSpace(n);
+        } else {
+            space = log.ReserveSpace(n);
+        }
+        memcpy(space.Buffer, buf, n);
+        log.FinalizeWrite(space);
+        assert((space.Offset & LOG_STREAM_BITS) == bits[i%3]);
+        off.push_back(space.Offset);
+    }
+
+    for (auto i=0; i<numItems; i++) {
+        auto n = sprintf(buf, "%d", i);
+        assert(log.Read(off[i], b) == bytes(buf, n));
+    }
+
+    vector<bytes> blocks(numItems);
+    log.ReadBatch(off.data(), numItems, b, blocks.data());
+    for (auto i=0; i<numItems; i++) {
+        auto n = sprintf(buf, "%d", i);
+        assert(blocks[i] == bytes(buf, n));
+    }
+
+    auto head = log.HeadOffset();
+    log.TrimLog(off[numItems-1]);
+    log.TrimLog(off[numItems-3]);
+    assert(log.HeadOffset() == head);
+    assert(log.ColdHeadOffset() == off[numItems-1]);
+    assert(log.ValueHeadOffset() == off[numItems-3]);
+    log.TrimLog(off[numItems-2]);
+    assert(log.HeadOffset() == off[numItems-2]);
+}
+
 int main() {
     test_log_write_read(true);
     test_log_write_read(false);
+    test_log_recover();
+    test_block_cache();
+    test_async_reads(LOG_IO_SYNC);
+    test_async_reads(LOG_IO_URING);
+    test_write_buffers();
+    test_durability(LOG_DURABLE_SYNC);
+    test_durability(LOG_DURABLE_NONE);
+    test_durability(LOG_DURABLE_PERIODIC);
+    test_durability(LOG_DURABLE_GROUP_COMMIT);
+    test_torn_tail();
+    test_hot_cold_log();
 
     return 0;
 }
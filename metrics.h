@@ -0,0 +1,199 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Counters and latency histograms are compiled out with -DHT_NO_METRICS
+#ifndef HT_NO_METRICS
+#define USE_METRICS
+#endif
+
+using namespace std;
+
+// Copies of the metrics, reads add them up
+const int METRIC_SLOTS = 16;
+// Histograms have 16 linear sub-buckets per power of two, percentiles are
+// within 6.25% of the recorded values
+const int METRIC_SUB_BITS = 4;
+// Latencies of 2^40 ns or more go into the last bucket
+const int METRIC_MAX_BITS = 40;
+const int METRIC_BUCKETS = (METRIC_MAX_BITS - METRIC_SUB_BITS + 1) << METRIC_SUB_BITS;
+
+// The copy of the metrics updated by the calling thread. The first threads
+// of the process get a copy of their own, the last copy is shared by the
+// threads that come after them.
+inline int metricSlot() {
+    static atomic<int> next(0);
+    static thread_local int slot = min(next++, METRIC_SLOTS-1);
+    return slot;
+}
+
+// Only the shared copy needs atomic increments
+inline void metricAdd(int slot, atomic<uint64_t> &c, uint64_t n) {
+    if (slot < METRIC_SLOTS-1) {
+        c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
+    } else {
+        c.fetch_add(n, memory_order_relaxed);
+    }
+}
+
+// Latencies in nanoseconds
+struct Histogram {
+    vector<uint64_t> counts;
+    uint64_t count, sum, max;
+
+    Histogram() :counts(METRIC_BUCKETS), count(0), sum(0), max(0) {}
+
+    void Merge(const Histogram &o) {
+        for (auto i=0; i<METRIC_BUCKETS; i++) {
+            counts[i] += o.counts[i];
+        }
+        count += o.count;
+        sum += o.sum;
+        max = std::max(max, o.max);
+    }
+
+    double Mean() const {
+        return count ? double(sum)/count : 0;
+    }
+
+    uint64_t Percentile(double p) const {
+        uint64_t rank = ceil(p*count), seen = 0;
+        for (auto i=0; i<METRIC_BUCKETS && count; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(max, Value(i));
+            }
+        }
+        return max;
+    }
+
+    static int Bucket(uint64_t ns) {
+        const uint64_t sub = 1 << METRIC_SUB_BITS;
+        if (ns < sub) {
+            return int(ns);
+        }
+        auto e = min(63 - __builtin_clzll(ns), METRIC_MAX_BITS-1);
+        auto m = min(ns >> (e-METRIC_SUB_BITS), 2*sub-1);
+        return int(sub*(e-METRIC_SUB_BITS+1) + m - sub);
+    }
+
+    // Upper bound of the latencies in bucket i
+    static uint64_t Value(int i) {
+        const int sub = 1 << METRIC_SUB_BITS;
+        if (i < sub) {
+            return i;
+        }
+        auto e = i/sub + METRIC_SUB_BITS - 1;
+        uint64_t m = i%sub + sub;
+        return ((m+1) << (e-METRIC_SUB_BITS)) - 1;
+    }
+};
+
+// Time since construction, for Metrics::Record
+class MetricTimer {
+public:
+#ifdef USE_METRICS
+    MetricTimer() :start(chrono::steady_clock::now()) {}
+
+    uint64_t Elapsed() const {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    chrono::steady_clock::time_point start;
+#else
+    uint64_t Elapsed() const {
+        return 0;
+    }
+#endif
+};
+
+// Counters and latency histograms updated without locks or atomic
+// read-modify-writes, threads update their own copy of them. Reads add the
+// copies up and are only consistent once updates have stopped. The copies
+// are reserved upfront and populated on first use.
+class Metrics {
+public:
+    Metrics(int counters, int histograms) :counters(counters), histograms(histograms), stride(0), data(nullptr) {
+#ifdef USE_METRICS
+        // A cache line aligned stride keeps the slots apart
+        stride = (counters + histograms*histStride + 7) & ~size_t(7);
+        auto p = mmap(0, size(), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        assert(p != MAP_FAILED);
+        data = static_cast<atomic<uint64_t> *>(p);
+#endif
+    }
+
+    Metrics(const Metrics &) = delete;
+
+    ~Metrics() {
+        if (data) {
+            munmap(data, size());
+        }
+    }
+
+    void Add(int counter, uint64_t n=1) {
+#ifdef USE_METRICS
+        auto slot = metricSlot();
+        metricAdd(slot, data[slot*stride + counter], n);
+#endif
+    }
+
+    void Record(int histogram, uint64_t ns) {
+#ifdef USE_METRICS
+        auto slot = metricSlot();
+        auto h = data + slot*stride + counters + histogram*histStride;
+        metricAdd(slot, h[Histogram::Bucket(ns)], 1);
+        metricAdd(slot, h[METRIC_BUCKETS], ns);
+        auto &max = h[METRIC_BUCKETS+1];
+        auto cur = max.load(memory_order_relaxed);
+        while (ns > cur && !max.compare_exchange_weak(cur, ns, memory_order_relaxed)) {}
+#endif
+    }
+
+    void Record(int histogram, const MetricTimer &t) {
+#ifdef USE_METRICS
+        Record(histogram, t.Elapsed());
+#endif
+    }
+
+    uint64_t Counter(int counter) const {
+        uint64_t n = 0;
+        for (auto i=0; data && i<METRIC_SLOTS; i++) {
+            n += data[i*stride + counter].load(memory_order_relaxed);
+        }
+        return n;
+    }
+
+    // Add the histogram to h
+    void GetHistogram(int histogram, Histogram &h) const {
+        for (auto i=0; data && i<METRIC_SLOTS; i++) {
+            auto s = data + i*stride + counters + histogram*histStride;
+            for (auto j=0; j<METRIC_BUCKETS; j++) {
+                auto c = s[j].load(memory_order_relaxed);
+                h.counts[j] += c;
+                h.count += c;
+            }
+            h.sum += s[METRIC_BUCKETS].load(memory_order_relaxed);
+            h.max = std::max(h.max, s[METRIC_BUCKETS+1].load(memory_order_relaxed));
+        }
+    }
+
+private:
+    // Bucket counts, then sum and max
+    static const int histStride = METRIC_BUCKETS + 2;
+
+    size_t size() const {
+        return METRIC_SLOTS*stride*sizeof(atomic<uint64_t>);
+    }
+
+    int counters, histograms;
+    size_t stride;
+    atomic<uint64_t> *data;
+};
@@ -0,0 +1,173 @@
+#include "sharded.h"
+#include <pthread.h>
+#include <sched.h>
+
+// Polls of an empty queue, yielding the core in between, before a worker
+// goes to sleep
+const int SHARD_WORKER_SPINS = 1024;
+
+ShardedHashTable::ShardedHashTable(int shards, int nb, const string &filepath, bool recover,
+        uint64_t cacheSize, LogDurability durability, int bloomBits, uint32_t valueThreshold) :workersRunning(false) {
+    assert(shards > 0);
+    for (auto i=0; i<shards; i++) {
+        auto path = filepath == "" ? filepath : filepath + "." + to_string(i);
+        this->shards.push_back(new HashTable(nb, path, recover, cacheSize/shards, durability, bloomBits, valueThreshold));
+    }
+}
+
+ShardedHashTable::~ShardedHashTable() {
+    StopWorkers();
+    for (auto s: shards) {
+        delete s;
+    }
+}
+
+void ShardedHashTable::StartWorkers(bool pinCores) {
+    if (workersRunning) {
+        return;
+    }
+
+    workersRunning = true;
+    auto cores = thread::hardware_concurrency();
+    for (auto i=0; i<NumShards(); i++) {
+        auto w = new worker();
+        w->sleeping = false;
+        workers.push_back(w);
+        w->t = thread(&ShardedHashTable::runWorker, this, i);
+        if (pinCores && cores) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % cores, &set);
+            pthread_setaffinity_np(w->t.native_handle(), sizeof(set), &set);
+        }
+    }
+}
+
+void ShardedHashTable::StopWorkers() {
+    if (!workersRunning) {
+        return;
+    }
+
+    workersRunning = false;
+    for (auto w: workers) {
+        {
+            lock_guard<mutex> lock(w->m);
+            w->cond.notify_one();
+        }
+        w->t.join();
+        delete w;
+    }
+    workers.clear();
+}
+
+void ShardedHashTable::Submit(Request *reqs, int n) {
+    assert(workersRunning);
+    for (auto i=0; i<n; i++) {
+        auto &r = reqs[i];
+        r.done.store(false, memory_order_relaxed);
+        auto w = workers[ShardOf(r.key)];
+        w->queue.Push(&r);
+        // Pairs with the check of the queue by the worker before it sleeps
+        if (w->sleeping.load()) {
+            lock_guard<mutex> lock(w->m);
+            w->cond.notify_one();
+        }
+    }
+}
+
+void ShardedHashTable::Wait(Request *reqs, int n) {
+    for (auto i=0; i<n; i++) {
+        while (!reqs[i].done.load(memory_order_acquire)) {
+            this_thread::yield();
+        }
+    }
+}
+
+void ShardedHashTable::runWorker(int i) {
+    auto shard = shards[i];
+    auto w = workers[i];
+    auto idle = 0;
+    while (true) {
+        auto r = w->queue.Pop();
+        if (!r) {
+            if (!w->queue.Empty() || ++idle < SHARD_WORKER_SPINS) {
+                this_thread::yield();
+                continue;
+            }
+
+            // Requests pushed after the check see sleeping set and wake
+            // the worker up under the lock
+            unique_lock<mutex> lock(w->m);
+            w->sleeping = true;
+            while (w->queue.Empty() && workersRunning) {
+                w->cond.wait(lock);
+            }
+            w->sleeping = false;
+            idle = 0;
+            if (!workersRunning && w->queue.Empty()) {
+                return;
+            }
+            continue;
+        }
+
+        idle = 0;
+        switch (r->op) {
+        case SHARD_GET: {
+            auto v = shard->Get(r->key, r->b);
+            r->found = v.data != nullptr;
+            r->value = v;
+            break;
+        }
+        case SHARD_SET:
+            r->seq = shard->Set(r->key, r->value);
+            break;
+        case SHARD_DELETE:
+            r->seq = shard->Delete(r->key);
+            break;
+        }
+        r->done.store(true, memory_order_release);
+    }
+}
+
+void ShardedHashTable::StartCompactor(const CompactionOptions &opts) {
+    for (auto s: shards) {
+        s->StartCompactor(opts);
+    }
+}
+
+void ShardedHashTable::StopCompactor() {
+    for (auto s: shards) {
+        s->StopCompactor();
+    }
+}
+
+void ShardedHashTable::Checkpoint() {
+    for (auto s: shards) {
+        s->Checkpoint();
+    }
+}
+
+uint64_t ShardedHashTable::NumBuckets() {
+    uint64_t n = 0;
+    for (auto s: shards) {
+        n += s->NumBuckets();
+    }
+    return n;
+}
+
+float ShardedHashTable::GetWriteAmplification() {
+    uint64_t user = 0, written = 0;
+    for (auto s: shards) {
+        user += s->userBytes;
+        written += s->logBytes;
+    }
+    return user ? float(written)/user : 0;
+}
+
+void ShardedHashTable::Stats() {
+    for (auto i=0; i<NumShards(); i++) {
+        cout<<"Shard "<<i<<endl;
+        shards[i]->Stats();
+    }
+    cout<<"Write amplification: "<<GetWriteAmplification()<<endl;
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "hashtable.h"
+
+// Intrusive multi producer single consumer queue (Vyukov). Producers push
+// with one exchange, the consumer pops without atomic read-modify-writes.
+// T needs an atomic<T *> next member.
+template<class T>
+class MPSCQueue {
+public:
+    MPSCQueue() :head(&stub), tail(&stub) {
+        stub.next = nullptr;
+    }
+
+    void Push(T *n) {
+        n->next.store(nullptr, memory_order_relaxed);
+        auto prev = head.exchange(n);
+        prev->next.store(n, memory_order_release);
+    }
+
+    // Returns null when the queue is empty or the last push has not been
+    // linked in yet. Only the consumer may call it.
+    T *Pop() {
+        auto t = tail;
+        auto next = t->next.load(memory_order_acquire);
+        if (t == &stub) {
+            if (!next) {
+                return nullptr;
+            }
+            tail = next;
+            t = next;
+            next = next->next.load(memory_order_acquire);
+        }
+
+        if (next) {
+            tail = next;
+            return t;
+        }
+
+        if (t != head.load()) {
+            return nullptr;
+        }
+
+        Push(&stub);
+        next = t->next.load(memory_order_acquire);
+        if (next) {
+            tail = next;
+            return t;
+        }
+        return nullptr;
+    }
+
+    // Only the consumer may call it. Pushes in progress count as queued.
+    bool Empty() {
+        return tail->next.load(memory_order_acquire) == nullptr && head.load() == tail;
+    }
+
+private:
+    alignas(64) atomic<T *> head;
+    alignas(64) T *tail;
+    T stub;
+};
+
+// Shared nothing partitioning of a table over independent HashTables, each
+// with its own logs, directory and compactor. Keys are routed by the high
+// bits of their remixed hash. Shards can be called directly, they take
+// their own bucket locks, or through one worker thread per shard that is
+// fed by a lock free queue, so that a shard is only touched by one core.
+class ShardedHashTable {
+public:
+    enum Op {
+        SHARD_GET,
+        SHARD_SET,
+        SHARD_DELETE,
+    };
+
+    struct Request {
+        int op;
+        bytes key;
+        bytes value;
+        // Sequence number in the log of the shard for updates
+        LogOffset seq;
+        // Gets copy the found value to b
+        bool found;
+        Buffer b;
+        atomic<bool> done;
+        atomic<Request *> next;
+
+        Request() :op(SHARD_GET), seq(0), found(false), done(false), next(nullptr) {}
+    };
+
+    // Shard i of a table on disk uses the log files at filepath.i, with
+    // filepath empty the shards are kept in memory. The other parameters
+    // are passed to every shard, cacheSize is split between them.
+    ShardedHashTable(int shards, int nb, const string &filepath, bool recover=false,
+            uint64_t cacheSize=BLOCK_CACHE_SIZE, LogDurability durability=LOG_DURABLE_SYNC,
+            int bloomBits=HT_BLOOM_BITS, uint32_t valueThreshold=0);
+
+    ~ShardedHashTable();
+
+    int NumShards() {
+        return int(shards.size());
+    }
+
+    HashTable *Shard(int i) {
+        return shards[i];
+    }
+
+    int ShardOf(const bytes &key) {
+        // The plain high bits of the hash are the segment tags of the
+        // key, fmix32 decorrelates the shard from them
+        auto h = keyHash<>(key);
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        h ^= h >> 16;
+        return int((uint64_t(h) * shards.size()) >> 32);
+    }
+
+    // Direct calls run on the calling thread. Sequence numbers are those
+    // of the shard of the key.
+    LogOffset Set(const bytes &key, const bytes &value, uint32_t expires=0) {
+        return shards[ShardOf(key)]->Set(key, value, expires);
+    }
+
+    LogOffset Delete(const bytes &key) {
+        return shards[ShardOf(key)]->Delete(key);
+    }
+
+    LogOffset Merge(const bytes &key, const bytes &operand, int id=0) {
+        return shards[ShardOf(key)]->Merge(key, operand, id);
+    }
+
+    void RegisterMergeOperator(int id, MergeOperator *op) {
+        for (auto s: shards) {
+            s->RegisterMergeOperator(id, op);
+        }
+    }
+
+    bytes Get(const bytes &key, Buffer &b) {
+        return shards[ShardOf(key)]->Get(key, b);
+    }
+
+    void WaitDurable(const bytes &key, LogOffset seq) {
+        shards[ShardOf(key)]->WaitDurable(seq);
+    }
+
+    // Start one worker per shard, pinned to a core when pinCores is set
+    void StartWorkers(bool pinCores=true);
+    void StopWorkers();
+
+    // Queue the requests to the workers of their shards. Keys and values
+    // must stay valid until the requests are done.
+    void Submit(Request *reqs, int n);
+
+    // Wait until all of the requests are done
+    void Wait(Request *reqs, int n);
+
+    void Run(Request *reqs, int n) {
+        Submit(reqs, n);
+        Wait(reqs, n);
+    }
+
+    // The options apply to each shard
+    void StartCompactor(const CompactionOptions &opts = CompactionOptions());
+    void StopCompactor();
+
+    void Checkpoint();
+
+    uint64_t NumBuckets();
+    float GetWriteAmplification();
+
+    void Stats();
+
+private:
+    struct alignas(64) worker {
+        MPSCQueue<Request> queue;
+        thread t;
+        atomic<bool> sleeping;
+        mutex m;
+        condition_variable cond;
+    };
+
+    void runWorker(int i);
+
+    vector<HashTable *> shards;
+    vector<worker *> workers;
+    atomic<bool> workersRunning;
+};
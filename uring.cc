@@ -0,0 +1,230 @@
+#include "uring.h"
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+IORing::IORing(int fd, bool enable) :fd(fd), ringFd(-1), fixedFile(false),
+    sqRing(MAP_FAILED), cqRing(MAP_FAILED), inflight(0), waiting(false) {
+    if (!enable) {
+        return;
+    }
+
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ringFd = syscall(__NR_io_uring_setup, IORING_ENTRIES, &p);
+    if (ringFd < 0) {
+        return;
+    }
+
+    sqEntries = p.sq_entries;
+    cqEntries = p.cq_entries;
+    sqRingSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+    sqesSize = p.sq_entries*sizeof(io_uring_sqe);
+
+    // Both rings share one mapping on kernels that support it
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sqRingSize = max(sqRingSize, cqRingSize);
+        cqRingSize = sqRingSize;
+    }
+
+    sqRing = mmap(0, sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    assert(sqRing != MAP_FAILED);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(0, cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        assert(cqRing != MAP_FAILED);
+    }
+    auto s = mmap(0, sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    assert(s != MAP_FAILED);
+    sqes = static_cast<io_uring_sqe *>(s);
+
+    auto sq = static_cast<char *>(sqRing), cq = static_cast<char *>(cqRing);
+    sqHead = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    sqTail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    cqHead = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cqTail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+
+    fixedFile = syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES, &fd, 1) == 0;
+}
+
+IORing::~IORing() {
+    if (ringFd < 0) {
+        return;
+    }
+
+    munmap(sqes, sqesSize);
+    if (cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    munmap(sqRing, sqRingSize);
+    close(ringFd);
+}
+
+bool IORing::RegisterBuffers(const iovec *iovs, int n) {
+    if (ringFd < 0) {
+        return false;
+    }
+    return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iovs, n) == 0;
+}
+
+int IORing::enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    while (true) {
+        auto r = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+        if (r >= 0 || errno != EINTR) {
+            return r;
+        }
+    }
+}
+
+// Hand out the completions in the ring to their requests. The caller must
+// hold the lock, and nobody may wait in the kernel: reaping the completion
+// it waits for would leave it sleeping.
+void IORing::reap() {
+    auto head = *cqHead;
+    auto tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return;
+    }
+
+    for (; head != tail; head++) {
+        auto &cqe = cqes[head & *cqMask];
+        auto req = reinterpret_cast<Request *>(cqe.user_data);
+        req->result = cqe.res;
+        req->done = true;
+        inflight--;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    cond.notify_all();
+}
+
+void IORing::Submit(Request *reqs, int n) {
+    if (ringFd < 0) {
+        for (auto i=0; i<n; i++) {
+            auto &r = reqs[i];
+            r.result = r.write ? pwrite(fd, r.buf, r.len, r.off) : pread(fd, r.buf, r.len, r.off);
+            r.done = true;
+        }
+        return;
+    }
+
+    unique_lock<mutex> lock(m);
+    unsigned queued = 0;
+    for (auto i=0; i<n; i++) {
+        // Completions must never outnumber the completion ring
+        while (inflight + queued >= cqEntries || *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+            if (queued) {
+                auto r = enter(queued, 0, 0);
+                assert(r >= 0);
+                inflight += queued;
+                queued = 0;
+            } else {
+                waitCompletions(lock);
+            }
+        }
+
+        auto &r = reqs[i];
+        r.done = false;
+        auto tail = *sqTail;
+        auto idx = tail & *sqMask;
+        auto &sqe = sqes[idx];
+        memset(&sqe, 0, sizeof(sqe));
+        if (r.write) {
+            sqe.opcode = r.bufIndex >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        } else {
+            sqe.opcode = r.bufIndex >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        }
+        sqe.fd = fixedFile ? 0 : fd;
+        sqe.flags = fixedFile ? IOSQE_FIXED_FILE : 0;
+        sqe.addr = reinterpret_cast<uint64_t>(r.buf);
+        sqe.len = r.len;
+        sqe.off = r.off;
+        sqe.buf_index = r.bufIndex >= 0 ? r.bufIndex : 0;
+        sqe.user_data = reinterpret_cast<uint64_t>(&r);
+        sqArray[idx] = idx;
+        __atomic_store_n(sqTail, tail+1, __ATOMIC_RELEASE);
+        queued++;
+    }
+
+    if (queued) {
+        auto r = enter(queued, 0, 0);
+        assert(r >= 0);
+        inflight += queued;
+    }
+}
+
+// Block until completions arrive. A single thread waits in the kernel and
+// reaps for everybody, the others wait for it to pass them on.
+void IORing::waitCompletions(unique_lock<mutex> &lock) {
+    if (waiting) {
+        cond.wait(lock);
+        return;
+    }
+
+    waiting = true;
+    lock.unlock();
+    enter(0, 1, IORING_ENTER_GETEVENTS);
+    lock.lock();
+    waiting = false;
+    reap();
+    cond.notify_all();
+}
+
+void IORing::Wait(Request *reqs, int n) {
+    if (ringFd < 0) {
+        return;
+    }
+
+    unique_lock<mutex> lock(m);
+    while (true) {
+        if (!waiting) {
+            reap();
+        }
+
+        auto done = true;
+        for (auto i=0; i<n && done; i++) {
+            done = reqs[i].done;
+        }
+
+        if (done) {
+            return;
+        }
+
+        waitCompletions(lock);
+    }
+}
+
+#else
+
+IORing::IORing(int fd, bool enable) :fd(fd), ringFd(-1), fixedFile(false), inflight(0), waiting(false) {}
+
+IORing::~IORing() {}
+
+bool IORing::RegisterBuffers(const iovec *iovs, int n) {
+    return false;
+}
+
+void IORing::Submit(Request *reqs, int n) {
+    for (auto i=0; i<n; i++) {
+        auto &r = reqs[i];
+        r.result = r.write ? pwrite(fd, r.buf, r.len, r.off) : pread(fd, r.buf, r.len, r.off);
+        r.done = true;
+    }
+}
+
+void IORing::Wait(Request *reqs, int n) {}
+
+#endif
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <sys/uio.h>
+#include "common.h"
+
+using namespace std;
+
+const unsigned IORING_ENTRIES = 256;
+
+// io_uring on the raw system calls, bound to a single file that is
+// registered with the ring. The ring is shared by all threads: submission
+// and reaping of completions are serialized, and one thread at a time
+// blocks in the kernel for the completions of everybody. Without io_uring
+// support requests are served with pread and pwrite when submitted.
+class IORing {
+public:
+    struct Request {
+        char *buf;
+        uint64_t len;
+        uint64_t off;
+        bool write;
+        // Index of the registered buffer holding buf, or -1
+        int bufIndex;
+        int result;
+        bool done;
+    };
+
+    IORing(int fd, bool enable=true);
+
+    ~IORing();
+
+    bool Enabled() {
+        return ringFd >= 0;
+    }
+
+    // Register the buffers used with Request::bufIndex, returns false if
+    // the kernel refused them
+    bool RegisterBuffers(const iovec *iovs, int n);
+
+    // Queue the requests, they are passed to the kernel with one call
+    void Submit(Request *reqs, int n);
+
+    // Wait until all of the requests have completed
+    void Wait(Request *reqs, int n);
+
+    void Run(Request *reqs, int n) {
+        Submit(reqs, n);
+        Wait(reqs, n);
+    }
+
+private:
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+    void reap();
+    void waitCompletions(unique_lock<mutex> &lock);
+
+    int fd, ringFd;
+    bool fixedFile;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+    unsigned sqEntries, cqEntries;
+
+    mutex m;
+    condition_variable cond;
+    unsigned inflight;
+    bool waiting;
+};